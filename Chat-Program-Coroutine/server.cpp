@@ -0,0 +1,672 @@
+#include <iostream>
+#include <cstring>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "../common/frame.h"
+#include "../common/pool.h"
+
+using namespace std;
+
+constexpr int PORT = 1500;
+constexpr int BUF_SIZE = 1024;
+constexpr int READ_SIZE = 16 * 1024; // bytes requested per read(), may hold many frames
+constexpr int MAX_EVENTS = 128;
+constexpr int MAX_IOV = 64;      // queued messages per writev
+constexpr int READ_BUDGET = 8;   // read() calls per wakeup before a connection yields
+
+atomic<bool> stop{false};
+
+// Coroutine frames are carved from this pool instead of the heap. The
+// sized delete hands the frame size back, so its class is found again.
+// A frame bigger than the largest class comes from the heap.
+SizeClassPool framePool;
+
+struct PooledFrame
+{
+    static void *operator new(size_t size)
+    {
+        int c = SizeClassPool::classOf(size);
+        if (c < 0)
+            return ::operator new(size);
+        void *p = framePool[c].allocate();
+        if (!p)
+            throw bad_alloc();
+        return p;
+    }
+
+    static void operator delete(void *p, size_t size)
+    {
+        int c = SizeClassPool::classOf(size);
+        if (c < 0)
+            ::operator delete(p);
+        else
+            framePool[c].free(p);
+    }
+};
+
+// A lazily started coroutine that produces a T for the coroutine awaiting
+// it. When it finishes it resumes that coroutine directly (symmetric
+// transfer), so a chain of awaits does not grow the stack.
+template <typename T>
+class Task
+{
+public:
+    struct promise_type : PooledFrame
+    {
+        T value{};
+        coroutine_handle<> continuation;
+
+        Task get_return_object() { return Task(coroutine_handle<promise_type>::from_promise(*this)); }
+        suspend_always initial_suspend() noexcept { return {}; }
+
+        struct FinalAwaiter
+        {
+            bool await_ready() noexcept { return false; }
+            coroutine_handle<> await_suspend(coroutine_handle<promise_type> h) noexcept
+            {
+                return h.promise().continuation;
+            }
+            void await_resume() noexcept {}
+        };
+        FinalAwaiter final_suspend() noexcept { return {}; }
+
+        void return_value(T v) { value = move(v); }
+        void unhandled_exception() { terminate(); }
+    };
+
+    Task(Task &&other) noexcept : h(exchange(other.h, nullptr)) {}
+    Task(const Task &) = delete;
+    ~Task()
+    {
+        if (h)
+            h.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    coroutine_handle<> await_suspend(coroutine_handle<> awaiter) noexcept
+    {
+        h.promise().continuation = awaiter;
+        return h;
+    }
+    T await_resume() { return move(h.promise().value); }
+
+private:
+    explicit Task(coroutine_handle<promise_type> handle) : h(handle) {}
+    coroutine_handle<promise_type> h;
+};
+
+// A coroutine nobody awaits: it starts right away and frees its own frame
+// when it returns
+struct Detached
+{
+    struct promise_type : PooledFrame
+    {
+        Detached get_return_object() { return {}; }
+        suspend_never initial_suspend() noexcept { return {}; }
+        suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { terminate(); }
+    };
+};
+
+// What the scheduler knows about one fd: the coroutines waiting on it
+struct IoState
+{
+    int fd = -1;
+    coroutine_handle<> reader; // waiting for EPOLLIN
+    coroutine_handle<> writer; // waiting for EPOLLOUT
+    int budget = READ_BUDGET;  // reads left before the reader must yield
+};
+
+// Single-threaded epoll loop that resumes whichever coroutine is waiting
+// on a ready fd. Sockets are watched edge-triggered, so a coroutine only
+// waits after its syscall said EAGAIN; with one thread no edge can slip by
+// in between.
+class Scheduler
+{
+public:
+    bool init()
+    {
+        epollfd = epoll_create1(0);
+        if (epollfd < 0)
+        {
+            perror("epoll_create1");
+            return false;
+        }
+        ioPool.init(sizeof(IoState), false);
+        return true;
+    }
+
+    IoState *watch(int fd, uint32_t events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+    {
+        IoState *io = new (ioPool.allocate()) IoState();
+        io->fd = fd;
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.ptr = io;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+        {
+            perror("epoll_ctl: EPOLL_CTL_ADD");
+            ioPool.free(io);
+            return nullptr;
+        }
+        return io;
+    }
+
+    // Stop watching. The state is freed after the current batch of events,
+    // which may still mention it.
+    void retire(IoState *io)
+    {
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, io->fd, nullptr);
+        io->fd = -1;
+        io->reader = nullptr;
+        io->writer = nullptr;
+        retired.push_back(io);
+    }
+
+    void yield(coroutine_handle<> h) { ready.push_back(h); }
+
+    void run()
+    {
+        epoll_event events[MAX_EVENTS];
+        while (!stop.load())
+        {
+            int n = epoll_wait(epollfd, events, MAX_EVENTS, ready.empty() ? -1 : 0);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                perror("epoll_wait");
+                break;
+            }
+
+            for (int i = 0; i < n; i++)
+            {
+                IoState *io = static_cast<IoState *>(events[i].data.ptr);
+                uint32_t ev = events[i].events;
+                // The writer first: resuming the reader may end the connection
+                if ((ev & (EPOLLOUT | EPOLLHUP | EPOLLERR)) && io->writer)
+                    exchange(io->writer, nullptr).resume();
+                if ((ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && io->reader)
+                    exchange(io->reader, nullptr).resume();
+            }
+
+            runYielded();
+            reclaim();
+        }
+    }
+
+    // Resume everything that yielded, including whatever yields meanwhile
+    void drain()
+    {
+        while (!ready.empty())
+            runYielded();
+        reclaim();
+    }
+
+    SlabPool ioPool;
+
+private:
+    void runYielded()
+    {
+        scratch.swap(ready);
+        for (coroutine_handle<> h : scratch)
+            h.resume();
+        scratch.clear();
+    }
+
+    void reclaim()
+    {
+        for (IoState *io : retired)
+        {
+            io->~IoState();
+            ioPool.free(io);
+        }
+        retired.clear();
+    }
+
+    int epollfd = -1;
+    vector<coroutine_handle<>> ready, scratch;
+    vector<IoState *> retired;
+};
+
+Scheduler scheduler;
+
+struct Readable
+{
+    IoState &io;
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(coroutine_handle<> h) noexcept { io.reader = h; }
+    void await_resume() noexcept { io.budget = READ_BUDGET; }
+};
+
+struct Writable
+{
+    IoState &io;
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(coroutine_handle<> h) noexcept { io.writer = h; }
+    void await_resume() noexcept {}
+};
+
+// Go to the back of the line so other connections get a turn
+struct Yield
+{
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(coroutine_handle<> h) { scheduler.yield(h); }
+    void await_resume() noexcept {}
+};
+
+// Each operation tries the syscall first and suspends only on EAGAIN
+Task<ssize_t> async_read(IoState &io, void *buf, size_t len)
+{
+    while (true)
+    {
+        ssize_t n = read(io.fd, buf, len);
+        if (n >= 0)
+            co_return n;
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            co_return -1;
+        co_await Readable{io};
+    }
+}
+
+// Returns -1 once the server is stopping
+Task<int> async_accept(IoState &io)
+{
+    while (!stop.load())
+    {
+        int fd = accept4(io.fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd >= 0)
+            co_return fd;
+        if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            perror("accept4");
+        co_await Readable{io};
+    }
+    co_return -1;
+}
+
+// One serialized message, shared by every queue it is in
+typedef shared_ptr<const string> MessagePtr;
+
+enum class ReadStatus
+{
+    Frame,
+    Closed,
+    Oversized,
+    Failed
+};
+
+struct Conn
+{
+    IoState *io = nullptr;
+    size_t index = 0; // position in clients
+    string name;
+    FrameParser parser;
+    FrameMode encoding = FrameMode::Detect; // fixed by the client's first byte
+    bool eof = false;
+
+    deque<MessagePtr> queue; // waiting for the socket to take them
+    size_t offset = 0;       // bytes of queue.front() already sent
+    bool writing = false;    // the writer coroutine is running or waiting
+
+    Task<ReadStatus> read_frame(const char *&frame, size_t &length);
+    void send(const MessagePtr &msg);
+};
+
+vector<Conn *> clients;
+unsigned long long messagesIn = 0, messagesOut = 0;
+
+// Next complete frame, reading as much as it takes
+Task<ReadStatus> Conn::read_frame(const char *&frame, size_t &length)
+{
+    while (true)
+    {
+        FrameParser::Result res = parser.next(frame, length);
+        if (res == FrameParser::Frame)
+            co_return ReadStatus::Frame;
+        if (res == FrameParser::Error)
+            co_return ReadStatus::Oversized;
+        if (eof)
+            co_return ReadStatus::Closed;
+
+        // A client that keeps sending must not starve the others
+        if (--io->budget < 0)
+        {
+            co_await Yield{};
+            io->budget = READ_BUDGET;
+        }
+
+        // Receive straight into the parser; one read may carry many frames
+        ssize_t n = co_await async_read(*io, parser.prepare(READ_SIZE), READ_SIZE);
+        if (n < 0)
+            co_return ReadStatus::Failed;
+        if (n == 0)
+        {
+            // Older clients send "#" without a newline and close right away
+            eof = true;
+            co_return parser.finish(frame, length) == FrameParser::Frame ? ReadStatus::Frame
+                                                                          : ReadStatus::Closed;
+        }
+        parser.commit(n);
+    }
+}
+
+// Runs while the connection has queued output
+Detached writer(Conn &c)
+{
+    c.writing = true;
+    while (!c.queue.empty())
+    {
+        iovec iov[MAX_IOV];
+        int iovcnt = 0;
+        for (size_t i = 0; i < c.queue.size() && iovcnt < MAX_IOV; i++, iovcnt++)
+        {
+            size_t skip = (i == 0) ? c.offset : 0;
+            iov[iovcnt].iov_base = const_cast<char *>(c.queue[i]->data()) + skip;
+            iov[iovcnt].iov_len = c.queue[i]->size() - skip;
+        }
+
+        ssize_t n = writev(c.io->fd, iov, iovcnt);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                co_await Writable{*c.io};
+                continue;
+            }
+
+            // Peer is gone. Drop what is queued; the reader sees EOF and
+            // ends the session.
+            c.queue.clear();
+            c.offset = 0;
+            shutdown(c.io->fd, SHUT_RDWR);
+            break;
+        }
+
+        size_t left = n;
+        while (left > 0)
+        {
+            size_t avail = c.queue.front()->size() - c.offset;
+            if (left < avail)
+            {
+                c.offset += left;
+                break;
+            }
+            left -= avail;
+            c.offset = 0;
+            c.queue.pop_front();
+            messagesOut++;
+        }
+    }
+    c.writing = false;
+}
+
+void Conn::send(const MessagePtr &msg)
+{
+    // Nothing is sent before the client's first byte fixes its encoding
+    if (encoding == FrameMode::Detect || !io)
+        return;
+    queue.push_back(msg);
+    if (!writing)
+        writer(*this);
+}
+
+// Build the per-encoding variants of a line once and share them
+struct Broadcast
+{
+    string line; // without the trailing '\n'
+    MessagePtr text, binary;
+
+    explicit Broadcast(string l) : line(move(l)) {}
+
+    const MessagePtr &forEncoding(FrameMode mode)
+    {
+        MessagePtr &slot = (mode == FrameMode::Binary) ? binary : text;
+        if (!slot)
+        {
+            string out;
+            appendFrame(out, mode, line.data(), line.size());
+            slot = make_shared<const string>(move(out));
+        }
+        return slot;
+    }
+};
+
+void broadcastMessage(Conn &sender, const string &body)
+{
+    Broadcast others(sender.name + body);
+    Broadcast self("You" + body);
+
+    for (Conn *c : clients)
+    {
+        Broadcast &b = (c == &sender) ? self : others;
+        c->send(b.forEncoding(c->encoding));
+    }
+}
+
+void broadcastServer(const string &text)
+{
+    Broadcast msg("[SERVER]: " + text);
+    for (Conn *c : clients)
+        c->send(msg.forEncoding(c->encoding));
+}
+
+// One client, start to finish
+Detached session(int fd)
+{
+    Conn c;
+    c.io = scheduler.watch(fd);
+    if (!c.io)
+    {
+        close(fd);
+        co_return;
+    }
+    c.index = clients.size();
+    clients.push_back(&c);
+
+    const char *frame;
+    size_t length;
+    const char *reason = "closed connection";
+    while (true)
+    {
+        ReadStatus status = co_await c.read_frame(frame, length);
+        if (status == ReadStatus::Oversized)
+            reason = "sent an oversized frame";
+        else if (status == ReadStatus::Failed)
+            reason = "error on recv";
+        if (status != ReadStatus::Frame)
+            break;
+
+        messagesIn++;
+        // Replies follow the encoding the client picked
+        c.encoding = c.parser.encoding();
+
+        // Check for disconnect message
+        if (length > 0 && frame[0] == '#')
+        {
+            reason = "sent disconnect";
+            break;
+        }
+
+        if (length >= 5 && strncmp(frame, "JOIN ", 5) == 0)
+        {
+            c.name.assign(frame + 5, length - 5);
+            broadcastMessage(c, " has joined the chat.");
+            cout << "\nClient " << fd << "[" << c.name << "]: connected (total: " << clients.size() << ")\n";
+            continue;
+        }
+
+        string text(frame, length);
+        cout << "\nClient " << fd << "[" << c.name << "]" << " message: " << text << "\n";
+        broadcastMessage(c, ": " + text);
+    }
+
+    broadcastMessage(c, " has left the chat.");
+
+    // Leave the broadcast list; the last client takes this one's place
+    clients[c.index] = clients.back();
+    clients[c.index]->index = c.index;
+    clients.pop_back();
+    cout << "\nClient " << fd << "[" << c.name << "]" << " " << reason << " (total: " << clients.size() << ")\n";
+
+    // A writer still waiting for EPOLLOUT goes with the connection
+    if (c.io->writer)
+        c.io->writer.destroy();
+    scheduler.retire(c.io);
+    c.io = nullptr;
+    close(fd);
+}
+
+Detached acceptor(IoState &listen)
+{
+    while (true)
+    {
+        int fd = co_await async_accept(listen);
+        if (fd < 0)
+            break;
+        session(fd);
+    }
+}
+
+IoState *stdinIo = nullptr;
+
+// Server input → broadcast. stdin is watched level-triggered and read once
+// per wakeup, since it stays blocking (it may be the operator's terminal).
+Detached operatorInput(IoState &io)
+{
+    FrameParser lines(FrameMode::Text);
+    char buffer[BUF_SIZE];
+    while (true)
+    {
+        co_await Readable{io};
+        if (stop.load())
+            break;
+        ssize_t n = read(io.fd, buffer, sizeof(buffer));
+        if (n <= 0)
+            break; // stdin closed, stop watching it
+
+        lines.feed(buffer, n);
+        const char *frame;
+        size_t length;
+        while (lines.next(frame, length) == FrameParser::Frame)
+        {
+            if (length > 0)
+                broadcastServer(string(frame, length));
+        }
+    }
+    scheduler.retire(&io);
+    stdinIo = nullptr;
+}
+
+void handle_sigint(int)
+{
+    cout << "\nSIGINT received, shutting down server...\n";
+    stop.store(true);
+}
+
+int main()
+{
+    signal(SIGINT, handle_sigint);
+    signal(SIGPIPE, SIG_IGN);
+
+    //Setup server socket
+    sockaddr_in server_addr{};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    server_addr.sin_port = htons(PORT);
+
+    int serverSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (serverSocket < 0)
+    {
+        perror("socket");
+        return 1;
+    }
+
+    int opt = 1;
+    setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    if (bind(serverSocket, (sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+        perror("bind");
+        return 1;
+    }
+
+    if (listen(serverSocket, 128) < 0)
+    {
+        perror("listen");
+        return 1;
+    }
+
+    framePool.init(false);
+    if (!scheduler.init())
+        return 1;
+    IoState *listenIo = scheduler.watch(serverSocket, EPOLLIN | EPOLLET);
+    if (!listenIo)
+        return 1;
+    // Fails when stdin is /dev/null or a file; the server runs without it
+    stdinIo = scheduler.watch(STDIN_FILENO, EPOLLIN);
+
+    cout << "Server (coroutines) listening on port " << PORT << "...\n";
+
+    acceptor(*listenIo);
+    if (stdinIo)
+        operatorInput(*stdinIo);
+
+    scheduler.run();
+
+    // Notify clients about shutdown (best effort), then let every session
+    // run to its end: with the socket shut down its next read sees EOF
+    vector<Conn *> remaining = clients;
+    for (Conn *c : remaining)
+    {
+        if (c->encoding != FrameMode::Detect)
+        {
+            string bye;
+            appendFrame(bye, c->encoding, "#", 1);
+            ::send(c->io->fd, bye.data(), bye.size(), MSG_DONTWAIT);
+        }
+        shutdown(c->io->fd, SHUT_RDWR);
+    }
+    for (Conn *c : remaining)
+    {
+        if (c->io && c->io->reader)
+            exchange(c->io->reader, nullptr).resume();
+    }
+    if (listenIo->reader)
+        exchange(listenIo->reader, nullptr).resume();
+    if (stdinIo && stdinIo->reader)
+        exchange(stdinIo->reader, nullptr).resume();
+    scheduler.drain();
+    close(serverSocket);
+
+    uint64_t hits = 0, misses = 0;
+    for (int c = 0; c < SizeClassPool::CLASSES; c++)
+    {
+        hits += framePool[c].hits.get();
+        misses += framePool[c].misses.get();
+    }
+    cout << "messages in: " << messagesIn << ", messages out: " << messagesOut
+         << ", coroutine frames: " << hits + misses;
+    if (hits + misses > 0)
+        cout << " (" << 100.0 * hits / (hits + misses) << "% reused from the pool)";
+    cout << "\nServer shutdown complete.\n";
+}
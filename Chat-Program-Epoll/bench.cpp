@@ -0,0 +1,358 @@
+#include <iostream>
+#include <cstring>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/epoll.h>
+
+using namespace std;
+
+// Fan-out throughput benchmark for the epoll server.
+//
+// Opens `clients` connections, JOINs them all, then lets the first `senders`
+// of them send chat lines in a closed loop: at most `window` lines in flight
+// per sender, and a slot is freed only by the sender's own "You: ..." echo,
+// not by other traffic it receives. Output the socket does not take at once
+// is kept and finished on EPOLLOUT. Every line received by any client is
+// counted, so the result is the number of messages per second the server
+// delivers. With -R the clients are spread
+// round-robin over that many rooms, so each line fans out to one room only.
+// With -p the clients are spread round-robin over several ports, e.g. the
+// nodes of a federated cluster, and the result is the cluster's total.
+
+constexpr int PORT = 1500;
+constexpr int BUF_SIZE = 16384;
+constexpr int MAX_EVENTS = 256;
+
+struct BenchConn
+{
+    int fd = -1;
+    bool sender = false;
+    int inFlight = 0;       // lines queued whose echo has not come back
+    string out;             // output not yet taken by the socket
+    size_t outOffset = 0;   // ... of which this much has been sent
+    bool watchingOut = false;
+    size_t lineLength = 0;  // the line being received: its length so far
+    char lineHead[5] = {};  // ... and its first bytes
+};
+
+atomic<bool> measuring{false};
+atomic<bool> stop{false};
+atomic<long long> delivered{0};
+atomic<long long> sent{0};
+
+void set_non_blocking(int socket)
+{
+    int flags = fcntl(socket, F_GETFL, 0);
+
+    if (flags == -1)
+    {
+        perror("fcntl F_GETFL");
+        return;
+    }
+
+    if (fcntl(socket, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        perror("fcntl F_SETFL");
+        return;
+    }
+}
+
+int connectTo(const sockaddr_in &addr)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    if (connect(fd, (const sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// Send as much queued output as the socket takes, and ask for EPOLLOUT
+// while some is left
+void flushOut(int epollfd, uint32_t index, BenchConn &c)
+{
+    while (c.outOffset < c.out.size())
+    {
+        ssize_t n = send(c.fd, c.out.data() + c.outOffset, c.out.size() - c.outOffset, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break; // EAGAIN: finished on EPOLLOUT; an error shows up on recv()
+        }
+        c.outOffset += n;
+    }
+    if (c.outOffset == c.out.size())
+    {
+        c.out.clear();
+        c.outOffset = 0;
+    }
+
+    bool wantOut = !c.out.empty();
+    if (wantOut != c.watchingOut)
+    {
+        c.watchingOut = wantOut;
+        epoll_event ev{};
+        ev.events = EPOLLIN | (wantOut ? (uint32_t)EPOLLOUT : 0);
+        ev.data.u32 = index;
+        epoll_ctl(epollfd, EPOLL_CTL_MOD, c.fd, &ev);
+    }
+}
+
+// Queue lines until the sender's window is full. A queued line is in
+// flight: the window, not the socket, bounds how much is kept.
+void fillWindow(int epollfd, uint32_t index, BenchConn &c, int window)
+{
+    static const char line[] = "benchmark message payload\n";
+    while (c.inFlight < window)
+    {
+        c.out.append(line, sizeof(line) - 1);
+        c.inFlight++;
+        if (measuring.load(memory_order_relaxed))
+            sent.fetch_add(1, memory_order_relaxed);
+    }
+    flushOut(epollfd, index, c);
+}
+
+void worker(vector<BenchConn> conns, int window)
+{
+    int epollfd = epoll_create1(0);
+    if (epollfd == -1)
+    {
+        perror("epoll_create1");
+        return;
+    }
+
+    for (size_t i = 0; i < conns.size(); i++)
+    {
+        set_non_blocking(conns[i].fd);
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u32 = (uint32_t)i;
+        epoll_ctl(epollfd, EPOLL_CTL_ADD, conns[i].fd, &ev);
+    }
+
+    epoll_event events[MAX_EVENTS];
+    char buffer[BUF_SIZE];
+    bool started = false;
+
+    while (!stop.load())
+    {
+        // Prime every sender's window once the measurement begins
+        if (!started && measuring.load())
+        {
+            started = true;
+            for (size_t i = 0; i < conns.size(); i++)
+            {
+                if (conns[i].sender)
+                    fillWindow(epollfd, (uint32_t)i, conns[i], window);
+            }
+        }
+
+        int nready = epoll_wait(epollfd, events, MAX_EVENTS, 100);
+        if (nready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < nready; i++)
+        {
+            uint32_t index = events[i].data.u32;
+            BenchConn &c = conns[index];
+            if (events[i].events & EPOLLOUT)
+                flushOut(epollfd, index, c);
+            if (!(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                continue;
+
+            ssize_t n = recv(c.fd, buffer, sizeof(buffer), 0);
+            if (n <= 0)
+            {
+                if (n < 0 && (errno == EAGAIN || errno == EINTR))
+                    continue;
+                epoll_ctl(epollfd, EPOLL_CTL_DEL, c.fd, nullptr);
+                continue;
+            }
+
+            // A heartbeat PING is answered and not counted. Lines may be split
+            // across reads, so the start of the current one is carried over.
+            long long lines = 0;
+            int echoes = 0;
+            bool pinged = false;
+            for (ssize_t k = 0; k < n; k++)
+            {
+                if (buffer[k] != '\n')
+                {
+                    if (c.lineLength < sizeof(c.lineHead))
+                        c.lineHead[c.lineLength] = buffer[k];
+                    c.lineLength++;
+                    continue;
+                }
+                if (c.lineLength == 4 && memcmp(c.lineHead, "PING", 4) == 0)
+                {
+                    pinged = true;
+                }
+                else
+                {
+                    lines++;
+                    // "You: ..." in the lobby, "You [#room]: ..." elsewhere
+                    if (c.lineLength >= 5 && (memcmp(c.lineHead, "You: ", 5) == 0 ||
+                                              memcmp(c.lineHead, "You [", 5) == 0))
+                        echoes++;
+                }
+                c.lineLength = 0;
+            }
+            if (pinged)
+            {
+                c.out.append("PONG\n");
+                flushOut(epollfd, index, c);
+            }
+
+            // Each of its own lines echoed back to a sender frees a window
+            // slot. The echo is a delivery as well, so it is counted like any
+            // other line.
+            if (c.sender && started)
+            {
+                c.inFlight = max(0, c.inFlight - echoes);
+                fillWindow(epollfd, index, c, window);
+            }
+
+            if (measuring.load(memory_order_relaxed))
+                delivered.fetch_add(lines, memory_order_relaxed);
+        }
+    }
+
+    for (auto &c : conns)
+    {
+        send(c.fd, "#", 1, MSG_NOSIGNAL);
+        close(c.fd);
+    }
+    close(epollfd);
+}
+
+void usage(const char *prog)
+{
+    cerr << "Usage: " << prog << " [-c clients] [-s senders] [-w window] [-d seconds] [-t threads] [-R rooms]\n"
+         << "       [-p port[,port...]] [host]\n";
+}
+
+int main(int argc, char *argv[])
+{
+    int clientCount = 200;
+    int senderCount = 20;
+    int window = 4;
+    int seconds = 10;
+    int threadCount = 2;
+    int roomCount = 0; // 0: everybody stays in the lobby
+    const char *host = "127.0.0.1";
+    vector<int> ports;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:s:w:d:t:R:p:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c': clientCount = atoi(optarg); break;
+        case 's': senderCount = atoi(optarg); break;
+        case 'w': window = atoi(optarg); break;
+        case 'd': seconds = atoi(optarg); break;
+        case 't': threadCount = atoi(optarg); break;
+        case 'R': roomCount = atoi(optarg); break;
+        case 'p':
+            for (char *port = strtok(optarg, ","); port; port = strtok(nullptr, ","))
+                ports.push_back(atoi(port));
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc)
+        host = argv[optind];
+
+    if (ports.empty())
+        ports.push_back(PORT);
+
+    if (clientCount <= 0 || threadCount <= 0 || senderCount > clientCount)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    vector<sockaddr_in> addrs(ports.size());
+    for (size_t i = 0; i < ports.size(); i++)
+    {
+        addrs[i].sin_family = AF_INET;
+        addrs[i].sin_port = htons(ports[i]);
+        if (inet_pton(AF_INET, host, &addrs[i].sin_addr) != 1)
+        {
+            cerr << "invalid IPv4 address: " << host << "\n";
+            return 1;
+        }
+    }
+
+    // Connect and JOIN every client while the sockets are still blocking
+    vector<vector<BenchConn>> perThread(threadCount);
+    for (int i = 0; i < clientCount; i++)
+    {
+        BenchConn c;
+        c.fd = connectTo(addrs[i % addrs.size()]);
+        if (c.fd < 0)
+            return 1;
+        c.sender = i < senderCount;
+
+        string join = "JOIN bench" + to_string(i) + "\n";
+        if (roomCount > 0)
+            join += "JOIN room" + to_string(i % roomCount) + "\nLEAVE lobby\n";
+        send(c.fd, join.c_str(), join.size(), MSG_NOSIGNAL);
+        perThread[i % threadCount].push_back(c);
+    }
+
+    vector<thread> workers;
+    for (auto &conns : perThread)
+        workers.emplace_back(worker, conns, window);
+
+    // Let the JOIN announcements drain before measuring
+    this_thread::sleep_for(chrono::seconds(1));
+
+    measuring.store(true);
+    auto start = chrono::steady_clock::now();
+    this_thread::sleep_for(chrono::seconds(seconds));
+    measuring.store(false);
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    stop.store(true);
+    for (auto &t : workers)
+        t.join();
+
+    cout << "clients=" << clientCount
+         << " senders=" << senderCount
+         << " rooms=" << roomCount
+         << " sent/s=" << (long long)(sent.load() / elapsed)
+         << " delivered/s=" << (long long)(delivered.load() / elapsed) << "\n";
+}
@@ -0,0 +1,101 @@
+#!/bin/sh
+# Measure fan-out throughput of the epoll server from 1 reactor up to
+# one reactor per core.
+#
+#   ./bench.sh [max-reactors] [bench options...]
+#   BACKEND=uring ./bench.sh [-] [bench options...]
+#   BACKEND=coro ./bench.sh [-] [bench options...]
+#   BACKEND=cluster ./bench.sh [max-nodes] [bench options...]
+#
+# Builds the server and bench if needed, then for each reactor count starts
+# the server pinned (-p), runs ./bench against it and prints one line per
+# run. With BACKEND=uring the io_uring server from ../Chat-Program-IoUring
+# is measured instead (single ring, so it runs once). BACKEND=coro runs the
+# coroutine server from ../Chat-Program-Coroutine and then this server with
+# one reactor, the callback version of the same single-threaded loop.
+# BACKEND=cluster starts a federated cluster of 1, 2, 4, ... nodes on this
+# host instead (REACTORS reactors each, default 1; node k on client port
+# 1600+k and peer port 1700+k, linked to every earlier node) and spreads
+# the bench clients over all of them.
+
+set -e
+cd "$(dirname "$0")"
+
+BACKEND=${BACKEND:-epoll}
+MAX=${1:-$(nproc)}
+[ $# -gt 0 ] && shift
+
+[ bench -nt bench.cpp ] || g++ -std=c++11 -O2 -pthread bench.cpp -o bench
+
+if [ "$BACKEND" = uring ]; then
+    URING=../Chat-Program-IoUring
+    [ $URING/server -nt $URING/server.cpp ] || g++ -std=c++11 -O2 -pthread $URING/server.cpp -o $URING/server
+    $URING/server </dev/null >/dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+    printf 'io_uring      '
+    ./bench "$@"
+    kill -INT "$pid"
+    wait "$pid" || true
+    exit 0
+fi
+
+[ server -nt server.cpp ] || g++ -std=c++11 -O2 -pthread server.cpp -o server
+
+if [ "$BACKEND" = coro ]; then
+    CORO=../Chat-Program-Coroutine
+    [ $CORO/server -nt $CORO/server.cpp ] || g++ -std=c++20 -O2 -pthread $CORO/server.cpp -o $CORO/server
+    $CORO/server </dev/null >/dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+    printf 'coroutines    '
+    ./bench "$@"
+    kill -INT "$pid"
+    wait "$pid" || true
+
+    ./server -r 1 </dev/null >/dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+    printf 'callbacks     '
+    ./bench "$@"
+    kill -INT "$pid"
+    wait "$pid" || true
+    exit 0
+fi
+
+if [ "$BACKEND" = cluster ]; then
+    n=1
+    while [ "$n" -le "$MAX" ]; do
+        pids= ports= peers=
+        k=0
+        while [ "$k" -lt "$n" ]; do
+            ./server -r "${REACTORS:-1}" -m 0 -l $((1600 + k)) -F $((1700 + k)) \
+                ${peers:+-C "$peers"} </dev/null >/dev/null 2>&1 &
+            pids="$pids $!"
+            ports="${ports:+$ports,}$((1600 + k))"
+            peers="${peers:+$peers,}127.0.0.1:$((1700 + k))"
+            k=$((k + 1))
+        done
+        sleep 1
+        printf 'nodes=%-3s ' "$n"
+        ./bench -p "$ports" "$@"
+        kill -INT $pids
+        wait $pids || true
+        n=$((n * 2))
+        [ "$n" -gt "$MAX" ] && [ "$((n / 2))" -lt "$MAX" ] && n=$MAX
+    done
+    exit 0
+fi
+
+n=1
+while [ "$n" -le "$MAX" ]; do
+    ./server -r "$n" -p </dev/null >/dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+    printf 'reactors=%-3s ' "$n"
+    ./bench "$@"
+    kill -INT "$pid"
+    wait "$pid" || true
+    n=$((n * 2))
+    [ "$n" -gt "$MAX" ] && [ "$((n / 2))" -lt "$MAX" ] && n=$MAX
+done
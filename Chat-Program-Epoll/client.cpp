@@ -1,37 +1,222 @@
 #include <iostream>
 #include <cstring>
-#include <thread>
-#include <mutex>
 #include <atomic>
+#include <chrono>
 #include <csignal>
 #include <netdb.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
 #include <termios.h>
+#include <getopt.h>
 #include <vector>
 #include <deque>
+#include <fstream>
+
+#include "../common/frame.h"
 
 using namespace std;
 
 constexpr int PORT = 1500;
 constexpr int BUF_SIZE = 1024;
 constexpr int MAX_MESSAGES = 100;
+constexpr int FRAME_MS = 16; // incoming messages are drawn at most once per frame
+constexpr int INPUT_BUF = 4096;
+constexpr size_t BOT_BUF_SIZE = 64 * 1024;
 
 atomic<bool> stop{false};
+atomic<bool> resized{false};
 int clientSocket = -1;
 
 epoll_event ev, events[2];
 int epollfd;
 
-mutex displayMutex;
+// The screen is split in two: rows 1 .. screenRows - 1 are a terminal
+// scroll region for messages, the last row is the input line. A new
+// message is printed at the bottom of the region and the terminal scrolls
+// it up; a keystroke rewrites at most the input line. Only a resize
+// redraws everything, from messageHistory.
 deque<string> messageHistory;
-string currentInput;
+vector<string> pendingLines; // received but not drawn yet
+int screenRows = 24;
+int screenCols = 80;
+chrono::steady_clock::time_point lastFrame;
+string frameOut; // escape sequences and text for the next write()
 
 termios originalTermios;
 
+// Input line editor. Stdin is read in bulk, and a read may end in the
+// middle of an escape sequence, so decoding state is kept between calls.
+// feed() edits the line and collects finished lines in `outgoing`; the
+// caller sends them and updates the screen once per read, so a pasted
+// block costs one send() and one redraw however many lines it holds.
+//
+// Keys: arrows, Home/End, Delete, Backspace, Ctrl-A/E/B/F (home, end,
+// left, right), Ctrl-K/U (kill to end/start), Ctrl-W (kill word). Text
+// inside a bracketed paste is taken literally, newlines included.
+struct LineEditor
+{
+    string line;
+    size_t cursor = 0;
+    string outgoing; // finished lines, newline-terminated
+    string echo;     // output for plain typing at the end of the line
+    bool redraw = false;
+
+    void feed(const char *p, size_t n)
+    {
+        for (size_t i = 0; i < n; i++)
+            step((unsigned char)p[i]);
+    }
+
+private:
+    enum class State { Text, Esc, Csi, Ss3 };
+    State state = State::Text;
+    string params; // CSI parameter bytes
+    bool pasting = false;
+
+    static size_t room() { return screenCols - 3; }
+
+    void step(unsigned char c)
+    {
+        switch (state)
+        {
+        case State::Esc:
+            state = c == '[' ? State::Csi : c == 'O' ? State::Ss3 : State::Text;
+            params.clear();
+            return; // Alt+key and lone Esc are ignored
+        case State::Csi:
+            if (c >= 0x30 && c <= 0x3F)
+            {
+                params += (char)c;
+                return;
+            }
+            state = State::Text;
+            csi(c);
+            return;
+        case State::Ss3:
+            state = State::Text;
+            csi(c);
+            return;
+        case State::Text:
+            break;
+        }
+
+        if (c == 0x1B)
+            state = State::Esc;
+        else if (c == '\n' || c == '\r')
+            finishLine();
+        else if (c >= 32 && c <= 126)
+            insert((char)c);
+        else if (c == '\t')
+            insert(' ');
+        else if (pasting)
+            return; // other control characters in a paste are not keys
+        else if (c == 127 || c == 8)
+            backspace();
+        else if (c == 1)
+            moveCursor(0);
+        else if (c == 5)
+            moveCursor(line.size());
+        else if (c == 2 && cursor > 0)
+            moveCursor(cursor - 1);
+        else if (c == 6 && cursor < line.size())
+            moveCursor(cursor + 1);
+        else if (c == 11)
+            erase(cursor, line.size());
+        else if (c == 21)
+            erase(0, cursor);
+        else if (c == 23)
+        {
+            size_t from = cursor;
+            while (from > 0 && line[from - 1] == ' ')
+                from--;
+            while (from > 0 && line[from - 1] != ' ')
+                from--;
+            erase(from, cursor);
+        }
+    }
+
+    void csi(unsigned char final)
+    {
+        if (final == '~' && params == "200")
+            pasting = true;
+        else if (final == '~' && params == "201")
+            pasting = false;
+        else if (pasting)
+            return;
+        else if (final == 'C' && cursor < line.size())
+            moveCursor(cursor + 1);
+        else if (final == 'D' && cursor > 0)
+            moveCursor(cursor - 1);
+        else if (final == 'H' || (final == '~' && (params == "1" || params == "7")))
+            moveCursor(0);
+        else if (final == 'F' || (final == '~' && (params == "4" || params == "8")))
+            moveCursor(line.size());
+        else if (final == '~' && params == "3")
+            erase(cursor, cursor + 1);
+    }
+
+    void finishLine()
+    {
+        // Empty lines are not sent; a pasted CR LF is one line break
+        if (line.empty())
+            return;
+        outgoing += line;
+        outgoing += '\n';
+        line.clear();
+        cursor = 0;
+        redraw = true;
+    }
+
+    void insert(char c)
+    {
+        bool atEnd = cursor == line.size();
+        line.insert(cursor++, 1, c);
+        if (atEnd && line.size() <= room() && !redraw)
+            echo += c;
+        else
+            redraw = true;
+    }
+
+    void backspace()
+    {
+        if (cursor == 0)
+            return;
+        bool atEnd = cursor == line.size();
+        bool fitted = line.size() <= room();
+        line.erase(--cursor, 1);
+        if (atEnd && fitted && !redraw)
+            echo += "\b \b";
+        else
+            redraw = true;
+    }
+
+    void erase(size_t from, size_t to)
+    {
+        to = min(to, line.size());
+        if (from >= to)
+            return;
+        line.erase(from, to - from);
+        cursor = from;
+        redraw = true;
+    }
+
+    void moveCursor(size_t to)
+    {
+        cursor = to;
+        redraw = true;
+    }
+};
+
+LineEditor editor;
+
+// Server messages are newline-delimited
+FrameParser incoming(FrameMode::Text);
+
 void set_non_blocking(int socket)
 {
     int flags = fcntl(socket, F_GETFL, 0);
@@ -49,50 +234,195 @@ void set_non_blocking(int socket)
     }
 }
 
+// Raw input, plus bracketed paste so the terminal marks pasted text
 void enableRawMode()
 {
     tcgetattr(STDIN_FILENO, &originalTermios);
     termios raw = originalTermios;
     raw.c_lflag &= ~(ICANON | ECHO);
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+    write(STDOUT_FILENO, "\033[?2004h", 8);
 }
 
 void disableRawMode()
 {
+    write(STDOUT_FILENO, "\033[?2004l", 8);
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &originalTermios);
 }
 
 void clearScreen()
 {
-    cout << "\033[2J\033[H" << flush;
+    // Also gives the whole screen back to scrolling
+    cout << "\033[r\033[2J\033[H" << flush;
+}
+
+void querySize()
+{
+    winsize ws{};
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 1 && ws.ws_col > 2)
+    {
+        screenRows = ws.ws_row;
+        screenCols = ws.ws_col;
+    }
+}
+
+// Write out everything the renderer has queued, in one write() if it fits
+void writeFrame()
+{
+    size_t done = 0;
+    while (done < frameOut.size())
+    {
+        ssize_t n = write(STDOUT_FILENO, frameOut.data() + done, frameOut.size() - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    frameOut.clear();
+}
+
+void moveTo(int row, int col)
+{
+    frameOut += "\033[" + to_string(row) + ";" + to_string(col) + "H";
+}
+
+// First character of the input line on screen. A line wider than the
+// screen scrolls sideways to keep the cursor in view.
+size_t inputView()
+{
+    size_t room = screenCols - 3;
+    return editor.cursor > room ? editor.cursor - room : 0;
 }
 
+void placeCursor()
+{
+    moveTo(screenRows, 3 + (int)(editor.cursor - inputView()));
+}
+
+// Rewrite the input line and put the cursor back
+void drawInputLine()
+{
+    moveTo(screenRows, 1);
+    frameOut += "\033[K> ";
+    frameOut.append(editor.line, inputView(), screenCols - 3);
+    placeCursor();
+}
+
+// Clear the screen, set up the scroll region and draw the newest messages
+// that fit; on start and when the terminal is resized
 void redrawScreen()
 {
-    lock_guard<mutex> lock(displayMutex);
-    
-    // Clear screen and move cursor to top
-    cout << "\033[2J\033[H";
-    
-    // Display message history from top
-    for (const auto& msg : messageHistory)
+    querySize();
+    pendingLines.clear();
+    frameOut += "\033[2J";
+    frameOut += "\033[1;" + to_string(screenRows - 1) + "r";
+    moveTo(1, 1);
+
+    size_t shown = min(messageHistory.size(), (size_t)(screenRows - 1));
+    for (size_t i = messageHistory.size() - shown; i < messageHistory.size(); i++)
     {
-        cout << msg << "\n";
+        frameOut += messageHistory[i];
+        if (i + 1 < messageHistory.size())
+            frameOut += "\n";
+    }
+    drawInputLine();
+    writeFrame();
+    lastFrame = chrono::steady_clock::now();
+}
+
+// Draw the messages that arrived since the last frame: each is printed at
+// the bottom of the scroll region, which the terminal scrolls up. Lines
+// that would scroll straight off again are not printed at all.
+void drawPending()
+{
+    if (pendingLines.empty())
+        return;
+
+    size_t first = pendingLines.size() > (size_t)(screenRows - 1)
+                       ? pendingLines.size() - (screenRows - 1) : 0;
+    moveTo(screenRows - 1, 1);
+    for (size_t i = first; i < pendingLines.size(); i++)
+    {
+        frameOut += "\n";
+        frameOut += pendingLines[i];
+    }
+    pendingLines.clear();
+
+    // Back to where the user is typing
+    placeCursor();
+    writeFrame();
+    lastFrame = chrono::steady_clock::now();
+}
+
+// Milliseconds until the next frame may be drawn, 0 if it is due
+int frameWait()
+{
+    auto since = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - lastFrame).count();
+    return since >= FRAME_MS ? 0 : (int)(FRAME_MS - since);
+}
+
+// Send all of msg on the non-blocking socket, waiting for room if the
+// kernel buffer is full
+bool sendAll(const string &msg)
+{
+    size_t done = 0;
+    while (done < msg.size())
+    {
+        ssize_t n = send(clientSocket, msg.data() + done, msg.size() - done, MSG_NOSIGNAL);
+        if (n > 0)
+        {
+            done += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            pollfd pfd{clientSocket, POLLOUT, 0};
+            if (poll(&pfd, 1, 1000) > 0)
+                continue;
+        }
+        return false;
+    }
+    return true;
+}
+
+// The server's heartbeat: answered at once and not shown
+bool isPing(const char *frame, size_t length)
+{
+    if (length != 4 || memcmp(frame, "PING", 4) != 0)
+        return false;
+    sendAll("PONG\n");
+    return true;
+}
+
+// Everything waiting on stdin, in as few read() calls as possible
+bool readInput()
+{
+    char buf[INPUT_BUF];
+    for (;;)
+    {
+        ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        editor.feed(buf, n);
+
+        // A full buffer may have left more behind
+        int more = 0;
+        if ((size_t)n < sizeof(buf) || ioctl(STDIN_FILENO, FIONREAD, &more) != 0 || more == 0)
+            return true;
     }
-    
-    // Move to bottom of screen (save cursor position)
-    cout << "\033[999;1H";
-    
-    // Draw input line at bottom
-    cout << "\033[K> " << currentInput << flush;
 }
 
 void addMessage(const string& msg)
 {
-    lock_guard<mutex> lock(displayMutex);
     messageHistory.push_back(msg);
     if (messageHistory.size() > MAX_MESSAGES)
         messageHistory.pop_front();
+    pendingLines.push_back(msg);
 }
 
 void handle_sigint(int)
@@ -102,46 +432,341 @@ void handle_sigint(int)
     disableRawMode();
 }
 
-int main()
+void handle_sigwinch(int)
 {
-    signal(SIGINT, handle_sigint);
+    resized.store(true);
+}
 
+// Connected socket to host:port; throws on failure
+int connectTo(const string &host, int port)
+{
     addrinfo hints{};
     hints.ai_family = AF_INET;
     hints.ai_socktype = SOCK_STREAM;
 
     addrinfo *serverAddress = nullptr;
-    string serverIp;
-
-    cout << "Server IPv4 address> ";
-    getline(cin, serverIp);
-
-    if (getaddrinfo(serverIp.c_str(), to_string(PORT).c_str(),
+    if (getaddrinfo(host.c_str(), to_string(port).c_str(),
                     &hints, &serverAddress) != 0)
         throw runtime_error("getaddrinfo failed");
 
-    clientSocket = socket(
+    int fd = socket(
         serverAddress->ai_family,
         serverAddress->ai_socktype,
         serverAddress->ai_protocol);
 
-    if (clientSocket < 0)
+    if (fd < 0)
+    {
+        freeaddrinfo(serverAddress);
         throw runtime_error("socket failed");
+    }
 
-    if (connect(clientSocket,
+    if (connect(fd,
                 serverAddress->ai_addr,
                 serverAddress->ai_addrlen) != 0)
+    {
+        freeaddrinfo(serverAddress);
+        close(fd);
         throw runtime_error("connect failed");
+    }
 
     freeaddrinfo(serverAddress);
+    return fd;
+}
+
+// ---- Headless bot mode ----
+//
+// `-b script` runs the client without a terminal: it connects, JOINs as
+// `-u name`, sends the script's lines on its schedule and logs every line
+// it sends and receives with a timestamp, for soak tests with many
+// synthetic users whose runs can be compared later.
+//
+// Script lines are `<ms> <text>` (ms after the start) or `+<ms> <text>`
+// (ms after the previous line); blank lines and lines starting with `#`
+// are skipped. The text is sent as is, so `JOIN dev` or `PART` work too.
+// `-x` scales the schedule (2 = twice as fast), `-l` plays it that many
+// times back to back, and the bot keeps listening `-t` seconds after the
+// last line.
+//
+// Log lines are `S <us> <text>` for sends and `R <us> <text>` for
+// receives, with microseconds since connect; the header gives the wall
+// clock at connect so logs from many bots can be lined up.
+
+struct BotOptions
+{
+    string script;
+    string host = "127.0.0.1";
+    int port = PORT;
+    string name = "bot";
+    double speed = 1.0;
+    int loops = 1;
+    double linger = 2.0; // seconds
+    string logPath;      // stdout if empty
+};
+
+struct ScriptLine
+{
+    uint64_t atUs; // since the start of one pass
+    string text;
+};
 
+bool loadScript(const string &path, vector<ScriptLine> &lines)
+{
+    ifstream in(path);
+    if (!in)
+    {
+        perror(path.c_str());
+        return false;
+    }
+
+    uint64_t last = 0;
+    string line;
+    while (getline(in, line))
+    {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        size_t start = line.find_first_not_of(" \t");
+        if (start == string::npos || line[start] == '#')
+            continue;
+
+        bool relative = line[start] == '+';
+        char *end = nullptr;
+        const char *num = line.c_str() + start + (relative ? 1 : 0);
+        double ms = strtod(num, &end);
+        if (end == num || ms < 0)
+        {
+            cerr << path << ": bad line: " << line << "\n";
+            return false;
+        }
+        uint64_t at = (uint64_t)(ms * 1000);
+        last = relative ? last + at : at;
+
+        size_t text = line.find_first_not_of(" \t", end - line.c_str());
+        if (text == string::npos)
+            continue;
+        lines.push_back({last, line.substr(text)});
+    }
+    return true;
+}
+
+void handle_stop(int)
+{
+    stop.store(true);
+}
+
+int runBot(const BotOptions &opt)
+{
+    vector<ScriptLine> script;
+    if (!loadScript(opt.script, script))
+        return 1;
+
+    FILE *log = stdout;
+    if (!opt.logPath.empty() && !(log = fopen(opt.logPath.c_str(), "w")))
+    {
+        perror(opt.logPath.c_str());
+        return 1;
+    }
+
+    signal(SIGINT, handle_stop);
+    signal(SIGTERM, handle_stop);
+    signal(SIGPIPE, SIG_IGN);
+
+    clientSocket = connectTo(opt.host, opt.port);
     set_non_blocking(clientSocket);
 
-    cout << "Connected to server " << serverIp << ":" << PORT << "\n";
+    auto start = chrono::steady_clock::now();
+    auto sinceStart = [&]() {
+        return (uint64_t)chrono::duration_cast<chrono::microseconds>(
+            chrono::steady_clock::now() - start).count();
+    };
+    uint64_t wallUs = (uint64_t)chrono::duration_cast<chrono::microseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+    fprintf(log, "# bot %s start_us=%llu speed=%g script=%s\n", opt.name.c_str(),
+            (unsigned long long)wallUs, opt.speed, opt.script.c_str());
+
+    string join = "JOIN " + opt.name + "\n";
+    if (!sendAll(join))
+    {
+        cerr << "send failed\n";
+        return 1;
+    }
+
+    // Schedule in microseconds since connect. One pass lasts until its last
+    // line; the next pass starts right after.
+    uint64_t passUs = script.empty() ? 0 : script.back().atUs;
+    size_t total = script.size() * (size_t)max(opt.loops, 0);
+    auto dueUs = [&](size_t i) {
+        const ScriptLine &l = script[i % script.size()];
+        return (uint64_t)((double)((i / script.size()) * passUs + l.atUs) / opt.speed);
+    };
+
+    unsigned long long sent = 0, received = 0;
+    bool closed = false;
+    size_t next = 0;
+    uint64_t lingerUntil = 0;
+    string batch;
+
+    while (!stop.load() && !closed)
+    {
+        // Send whatever is due, in one send() if several lines are
+        uint64_t now = sinceStart();
+        batch.clear();
+        while (next < total && dueUs(next) <= now)
+        {
+            const string &text = script[next % script.size()].text;
+            fprintf(log, "S %llu %s\n", (unsigned long long)now, text.c_str());
+            batch += text;
+            batch += '\n';
+            next++;
+            sent++;
+        }
+        if (!batch.empty() && !sendAll(batch))
+        {
+            cerr << "send failed\n";
+            break;
+        }
+
+        int timeout;
+        if (next < total)
+            timeout = (int)((dueUs(next) - now + 999) / 1000);
+        else
+        {
+            if (lingerUntil == 0)
+                lingerUntil = now + (uint64_t)(opt.linger * 1e6);
+            if (now >= lingerUntil)
+                break;
+            timeout = (int)((lingerUntil - now + 999) / 1000);
+        }
+
+        pollfd pfd{clientSocket, POLLIN, 0};
+        int ready = poll(&pfd, 1, timeout);
+        if (ready < 0 && errno != EINTR)
+        {
+            perror("poll");
+            break;
+        }
+        if (ready <= 0)
+            continue;
+
+        for (;;)
+        {
+            ssize_t n = recv(clientSocket, incoming.prepare(BOT_BUF_SIZE), BOT_BUF_SIZE, 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (n <= 0)
+            {
+                closed = true;
+                break;
+            }
+            incoming.commit(n);
+
+            uint64_t at = sinceStart();
+            const char *frame;
+            size_t length;
+            while (incoming.next(frame, length) == FrameParser::Frame)
+            {
+                if (length > 0 && frame[0] == '#')
+                {
+                    closed = true;
+                    break;
+                }
+                if (isPing(frame, length))
+                    continue;
+                fprintf(log, "R %llu %.*s\n", (unsigned long long)at, (int)length, frame);
+                received++;
+            }
+        }
+    }
 
+    if (!closed)
+        send(clientSocket, "#\n", 2, MSG_NOSIGNAL);
+    shutdown(clientSocket, SHUT_RDWR);
+    close(clientSocket);
+
+    fflush(log);
+    if (log != stdout)
+        fclose(log);
+    cerr << opt.name << ": sent=" << sent << " received=" << received
+         << " elapsed=" << sinceStart() / 1000 << "ms"
+         << (closed ? " (server closed)" : "") << "\n";
+    return 0;
+}
+
+void usage(const char *prog)
+{
+    cerr << "usage: " << prog << "                 interactive client\n"
+         << "       " << prog << " -b script [-u name] [-x speed] [-l loops] [-t secs]\n"
+         << "              [-o log] [-p port] [host]\n"
+         << "  -b  run headless, sending the lines of script on its schedule\n"
+         << "  -u  username to JOIN as (default bot)\n"
+         << "  -x  replay speed factor (default 1)\n"
+         << "  -l  play the script this many times (default 1)\n"
+         << "  -t  keep receiving this long after the last line (default 2)\n"
+         << "  -o  write the send/receive log here (default stdout)\n"
+         << "  -p  server port (default " << PORT << ")\n";
+}
+
+int main(int argc, char *argv[])
+{
+    BotOptions bot;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:u:x:l:t:o:p:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b': bot.script = optarg; break;
+        case 'u': bot.name = optarg; break;
+        case 'x': bot.speed = atof(optarg); break;
+        case 'l': bot.loops = atoi(optarg); break;
+        case 't': bot.linger = atof(optarg); break;
+        case 'o': bot.logPath = optarg; break;
+        case 'p': bot.port = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc)
+        bot.host = argv[optind];
+
+    if (!bot.script.empty())
+    {
+        if (bot.speed <= 0 || bot.loops < 1 || bot.port <= 0)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        try
+        {
+            return runBot(bot);
+        }
+        catch (const exception &e)
+        {
+            cerr << bot.name << ": " << e.what() << "\n";
+            return 1;
+        }
+    }
+
+    signal(SIGINT, handle_sigint);
+    signal(SIGWINCH, handle_sigwinch);
+
+    string serverIp;
+
+    cout << "Server IPv4 address> ";
+    getline(cin, serverIp);
+
+    // Asked before connecting: the server gives a new connection only a
+    // few seconds to send its JOIN
     string username;
     cout << "Enter your username: ";
     getline(cin, username);
+
+    clientSocket = connectTo(serverIp, PORT);
+    set_non_blocking(clientSocket);
+
+    cout << "Connected to server " << serverIp << ":" << PORT << "\n";
+
     string join = "JOIN " + username + "\n";
     send(clientSocket, join.c_str(), join.size(), 0);
 
@@ -175,7 +800,23 @@ int main()
 
     while (!stop.load())
     {
-        int nready = epoll_wait(epollfd, events, 2, 200);
+        if (resized.exchange(false))
+            redrawScreen();
+
+        // Messages that arrived too soon after the last frame wait for the
+        // next one, so a busy room costs at most one redraw per frame
+        int timeout = 200;
+        if (!pendingLines.empty())
+        {
+            timeout = frameWait();
+            if (timeout == 0)
+            {
+                drawPending();
+                timeout = 200;
+            }
+        }
+
+        int nready = epoll_wait(epollfd, events, 2, timeout);
         if (nready < 0)
         {
             if (errno == EINTR)
@@ -188,70 +829,66 @@ int main()
         {
             if (events[i].data.fd == clientSocket)
             {
-                char buffer[BUF_SIZE];
-                ssize_t n = recv(clientSocket, buffer, BUF_SIZE - 1, 0);
+                ssize_t n = recv(clientSocket, incoming.prepare(BUF_SIZE), BUF_SIZE, 0);
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                    continue;
                 if (n <= 0)
                 {
-                    if (errno == EAGAIN || errno == EWOULDBLOCK)
-                    {
-                        this_thread::sleep_for(chrono::milliseconds(50));
-                        continue;
-                    }
                     stop.store(true);
-                    break; // real error
+                    break; // EOF or a real error
                 }
 
-                buffer[n] = '\0';
+                incoming.commit(n);
 
-                if (buffer[0] == '#')
+                // A single read may hold several lines, or part of one
+                const char *frame;
+                size_t length;
+                while (incoming.next(frame, length) == FrameParser::Frame)
                 {
-                    addMessage("Server closed connection.");
-                    redrawScreen();
-                    stop.store(true);
-                    break;
+                    if (length > 0 && frame[0] == '#')
+                    {
+                        addMessage("Server closed connection.");
+                        stop.store(true);
+                        break;
+                    }
+                    if (isPing(frame, length))
+                        continue;
+                    addMessage(string(frame, length));
                 }
-
-                addMessage(string(buffer));
-                redrawScreen();
+                if (frameWait() == 0 || stop.load())
+                    drawPending();
+                if (stop.load())
+                    break;
             }
             else if (events[i].data.fd == STDIN_FILENO)
             {
-                char c;
-                if (read(STDIN_FILENO, &c, 1) == 1)
+                if (!readInput())
                 {
-                    if (c == '\n')
-                    {
-                        // Enter pressed - send message
-                        if (!currentInput.empty())
-                        {
-                            string msg = currentInput + "\n";
-                            if (send(clientSocket, msg.c_str(), msg.length(), 0) <= 0)
-                            {
-                                addMessage("Failed to send data to server.");
-                                redrawScreen();
-                                stop.store(true);
-                                break;
-                            }
-                            currentInput.clear();
-                            redrawScreen();
-                        }
-                    }
-                    else if (c == 127 || c == 8)
-                    {
-                        // Backspace
-                        if (!currentInput.empty())
-                        {
-                            currentInput.pop_back();
-                            redrawScreen();
-                        }
-                    }
-                    else if (c >= 32 && c <= 126)
+                    stop.store(true);
+                    break;
+                }
+
+                // Every line finished in this read goes out in one send()
+                if (!editor.outgoing.empty())
+                {
+                    bool sent = sendAll(editor.outgoing);
+                    editor.outgoing.clear();
+                    if (!sent)
                     {
-                        // Printable character
-                        currentInput += c;
-                        redrawScreen();
+                        addMessage("Failed to send data to server.");
+                        drawPending();
+                        stop.store(true);
+                        break;
                     }
                 }
+
+                if (editor.redraw)
+                    drawInputLine();
+                else
+                    frameOut += editor.echo;
+                editor.redraw = false;
+                editor.echo.clear();
+                writeFrame();
             }
         }
     }
@@ -261,7 +898,7 @@ int main()
     disableRawMode();
     
     // Notify server about shutdown
-    send(clientSocket, "#", 1, 0);
+    send(clientSocket, "#\n", 2, 0);
 
     shutdown(clientSocket, SHUT_RDWR); // wake recv/send
     close(clientSocket);               // release fd
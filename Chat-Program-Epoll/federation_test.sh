@@ -0,0 +1,78 @@
+#!/bin/bash
+# Check that a node drops a peer link that sends malformed broadcasts and
+# keeps serving its clients, and that a well-formed broadcast from a peer
+# still reaches them.
+#
+#   ./federation_test.sh
+#
+# Builds the server if needed and starts one node on client port 1650 and
+# peer port 1750. The peer side is played by hand over /dev/tcp.
+
+set -e
+cd "$(dirname "$0")"
+
+CLIENT_PORT=1650
+PEER_PORT=1750
+
+[ server -nt server.cpp ] || g++ -std=c++11 -O2 -pthread server.cpp -o server
+
+./server -r 1 -m 0 -l "$CLIENT_PORT" -F "$PEER_PORT" </dev/null >/dev/null 2>&1 &
+pid=$!
+# A node that hangs would not stop on SIGINT
+trap 'kill -INT "$pid" 2>/dev/null; sleep 1; kill -KILL "$pid" 2>/dev/null || true; wait "$pid" 2>/dev/null || true' EXIT
+sleep 0.5
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+# Read lines from fd $1 until one matches $2, for up to 2 s
+expect() {
+    local line deadline=$((SECONDS + 2))
+    while [ "$SECONDS" -le "$deadline" ]; do
+        IFS= read -r -t 1 line <&"$1" || continue
+        case "$line" in *"$2"*) return 0 ;; esac
+    done
+    return 1
+}
+
+# Open a peer link, say HELLO, send one frame and close again. Frames are
+# printf formats: a 4-byte length, then the payload.
+HELLO='\x00\x00\x00\x12Hchat-federation/1'
+peer() {
+    exec 4<>"/dev/tcp/127.0.0.1/$PEER_PORT"
+    printf "$HELLO$1" >&4
+    sleep 0.2
+    exec 4>&-
+}
+
+# A text client in the lobby (room 0), so broadcasts to it have a recipient
+exec 3<>"/dev/tcp/127.0.0.1/$CLIENT_PORT"
+printf 'JOIN member\n' >&3
+sleep 0.2
+
+# M <room 0> <flags 0> <nameLength> <line>
+peer '\x00\x00\x00\x07M\x00\x00\x00\x00\x00\x00'            # empty line
+peer '\x00\x00\x00\x09M\x00\x00\x00\x00\x00\x00hi'          # no '\n'
+peer '\x00\x00\x00\x0aM\x00\x00\x00\x00\x00\x03ab\n'        # name is the whole line
+peer '\x00\x00\x00\x06M\x00\x00\x00\x00\x00'                # header cut short
+
+# The same room subscribed under two ids: the link is dropped
+exec 4<>"/dev/tcp/127.0.0.1/$PEER_PORT"
+printf "$HELLO"'\x00\x00\x00\x08S\x00\x00\x00\x01dev\x00\x00\x00\x08S\x00\x00\x00\x02dev' >&4
+timeout 2 cat <&4 >/dev/null || fail "peer subscribing to a room twice was not dropped"
+exec 4>&-
+
+# A new client is still served
+exec 5<>"/dev/tcp/127.0.0.1/$CLIENT_PORT"
+printf 'JOIN probe\nPING\n' >&5
+expect 5 PONG || fail "node stopped answering clients after malformed peer frames"
+exec 5>&-
+
+# ... and a proper broadcast from a peer is delivered
+peer '\x00\x00\x00\x13M\x00\x00\x00\x00\x01\x06peer: hello\n'
+expect 3 "peer: hello" || fail "well-formed peer broadcast not delivered"
+exec 3>&-
+
+echo "PASS"
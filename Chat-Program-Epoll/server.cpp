@@ -4,283 +4,3142 @@
 #include <thread>
 #include <mutex>
 #include <atomic>
+#include <chrono>
 #include <algorithm>
+#include <memory>
+#include <new>
 #include <csignal>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
 #include <unordered_map>
 
+#include "../common/frame.h"
+#include "../common/history.h"
+#include "../common/metrics.h"
+#include "../common/mpsc.h"
+#include "../common/pool.h"
+#include "../common/ratelimit.h"
+#include "../common/timerwheel.h"
+
 using namespace std;
 
-constexpr int PORT = 1500;
-constexpr int BUF_SIZE = 1024;
-constexpr int MAX_CONNECTION = 100;
+constexpr int PORT = 1500;
+constexpr int BUF_SIZE = 1024;
+constexpr int READ_SIZE = 16 * 1024; // bytes requested per recv(), may hold many frames
+constexpr int MAX_EVENTS = 128;
+constexpr int MAX_IOV = 64; // chunks handed to a single writev()
+constexpr int READ_BUDGET = 8; // recv() calls per connection per wakeup, for fairness
+constexpr int ADMIN_PORT = 1501; // Prometheus metrics, bound to localhost
+constexpr int REPLAY_COUNT = 50; // history records replayed on JOIN by default
+constexpr size_t COALESCE_BYTES = 64 * 1024; // queued bytes that are flushed before the deadline
+constexpr size_t HIGH_WATERMARK = 1024 * 1024; // client queue size that makes it a slow consumer
+constexpr size_t LOW_WATERMARK = 256 * 1024;   // ... until it has drained below this
+constexpr int SLOW_GRACE_MS = 5000;            // -S close: how long a client may stay slow
+constexpr int IDLE_TIMEOUT_S = 60; // silence after which a client is sent PING
+constexpr int PONG_TIMEOUT_S = 30; // ... and how long it then has to send anything
+constexpr int JOIN_TIMEOUT_S = 10; // time a new connection has to send its JOIN
+constexpr int MAX_ROOMS = 1024;    // rooms a node creates; they live as long as the server
+constexpr size_t MAX_ROOM_NAME = 32;
+constexpr int PEER_RETRY_MS = 1000; // pause before a lost peer node is dialed again
+constexpr size_t PEER_QUEUE_LIMIT = 64 * 1024 * 1024; // unsent bytes after which a peer link is dropped
+
+atomic<bool> stop{false};
+
+// Where the running reactor records recv-to-last-send latency
+thread_local Histogram *fanoutLatency = nullptr;
+// The running reactor's message buffer pool
+thread_local SizeClassPool *messagePool = nullptr;
+
+uint64_t nowNs()
+{
+    return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// A block for `bytes` from the running reactor's message pool, or from the
+// heap (sizeClass -1) when there is no pool on this thread or it is too big
+void *poolAllocate(size_t bytes, int &sizeClass, SizeClassPool *&pool)
+{
+    sizeClass = messagePool ? SizeClassPool::classOf(bytes) : -1;
+    void *mem = sizeClass >= 0 ? (*messagePool)[sizeClass].allocate() : nullptr;
+    if (!mem)
+    {
+        sizeClass = -1;
+        mem = ::operator new(bytes);
+    }
+    pool = sizeClass >= 0 ? messagePool : nullptr;
+    return mem;
+}
+
+// Give a poolAllocate() block back to its owner, from any thread
+void poolRelease(void *mem, int sizeClass, SizeClassPool *pool)
+{
+    if (!pool)
+        ::operator delete(mem);
+    else if (pool == messagePool)
+        (*pool)[sizeClass].free(mem);
+    else
+        (*pool)[sizeClass].freeRemote(mem);
+}
+
+// Immutable, reference-counted message. A broadcast is serialized once as a
+// text line ("<name><body>\n") and every recipient queue, on any reactor,
+// points at the same bytes. The payload is stored right after the header.
+// Buffers come from the creating reactor's size-classed pool and go back to
+// it from whichever reactor drops the last reference.
+struct MessageBuffer
+{
+    atomic<int> refs{1};
+    uint32_t length = 0;      // total payload bytes
+    uint32_t nameLength = 0;  // leading payload bytes holding the sender name
+    int sizeClass = -1;       // -1: allocated with operator new
+    SizeClassPool *pool = nullptr;
+    uint64_t recvNs = 0;      // when the frame that caused it was received, 0 if none
+    bool droppable = false;   // a chat line, which a slow consumer may miss
+    uint32_t room = UINT32_MAX; // room whose history holds it
+    uint64_t seq = 0;         // its sequence number there, 0 if not logged
+
+    const char *data() const { return reinterpret_cast<const char *>(this + 1); }
+    char *data() { return reinterpret_cast<char *>(this + 1); }
+
+    static MessageBuffer *create(const char *name, size_t nameLength, const char *body, size_t bodyLength)
+    {
+        int sizeClass;
+        SizeClassPool *pool;
+        void *mem = poolAllocate(sizeof(MessageBuffer) + nameLength + bodyLength, sizeClass, pool);
+
+        MessageBuffer *m = new (mem) MessageBuffer();
+        m->sizeClass = sizeClass;
+        m->pool = pool;
+        m->length = (uint32_t)(nameLength + bodyLength);
+        m->nameLength = (uint32_t)nameLength;
+        memcpy(m->data(), name, nameLength);
+        memcpy(m->data() + nameLength, body, bodyLength);
+        return m;
+    }
+
+    static MessageBuffer *create(const char *name, const char *body, size_t bodyLength)
+    {
+        return create(name, strlen(name), body, bodyLength);
+    }
+
+    void release()
+    {
+        if (refs.fetch_sub(1, memory_order_acq_rel) == 1)
+        {
+            // The last reference goes once the last recipient has it
+            if (recvNs && fanoutLatency)
+                fanoutLatency->record(nowNs() - recvNs);
+
+            SizeClassPool *owner = pool;
+            int c = sizeClass;
+            this->~MessageBuffer();
+            poolRelease(this, c, owner);
+        }
+    }
+};
+
+// Owning handle to a MessageBuffer
+class MessageRef
+{
+public:
+    MessageRef() = default;
+    explicit MessageRef(MessageBuffer *m) : msg(m) {} // adopts the initial reference
+    MessageRef(const MessageRef &other) : msg(other.msg)
+    {
+        if (msg)
+            msg->refs.fetch_add(1, memory_order_relaxed);
+    }
+    MessageRef(MessageRef &&other) noexcept : msg(other.msg) { other.msg = nullptr; }
+    MessageRef &operator=(MessageRef other) noexcept
+    {
+        swap(msg, other.msg);
+        return *this;
+    }
+    ~MessageRef() { reset(); }
+
+    void reset()
+    {
+        if (msg)
+            msg->release();
+        msg = nullptr;
+    }
+
+    MessageBuffer *operator->() const { return msg; }
+    explicit operator bool() const { return msg != nullptr; }
+
+private:
+    MessageBuffer *msg = nullptr;
+};
+
+// One queued write: a small per-recipient header (frame length and/or "You")
+// followed by the shared payload bytes [begin, end). Nothing here is
+// allocated per recipient.
+struct OutChunk
+{
+    MessageRef msg;
+    uint32_t begin = 0;
+    uint32_t end = 0;
+    uint8_t headerLength = 0;
+    char header[8];
+
+    size_t size() const { return headerLength + end - begin; }
+};
+
+// Growable ring of OutChunks. Once it has reached its working size,
+// push/pop never touch the allocator.
+class ChunkRing
+{
+public:
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+    OutChunk &operator[](size_t i) { return slots[(head + i) & (slots.size() - 1)]; }
+    OutChunk &front() { return slots[head]; }
+
+    OutChunk &push_back()
+    {
+        if (count == slots.size())
+            grow();
+        return slots[(head + count++) & (slots.size() - 1)];
+    }
+
+    void pop_front()
+    {
+        slots[head].msg.reset();
+        head = (head + 1) & (slots.size() - 1);
+        --count;
+    }
+
+    // Drop the second chunk, keeping the first (which may be half written)
+    void pop_second()
+    {
+        (*this)[1] = move(front());
+        pop_front();
+    }
+
+    void clear()
+    {
+        while (count > 0)
+            pop_front();
+    }
+
+private:
+    void grow()
+    {
+        vector<OutChunk> bigger(slots.empty() ? 8 : slots.size() * 2);
+        for (size_t i = 0; i < count; i++)
+            bigger[i] = move((*this)[i]);
+        slots.swap(bigger);
+        head = 0;
+    }
+
+    vector<OutChunk> slots; // size is always a power of two
+    size_t head = 0;
+    size_t count = 0;
+};
+
+// Bytes waiting to be written to one client. Chunks are appended by
+// broadcasts and flushed with writev() whenever the socket is writable.
+struct OutputQueue
+{
+    ChunkRing chunks;
+    size_t offset = 0;        // bytes of chunks.front() already written
+    size_t bytes = 0;         // unwritten bytes across all chunks
+    bool writeArmed = false;  // EPOLLOUT currently requested
+    FrameMode encoding = FrameMode::Detect; // how this client wants replies framed
+};
+
+constexpr size_t MAX_NAME = 31; // longer JOIN names are cut
+
+// Why a client's reads are paused (Connection::readPaused)
+constexpr uint8_t PAUSE_SLOW_ROOM = 1; // its room has a slow member (-B)
+constexpr uint8_t PAUSE_RATE = 2;      // it is over its rate limit (-P delay)
+
+// Everything a reactor keeps per client, carved from the reactor's
+// connection slab
+struct Connection
+{
+    int fd = -1;
+    uint32_t generation = 0; // tells this connection apart from earlier ones on the same fd
+    uint32_t liveIndex = 0;  // position in ConnectionTable's iteration array
+    bool named = false;      // its first JOIN, which names it, has arrived
+    uint8_t nameLength = 0;
+    char name[MAX_NAME + 1] = {}; // stored inline, NUL-terminated
+    vector<uint32_t> rooms; // joined room ids, active one last
+    OutputQueue out;
+    FrameParser parser;     // parses the reactor's receive buffer, owns none
+
+    // Received bytes not yet handled, kept between reads: an unfinished
+    // frame, or frames held back by a read pause. In a block from the
+    // reactor's message pool, only while there are any.
+    char *pending = nullptr;
+    uint32_t pendingLength = 0;
+    uint32_t pendingScanned = 0; // FrameParser::scannedTail() for them
+    int pendingClass = -1;
+    SizeClassPool *pendingPool = nullptr;
+
+    // History replay, sent ahead of the output queue. Live messages that
+    // are already part of the replay (seq <= replayThrough) are not queued.
+    HistoryCursor replay;
+    HistoryLog *replayLog = nullptr;
+    uint32_t replayRoom = UINT32_MAX;
+    uint64_t replayThrough = 0;
+
+    // Slow-consumer state: above the high watermark until drained below the
+    // low one. readPaused: the PAUSE_* reasons why this client is not read.
+    bool slow = false;
+    uint8_t readPaused = 0;
+    bool evicting = false;   // queued for disconnection at the end of the tick
+
+    // Timers on the reactor's wheel. liveTimer is the JOIN deadline until
+    // the first JOIN, then the idle/PING/PONG heartbeat; it is not moved on
+    // every read, lastActive is checked when it fires.
+    TimerNode liveTimer;
+    TimerNode flushTimer; // flush deadline (-f)
+    TimerNode slowTimer;  // grace period of a slow client (-S close)
+    TimerNode rateTimer;  // end of a rate-limit pause (-P delay)
+    uint64_t lastActive = 0; // last time data arrived
+    uint64_t pingSent = 0;
+
+    // Rate limits (-L): frames and bytes this client may still send
+    TokenBucket msgBucket;
+    TokenBucket byteBucket;
+    bool rateNotified = false; // told that its messages are being dropped
+
+    // fd and generation in one word; this is what epoll hands back
+    uint64_t handle() const { return ((uint64_t)generation << 32) | (uint32_t)fd; }
+};
+
+// A reactor's open connections. Lookup is an index into an fd-sized array;
+// a second, dense array holds the live connections for iteration, and each
+// connection knows its place there, so insert and remove are O(1) (removal
+// swaps the last entry into the hole). Every accept of an fd bumps that
+// fd's generation, so a handle taken before the fd was closed and reused
+// no longer resolves.
+class ConnectionTable
+{
+public:
+    Connection *find(int fd) const
+    {
+        return (size_t)fd < byFd.size() ? byFd[fd] : nullptr;
+    }
+
+    Connection *find(uint64_t handle) const
+    {
+        Connection *c = find((int)(uint32_t)handle);
+        return (c && c->generation == (uint32_t)(handle >> 32)) ? c : nullptr;
+    }
+
+    void insert(Connection *c)
+    {
+        if ((size_t)c->fd >= byFd.size())
+        {
+            byFd.resize(c->fd + 1, nullptr);
+            generations.resize(c->fd + 1, 0);
+        }
+        // Generation 0 is never used, so a client handle is never a bare fd
+        if (++generations[c->fd] == 0)
+            ++generations[c->fd];
+        c->generation = generations[c->fd];
+        byFd[c->fd] = c;
+        c->liveIndex = (uint32_t)live.size();
+        live.push_back(c);
+    }
+
+    void remove(Connection *c)
+    {
+        Connection *last = live.back();
+        live[c->liveIndex] = last;
+        last->liveIndex = c->liveIndex;
+        live.pop_back();
+        byFd[c->fd] = nullptr;
+    }
+
+    size_t size() const { return live.size(); }
+    const vector<Connection *> &all() const { return live; }
+
+private:
+    vector<Connection *> byFd;
+    vector<uint32_t> generations; // last generation handed out, per fd
+    vector<Connection *> live;
+};
+
+// A chat room. Names are interned once into a process-wide table so that
+// reactors can refer to a room by a small dense id. The table only grows.
+struct RoomInfo
+{
+    uint32_t id = 0;
+    string name;
+    unique_ptr<atomic<int>[]> localMembers; // member count on each reactor
+    unique_ptr<HistoryLog> history;          // null unless history is on (-d)
+    atomic<int> peerSubscribers{0};          // peer nodes with members here, written by reactor 0
+};
+
+constexpr uint32_t LOBBY_ROOM = 0;         // every client starts here after JOIN
+constexpr uint32_t ALL_ROOMS = UINT32_MAX; // server announcements
+
+// One reactor's share of a room: its local members, packed densely so that
+// a broadcast walks the room only, never the whole connection set
+struct Room
+{
+    RoomInfo *info = nullptr;
+    vector<Connection *> members;
+    uint32_t slowMembers = 0;        // members above the high watermark
+    vector<uint64_t> pausedSenders;  // handles of members whose reads wait for them
+    TokenBucket msgBucket;           // room rate limit (-R) on this reactor
+    TokenBucket byteBucket;
+};
+
+// What a Post asks of the reactor that receives it
+enum class PostKind : uint8_t
+{
+    Deliver,     // queue msg for the local members of room
+    Forward,     // reactor 0: send msg to the peer nodes subscribed to room
+    Subscription // reactor 0: the room's membership on the posting reactor went from or to 0
+};
+
+// A broadcast handed to a reactor by another reactor or the operator
+// thread, linked into the target's lock-free inbox. Like MessageBuffers,
+// posts come from the posting reactor's pool and go back to it.
+struct Post
+{
+    Post *next = nullptr;
+    uint32_t room = ALL_ROOMS; // ALL_ROOMS reaches every client
+    PostKind kind = PostKind::Deliver;
+    RoomInfo *info = nullptr;  // Forward, Subscription: the room
+    MessageRef msg;
+    int sizeClass = -1;
+    SizeClassPool *pool = nullptr;
+
+    static Post *create(uint32_t room, const MessageRef &msg, PostKind kind = PostKind::Deliver,
+                        RoomInfo *info = nullptr)
+    {
+        int sizeClass;
+        SizeClassPool *pool;
+        Post *p = new (poolAllocate(sizeof(Post), sizeClass, pool)) Post();
+        p->room = room;
+        p->kind = kind;
+        p->info = info;
+        p->msg = msg;
+        p->sizeClass = sizeClass;
+        p->pool = pool;
+        return p;
+    }
+
+    void destroy()
+    {
+        int c = sizeClass;
+        SizeClassPool *owner = pool;
+        this->~Post();
+        poolRelease(this, c, owner);
+    }
+};
+
+// How output reaches the socket
+enum class WriteMode
+{
+    Now,  // write as soon as a message is queued
+    Tick, // one writev per client at the end of each loop iteration
+    Cork, // Tick, with TCP_CORK held across a flush that takes several writes
+    More  // Tick, with MSG_MORE on every write of a flush but the last
+};
+
+// What a connection timer is for (TimerNode::kind)
+enum class TimerKind : uint32_t
+{
+    Join,  // no JOIN yet: disconnect
+    Idle,  // nothing received for a while: send PING
+    Pong,  // PING unanswered: disconnect
+    Flush, // flush deadline reached
+    Slow,  // slow for the whole grace period: disconnect
+    Rate,  // rate-limit pause over: read again
+    PeerRetry // reactor 0: dial a peer node again (owner is the Peer)
+};
+
+// What happens to a frame over a client or room rate limit
+enum class RatePolicy
+{
+    Delay, // handle it, then stop reading from the client until it is back under
+    Drop,  // ignore it
+    Close  // disconnect the client
+};
+
+// What happens to a client whose queue passes the high watermark
+enum class SlowPolicy
+{
+    DropOldest, // drop its oldest queued messages to make room
+    Skip,       // do not queue chat lines for it; notices still go out
+    Close       // skip chat lines, and disconnect it after the grace period
+};
+
+constexpr uint32_t NO_ROOM = UINT32_MAX; // Peer: not subscribed
+
+// A link to another node of the cluster (-F, -C). All of them belong to
+// reactor 0. Frames queued for a peer during a tick go out together, in as
+// few writes as the socket allows.
+struct Peer
+{
+    int fd = -1;
+    string address;          // host:port this node dials; empty for an accepted link
+    sockaddr_in addr{};
+    bool connecting = false; // non-blocking connect() in progress
+    bool up = false;         // connected, our HELLO and subscriptions queued
+    bool helloSeen = false;  // the other side's HELLO has arrived
+    bool writeArmed = false; // EPOLLOUT requested
+    bool dead = false;       // accepted link that closed, removed at the end of the tick
+    FrameParser parser{FrameMode::Binary};
+    string out;              // frames not yet written
+    size_t outOffset = 0;    // bytes of `out` already written
+
+    // Rooms the peer has members in: the peer's id for each by our room
+    // id (NO_ROOM if not subscribed), and our room for each of the peer's
+    vector<uint32_t> remoteIds;
+    vector<RoomInfo *> localRooms;
+    TimerNode retryTimer;
+};
+
+// One event loop per thread. Each reactor owns its own listening socket
+// (SO_REUSEPORT lets the kernel spread incoming connections across them),
+// its own epoll instance and the clients it accepted.
+struct Reactor
+{
+    int id = 0;
+    int epollfd = -1;
+    int listenSocket = -1;
+    int wakefd = -1; // eventfd, signalled when the inbox goes from empty to not
+    thread worker;
+
+    ConnectionTable conns;
+    vector<Room> rooms; // indexed by room id
+    epoll_event events[MAX_EVENTS];
+
+    // Per-reactor allocators: connection objects and message buffers
+    SlabPool connPool;
+    SizeClassPool msgPool;
+    string scratch; // message bodies are assembled here, capacity is kept
+    // Every client is received into this: what an unfinished frame left
+    // (at most MAX_FRAME + FRAME_HEADER_SIZE), then one READ_SIZE read
+    vector<char> recvBuffer;
+
+    // Output queue statistics
+    Counter queuedBytes;         // unwritten bytes across all clients
+    size_t peakQueuedBytes = 0;
+    size_t peakClientQueue = 0;  // deepest single client queue seen
+    unsigned long long partialWrites = 0;
+
+    // Event loop counters
+    Counter wakeups;             // epoll_wait calls that returned events
+    Counter eventCount;          // events those calls returned
+    unsigned long long acceptCalls = 0;
+    unsigned long long accepted = 0;
+    unsigned long long recvCalls = 0;
+    unsigned long long budgetYields = 0; // reads cut short by READ_BUDGET
+    uint64_t recvNs = 0;                 // time of the recv() being handled
+    uint64_t tickNs = 0;                 // when the current loop iteration began
+
+    // Clients (by handle) with output queued this tick, flushed at the end
+    // of it. With a flush deadline (-f) a client waits on its flushTimer
+    // instead, until the deadline or until COALESCE_BYTES are queued.
+    vector<uint64_t> pendingFlush;
+
+    // Connection timers; the next deadline bounds epoll_wait
+    TimerWheel timers;
+
+    // Slow consumers that ran out of grace, disconnected at the end of the
+    // tick (never in the middle of a broadcast loop)
+    vector<uint64_t> evictions;
+
+    // Exported on the admin port; only this reactor writes them
+    Counter connections;
+    Counter messagesIn;          // frames received
+    Counter messagesOut;         // messages fully written to a client
+    Counter bytesIn;
+    Counter bytesOut;
+    Counter writeCalls;          // writev/sendmsg calls on client sockets
+    Counter slowConnections;     // clients above the high watermark now
+    Counter slowDrops;           // messages dropped or skipped for slow clients
+    Counter slowEvictions;       // slow clients disconnected
+    Counter readPauses;          // senders paused by read-side backpressure
+    Counter rateLimited;         // frames over a rate limit (delayed, dropped or fatal)
+    Counter pings;               // heartbeat PINGs sent
+    Counter timeouts;            // clients dropped for a missing JOIN or PONG
+    Counter armedTimers;         // timers on the wheel
+    Counter busyNs;              // time spent outside epoll_wait
+    Histogram fanoutLatency;     // recv to last send, ns
+    Histogram queueDepth;        // client queue bytes after each enqueue
+    Counter historyAppends;      // broadcasts appended to a room history
+    Counter replayBytes;         // history bytes written to joining clients
+
+    // Admin endpoint, reactor 0 only: pending replies by connection, and
+    // the busy time of every reactor at the previous scrape
+    int adminSocket = -1;
+    unordered_map<int, string> adminConns;
+    vector<uint64_t> scrapeBusyNs;
+    uint64_t scrapeNs = 0;
+
+    // Edge-triggered mode: connections (by handle) that still had data when
+    // their read budget ran out. epoll will not report them again, so they
+    // are revisited after the next epoll_wait.
+    vector<uint64_t> readyList;
+    vector<uint64_t> readyScratch;
+
+    // Broadcasts from other reactors and the operator thread
+    MpscQueue<Post> inbox;
+
+    // Rooms whose membership on this reactor went from or to 0 this tick;
+    // reactor 0 hears of them at the end of it (federation only)
+    vector<RoomInfo *> membershipChanges;
+
+    // Federation, reactor 0 only: the links to the other nodes, the socket
+    // they connect to, and the rooms this node has subscribed to at its
+    // peers (by room id, null if none)
+    vector<unique_ptr<Peer>> peers;
+    int peerSocket = -1;
+    vector<RoomInfo *> advertised;
+    Counter peerLinks;           // links up now
+    Counter peerMessagesIn;      // broadcasts received from peers
+    Counter peerMessagesOut;     // broadcasts forwarded to peers, once per peer
+    Counter peerBytesIn;
+    Counter peerBytesOut;
+};
+
+vector<unique_ptr<Reactor>> reactors;
+bool pinReactors = false;
+bool edgeTriggered = false;
+bool hugePages = false;
+int adminPort = ADMIN_PORT;
+int clientPort = PORT;
+int peerPort = 0;                // 0: accept no peer links
+bool federation = false;         // part of a cluster (-F or -C)
+string historyDir;               // empty: no history
+WriteMode writeMode = WriteMode::Tick;
+uint64_t flushDeadlineNs = 0;    // how long output may wait for more to join it
+bool noDelay = false;            // TCP_NODELAY on client sockets
+size_t highWatermark = HIGH_WATERMARK; // 0: client queues are unbounded
+size_t lowWatermark = LOW_WATERMARK;
+SlowPolicy slowPolicy = SlowPolicy::DropOldest;
+uint64_t slowGraceNs = SLOW_GRACE_MS * 1000000ULL;
+bool readBackpressure = false;   // pause senders while their room has a slow member
+int replayCount = REPLAY_COUNT;
+size_t maxRooms = MAX_ROOMS;
+uint64_t idleNs = IDLE_TIMEOUT_S * 1000000000ULL;     // 0: no heartbeat
+uint64_t pongNs = PONG_TIMEOUT_S * 1000000000ULL;
+uint64_t joinTimeoutNs = JOIN_TIMEOUT_S * 1000000000ULL; // 0: no JOIN deadline
+RateLimit clientMsgLimit, clientByteLimit; // per connection, all frames
+RateLimit roomMsgLimit, roomByteLimit;     // per room and reactor, chat lines
+RatePolicy ratePolicy = RatePolicy::Delay;
+
+// Room name table, only locked when a client joins a room
+mutex roomsMtx;
+unordered_map<string, unique_ptr<RoomInfo>> roomsByName;
+
+void set_non_blocking(int socket)
+{
+    int flags = fcntl(socket, F_GETFL, 0);
+
+    if (flags == -1)
+    {
+        perror("fcntl F_GETFL");
+        return;
+    }
+
+    if (fcntl(socket, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        perror("fcntl F_SETFL");
+        return;
+    }
+}
+
+void handle_sigint(int)
+{
+    cout << "\nSIGINT received, shutting down server...\n";
+    stop.store(true);
+    // shutdown(serverSocket, SHUT_RDWR);
+}
+
+int createListenSocket(int port, in_addr_t addr)
+{
+    sockaddr_in server_addr{};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = htonl(addr);
+    server_addr.sin_port = htons(port);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    set_non_blocking(fd);
+
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    // Every reactor binds the same port; the kernel load-balances accepts
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+
+    if (bind(fd, (sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+
+    if (listen(fd, 128) < 0)
+    {
+        perror("listen");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// `handle` is what epoll reports back; 0 means the bare fd
+bool addToEpoll(Reactor &r, int fd, uint32_t events = EPOLLIN, uint64_t handle = 0)
+{
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.u64 = handle ? handle : (uint32_t)fd;
+    if (epoll_ctl(r.epollfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+    {
+        perror("epoll_ctl: EPOLL_CTL_ADD");
+        return false;
+    }
+    return true;
+}
+
+// Directory name of a room's history: the room name with anything that is
+// not safe in a file name written as %XX
+string historyName(const string &room)
+{
+    string out;
+    for (unsigned char ch : room)
+    {
+        if (isalnum(ch) || ch == '-' || ch == '_')
+        {
+            out += (char)ch;
+        }
+        else
+        {
+            char hex[4];
+            snprintf(hex, sizeof(hex), "%%%02X", ch);
+            out += hex;
+        }
+    }
+    return out;
+}
+
+// Room names are short words, so they are safe in notices, metrics and
+// file names alike
+bool validRoomName(const string &name)
+{
+    if (name.empty() || name.size() > MAX_ROOM_NAME)
+        return false;
+    for (unsigned char ch : name)
+    {
+        if (!isalnum(ch) && ch != '-' && ch != '_' && ch != '.')
+            return false;
+    }
+    return true;
+}
+
+// The room called name, created on first use. Rooms are never freed: ids
+// index every reactor's room table. So past maxRooms (-n) no new room is
+// made and null is returned.
+RoomInfo *internRoom(const string &name)
+{
+    lock_guard<mutex> lock(roomsMtx);
+    auto it = roomsByName.find(name);
+    if (it != roomsByName.end())
+        return it->second.get();
+    if (roomsByName.size() >= maxRooms)
+        return nullptr;
+    unique_ptr<RoomInfo> &info = roomsByName[name];
+    info.reset(new RoomInfo());
+    info->id = (uint32_t)(roomsByName.size() - 1);
+    info->name = name;
+    info->localMembers.reset(new atomic<int>[reactors.size()]);
+    for (size_t i = 0; i < reactors.size(); i++)
+        info->localMembers[i].store(0);
+    // Opened on the history thread; until then the room stores and
+    // replays nothing (see openHistories)
+    if (!historyDir.empty())
+    {
+        info->history.reset(new HistoryLog());
+        info->history->open(historyDir + "/" + historyName(name));
+    }
+    return info.get();
+}
+
+// Open the log of every room that has a history directory before any
+// client arrives, so the room's first JOIN already finds it ready. Rooms
+// created later start empty, so there is nothing to replay while theirs
+// opens.
+void openHistories()
+{
+    DIR *d = opendir(historyDir.c_str());
+    if (!d)
+        return;
+    while (dirent *e = readdir(d))
+    {
+        // historyName() writes '.' as %2E, so this skips only . and ..
+        if (e->d_name[0] == '.')
+            continue;
+        string name;
+        for (const char *p = e->d_name; *p; p++)
+        {
+            unsigned int ch;
+            if (*p == '%' && sscanf(p + 1, "%2x", &ch) == 1)
+            {
+                name += (char)ch;
+                p += 2;
+            }
+            else
+            {
+                name += *p;
+            }
+        }
+        if (validRoomName(name) && !internRoom(name))
+            break; // out of rooms
+    }
+    closedir(d);
+    HistoryFiles::get().drain();
+}
+
+// epoll interest for a level-triggered client: EPOLLIN unless its reads are
+// paused, EPOLLOUT while output is waiting
+void updateEvents(Reactor &r, Connection &c, bool readable, bool writable)
+{
+    epoll_event ev{};
+    ev.events = (readable ? (uint32_t)EPOLLIN : 0) | (writable ? (uint32_t)EPOLLOUT : 0);
+    ev.data.u64 = c.handle();
+    if (epoll_ctl(r.epollfd, EPOLL_CTL_MOD, c.fd, &ev) == -1)
+        perror("epoll_ctl: EPOLL_CTL_MOD");
+}
+
+// Read-side backpressure, for one or more PAUSE_* reasons; reads resume
+// when no reason is left. Edge-triggered sockets stay registered and the
+// read loop just holds off. A resumed client is put on the ready list:
+// frames already read may be waiting in its pending block, and in
+// edge-triggered mode the edge for data that arrived meanwhile has been
+// used up.
+void setReadPaused(Reactor &r, Connection &c, uint8_t reasons, bool paused)
+{
+    uint8_t before = c.readPaused;
+    c.readPaused = paused ? (before | reasons) : (before & ~reasons);
+    if (!before == !c.readPaused)
+        return;
+    if (paused)
+        ++r.readPauses;
+
+    if (!edgeTriggered)
+        updateEvents(r, c, !paused, c.out.writeArmed);
+    if (!paused)
+        r.readyList.push_back(c.handle());
+}
+
+// Let the senders paused on a room read again once it has no slow member
+void resumeSenders(Reactor &r, Room &room)
+{
+    for (uint64_t handle : room.pausedSenders)
+    {
+        if (Connection *c = r.conns.find(handle))
+            setReadPaused(r, *c, PAUSE_SLOW_ROOM, false);
+    }
+    room.pausedSenders.clear();
+}
+
+void armTimer(Reactor &r, Connection &c, TimerNode &t, TimerKind kind, uint64_t deadline)
+{
+    t.owner = c.handle();
+    t.kind = (uint32_t)kind;
+    r.timers.arm(t, deadline);
+}
+
+void setSlow(Reactor &r, Connection &c, bool slow)
+{
+    if (c.slow == slow)
+        return;
+    c.slow = slow;
+    if (slow)
+        ++r.slowConnections;
+    else
+        r.slowConnections -= 1;
+
+    if (slow && slowPolicy == SlowPolicy::Close)
+        armTimer(r, c, c.slowTimer, TimerKind::Slow, r.tickNs + slowGraceNs);
+    else if (!slow)
+        r.timers.cancel(c.slowTimer);
+
+    for (uint32_t id : c.rooms)
+    {
+        Room &room = r.rooms[id];
+        if (slow)
+            room.slowMembers++;
+        else if (--room.slowMembers == 0)
+            resumeSenders(r, room);
+    }
+}
+
+// Add the client to a room and make it the room its messages go to.
+// Returns false if the client was already a member.
+bool joinRoom(Reactor &r, Connection &c, RoomInfo *info)
+{
+    auto it = find(c.rooms.begin(), c.rooms.end(), info->id);
+    if (it != c.rooms.end())
+    {
+        c.rooms.erase(it);
+        c.rooms.push_back(info->id);
+        return false;
+    }
+    c.rooms.push_back(info->id);
+
+    if (info->id >= r.rooms.size())
+        r.rooms.resize(info->id + 1);
+    Room &room = r.rooms[info->id];
+    room.info = info;
+    room.members.push_back(&c);
+    if (c.slow)
+        room.slowMembers++;
+    if (info->localMembers[r.id].fetch_add(1, memory_order_relaxed) == 0 && federation)
+        r.membershipChanges.push_back(info);
+    return true;
+}
+
+void leaveRoom(Reactor &r, Connection &c, uint32_t roomId)
+{
+    c.rooms.erase(remove(c.rooms.begin(), c.rooms.end(), roomId), c.rooms.end());
+
+    // Member order does not matter, so removal is a swap with the last slot
+    Room &room = r.rooms[roomId];
+    auto it = find(room.members.begin(), room.members.end(), &c);
+    if (it == room.members.end())
+        return;
+    *it = room.members.back();
+    room.members.pop_back();
+    if (room.info->localMembers[r.id].fetch_sub(1, memory_order_relaxed) == 1 && federation)
+        r.membershipChanges.push_back(room.info);
+    if (c.slow && --room.slowMembers == 0)
+        resumeSenders(r, room);
+}
+
+// Forget a client and return its state to the slab. The fd stays open.
+void removeClient(Reactor &r, Connection &c)
+{
+    setSlow(r, c, false);
+    while (!c.rooms.empty())
+        leaveRoom(r, c, c.rooms.back());
+
+    r.queuedBytes -= c.out.bytes;
+    c.replay.reset();
+    if (c.pending)
+        poolRelease(c.pending, c.pendingClass, c.pendingPool);
+    r.timers.cancel(c.liveTimer);
+    r.timers.cancel(c.flushTimer);
+    r.timers.cancel(c.slowTimer);
+    r.timers.cancel(c.rateTimer);
+    r.conns.remove(&c);
+    c.~Connection();
+    r.connPool.free(&c);
+}
+
+void setWriteInterest(Reactor &r, Connection &c, bool enable)
+{
+    // Edge-triggered sockets are registered for EPOLLOUT once, up front
+    OutputQueue &q = c.out;
+    if (edgeTriggered || q.writeArmed == enable)
+        return;
+
+    updateEvents(r, c, !c.readPaused, enable);
+    q.writeArmed = enable;
+}
+
+// Peer is gone. Drop what is queued and let the read side see EOF so the
+// usual leave path cleans the client up.
+void dropOutput(Reactor &r, Connection &conn)
+{
+    OutputQueue &q = conn.out;
+    r.queuedBytes -= q.bytes;
+    q.chunks.clear();
+    q.offset = 0;
+    q.bytes = 0;
+    conn.replay.reset();
+    setSlow(r, conn, false);
+    setReadPaused(r, conn, PAUSE_SLOW_ROOM | PAUSE_RATE, false); // the read side has to see the EOF
+    shutdown(conn.fd, SHUT_RDWR);
+}
+
+// Write as much of a history replay as the socket accepts, straight from
+// the log's mapped pages. Returns true once the replay is finished.
+bool flushReplay(Reactor &r, Connection &conn)
+{
+    OutputQueue &q = conn.out;
+    HistoryLog &log = *conn.replayLog;
+
+    while (!conn.replay.done())
+    {
+        iovec iov[MAX_IOV];
+        int iovcnt = log.gather(conn.replay, q.encoding, iov, MAX_IOV);
+        if (iovcnt == 0)
+        {
+            // End of a segment: go on to the next one, or finish
+            log.advance(conn.replay, q.encoding, 0);
+            continue;
+        }
+
+        size_t want = 0;
+        for (int i = 0; i < iovcnt; i++)
+            want += iov[i].iov_len;
+
+        ++r.writeCalls;
+        ssize_t n = writev(conn.fd, iov, iovcnt);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                dropOutput(r, conn);
+            break;
+        }
+
+        r.bytesOut += n;
+        r.replayBytes += n;
+        log.advance(conn.replay, q.encoding, n);
+        if ((size_t)n < want)
+        {
+            r.partialWrites++;
+            break;
+        }
+    }
+    return conn.replay.done();
+}
+
+void setCork(int fd, bool on)
+{
+    int opt = on;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_CORK, &opt, sizeof(opt)) < 0)
+        perror("setsockopt TCP_CORK");
+}
+
+// Write as much of the client's queue as the socket accepts
+void flushQueue(Reactor &r, Connection &conn)
+{
+    OutputQueue &q = conn.out;
+
+    while (!q.chunks.empty())
+    {
+        iovec iov[MAX_IOV];
+        int iovcnt = 0;
+        size_t want = 0;
+        size_t c = 0;
+        for (; c < q.chunks.size() && iovcnt + 2 <= MAX_IOV; c++)
+        {
+            OutChunk &chunk = q.chunks[c];
+            size_t skip = (c == 0) ? q.offset : 0;
+
+            if (skip < chunk.headerLength)
+            {
+                iov[iovcnt].iov_base = chunk.header + skip;
+                iov[iovcnt].iov_len = chunk.headerLength - skip;
+                want += iov[iovcnt++].iov_len;
+                skip = 0;
+            }
+            else
+            {
+                skip -= chunk.headerLength;
+            }
+
+            iov[iovcnt].iov_base = const_cast<char *>(chunk.msg->data()) + chunk.begin + skip;
+            iov[iovcnt].iov_len = chunk.end - chunk.begin - skip;
+            want += iov[iovcnt++].iov_len;
+        }
+
+        // Chunks left over for another write: tell the kernel more follows
+        ssize_t n;
+        ++r.writeCalls;
+        if (writeMode == WriteMode::More && c < q.chunks.size())
+        {
+            msghdr msg{};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iovcnt;
+            n = sendmsg(conn.fd, &msg, MSG_MORE | MSG_NOSIGNAL);
+        }
+        else
+        {
+            n = writev(conn.fd, iov, iovcnt);
+        }
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+
+            dropOutput(r, conn);
+            break;
+        }
+
+        q.bytes -= n;
+        r.queuedBytes -= n;
+        r.bytesOut += n;
+        size_t left = n;
+        while (left > 0)
+        {
+            size_t avail = q.chunks.front().size() - q.offset;
+            if (left < avail)
+            {
+                q.offset += left;
+                break;
+            }
+            left -= avail;
+            q.offset = 0;
+            q.chunks.pop_front();
+            ++r.messagesOut;
+        }
+        if (conn.slow && q.bytes <= lowWatermark)
+            setSlow(r, conn, false);
+
+        if ((size_t)n < want)
+        {
+            // Socket buffer is full, wait for EPOLLOUT
+            r.partialWrites++;
+            break;
+        }
+    }
+}
+
+// Write a pending replay, then the queue. EPOLLOUT stays armed only while
+// something is left over.
+void flushClient(Reactor &r, Connection &conn)
+{
+    OutputQueue &q = conn.out;
+    r.timers.cancel(conn.flushTimer);
+
+    // When this takes more than one write, cork the socket so only the end
+    // of the flush can leave as a short segment
+    bool cork = writeMode == WriteMode::Cork &&
+                (!conn.replay.done() || q.chunks.size() * 2 > (size_t)MAX_IOV);
+    if (cork)
+        setCork(conn.fd, true);
+
+    // A replay goes out before anything queued after it started
+    if (conn.replay.done() || flushReplay(r, conn))
+        flushQueue(r, conn);
+
+    if (cork)
+        setCork(conn.fd, false);
+    setWriteInterest(r, conn, !q.chunks.empty() || !conn.replay.done());
+}
+
+// Flush the clients that were handed output during the tick: each one gets
+// a single writev for everything queued since, instead of a write per
+// message.
+void flushPending(Reactor &r)
+{
+    for (uint64_t handle : r.pendingFlush)
+    {
+        if (Connection *c = r.conns.find(handle))
+            flushClient(r, *c);
+    }
+    r.pendingFlush.clear();
+}
+
+// Drop a client's oldest queued messages until `length` more bytes fit
+// under `limit`, but never the chunk that is half written
+void dropOldest(Reactor &r, Connection &c, size_t length, size_t limit)
+{
+    OutputQueue &q = c.out;
+    while (q.bytes + length + sizeof(OutChunk::header) > limit)
+    {
+        size_t i = q.offset ? 1 : 0;
+        if (i >= q.chunks.size())
+            break;
+        size_t bytes = q.chunks[i].size();
+        q.bytes -= bytes;
+        r.queuedBytes -= bytes;
+        if (i == 0)
+            q.chunks.pop_front();
+        else
+            q.chunks.pop_second();
+        ++r.slowDrops;
+    }
+}
+
+// Apply the slow-consumer policy to a client whose queue would pass the
+// high watermark with `msg`. Returns false if msg is not to be queued.
+bool makeRoom(Reactor &r, Connection &c, const MessageRef &msg)
+{
+    setSlow(r, c, true);
+
+    switch (slowPolicy)
+    {
+    case SlowPolicy::DropOldest:
+        dropOldest(r, c, msg->length, highWatermark);
+        return true;
+
+    case SlowPolicy::Close:
+        // Treated like Skip until its slowTimer runs out
+        // fall through
+    case SlowPolicy::Skip:
+        if (!msg->droppable)
+        {
+            // Notices still get through, but a client that reads nothing
+            // must not hold an unbounded queue of them
+            dropOldest(r, c, msg->length, 2 * highWatermark);
+            return true;
+        }
+        ++r.slowDrops;
+        return false;
+    }
+    return true;
+}
+
+// Queue a message for one client, optionally replacing its first `begin`
+// bytes with a short prefix (at most 4 bytes, e.g. "You"). Binary clients
+// get the line as a length-prefixed frame without its '\n'. Unless -w now
+// is given, nothing is written before the end of the tick; then whatever
+// the socket does not accept goes out on EPOLLOUT.
+void enqueueMessage(Reactor &r, Connection &c, const MessageRef &msg,
+                    uint32_t begin = 0, const char *prefix = "")
+{
+    OutputQueue &q = c.out;
+    // Nothing is sent before the client's first byte fixes its encoding
+    if (q.encoding == FrameMode::Detect)
+        return;
+    // Already on its way as part of a history replay
+    if (msg->seq && msg->room == c.replayRoom && msg->seq <= c.replayThrough)
+        return;
+    if (c.evicting)
+        return;
+    if (highWatermark && q.bytes + msg->length + sizeof(OutChunk::header) > highWatermark &&
+        !makeRoom(r, c, msg))
+        return;
+    bool wasEmpty = q.chunks.empty();
+
+    OutChunk &chunk = q.chunks.push_back();
+    chunk.msg = msg;
+    chunk.begin = begin;
+    chunk.end = msg->length;
+    chunk.headerLength = 0;
+
+    size_t prefixLength = strnlen(prefix, sizeof(chunk.header) - FRAME_HEADER_SIZE);
+    if (q.encoding == FrameMode::Binary)
+    {
+        chunk.end--; // drop the '\n'
+        encodeFrameHeader((uint32_t)(prefixLength + chunk.end - chunk.begin), chunk.header);
+        chunk.headerLength = FRAME_HEADER_SIZE;
+    }
+    memcpy(chunk.header + chunk.headerLength, prefix, prefixLength);
+    chunk.headerLength += prefixLength;
+
+    size_t bytes = chunk.size();
+    q.bytes += bytes;
+    r.queuedBytes += bytes;
+
+    r.peakClientQueue = max(r.peakClientQueue, q.bytes);
+    r.peakQueuedBytes = max(r.peakQueuedBytes, (size_t)r.queuedBytes.get());
+    r.queueDepth.record(q.bytes);
+
+    // A non-empty queue, or one behind a replay, is already waiting for
+    // EPOLLOUT, the end of the tick or its flush deadline. One that has
+    // grown past COALESCE_BYTES stops waiting for the deadline.
+    if (!c.replay.done())
+        return;
+    if (writeMode == WriteMode::Now)
+    {
+        if (wasEmpty)
+            flushClient(r, c);
+    }
+    else if (flushDeadlineNs && q.bytes < COALESCE_BYTES)
+    {
+        if (wasEmpty)
+            armTimer(r, c, c.flushTimer, TimerKind::Flush, r.tickNs + flushDeadlineNs);
+    }
+    else if (wasEmpty || c.flushTimer.armed())
+    {
+        r.timers.cancel(c.flushTimer);
+        r.pendingFlush.push_back(c.handle());
+    }
+}
+
+void cleanupClient(Reactor &r, Connection &c)
+{
+    int fd = c.fd;
+    removeClient(r, c);
+    r.connections -= 1;
+    close(fd);
+}
+
+uint32_t clientEvents()
+{
+    // Edge-triggered clients watch both directions permanently, so output
+    // queues never need an epoll_ctl to arm or disarm EPOLLOUT
+    return edgeTriggered ? (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) : EPOLLIN;
+}
+
+// Accept everything in the backlog. accept4() hands back sockets that are
+// already non-blocking, saving two fcntl() calls per connection.
+void handleNewConnection(Reactor &r)
+{
+    while (true)
+    {
+        sockaddr_in client_addr{};
+        socklen_t len = sizeof(client_addr);
+
+        r.acceptCalls++;
+        int client_fd = accept4(r.listenSocket, (sockaddr*)&client_addr, &len,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return; // backlog drained (or another reactor took it)
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept4");
+            return;
+        }
+
+        // Create per-client state now, not on the broadcast path
+        void *mem = r.connPool.allocate();
+        if (!mem)
+        {
+            cerr << "reactor " << r.id << ": out of connection slabs\n";
+            close(client_fd);
+            continue;
+        }
+        Connection *c = new (mem) Connection();
+        c->fd = client_fd;
+        r.conns.insert(c);
+        c->lastActive = r.tickNs;
+        if (joinTimeoutNs)
+            armTimer(r, *c, c->liveTimer, TimerKind::Join, r.tickNs + joinTimeoutNs);
+
+        if (noDelay)
+        {
+            int one = 1;
+            if (setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0)
+                perror("setsockopt TCP_NODELAY");
+        }
+
+        // Add client to this reactor's epoll set, tagged with its handle
+        if (!addToEpoll(r, client_fd, clientEvents(), c->handle()))
+        {
+            removeClient(r, *c);
+            close(client_fd);
+            continue;
+        }
+        r.accepted++;
+        ++r.connections;
+    }
+}
+
+// Hand a fully formatted message to a reactor and wake it up. Safe from
+// any thread: it neither locks nor blocks.
+void postToReactor(Reactor &target, uint32_t room, const MessageRef &msg,
+                   PostKind kind = PostKind::Deliver, RoomInfo *info = nullptr)
+{
+    // Only the first post needs a wakeup; the rest ride along with it
+    if (target.inbox.push(Post::create(room, msg, kind, info)))
+    {
+        uint64_t one = 1;
+        if (write(target.wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            perror("write: wakefd");
+    }
+}
+
+// Pass a message on to the reactors that have members in the room
+void postToOtherReactors(Reactor &r, const RoomInfo *room, const MessageRef &msg)
+{
+    for (auto &other : reactors)
+    {
+        if (other.get() != &r && room->localMembers[other->id].load(memory_order_relaxed) > 0)
+            postToReactor(*other, room->id, msg);
+    }
+}
+
+// ---- Federation ----
+//
+// Several server processes form a cluster: each accepts peer links (-F)
+// and dials the nodes started before it (-C), so every pair of nodes
+// shares one persistent TCP link, owned by reactor 0 on both sides. A node
+// subscribes at its peers to the rooms it has members in, and forwards a
+// broadcast only to the peers subscribed to its room. A broadcast that
+// arrived from a peer is delivered locally and not forwarded again, which
+// is why the cluster has to be a full mesh.
+//
+// Links carry binary frames (common/frame.h). The first payload byte is
+// the frame type; room ids are 4 bytes, big-endian:
+//   H chat-federation/1               first frame in each direction
+//   S <id> <room name>                the sender has members in room <id>
+//   U <id>                            ... not any more
+//   M <id> <flags> <nameLength> <line> a broadcast
+// A broadcast names its room by the id the receiver subscribed with, so it
+// is delivered without looking the name up.
+
+const char FEDERATION_HELLO[] = "chat-federation/1";
+constexpr size_t PEER_MESSAGE_HEADER = 7;  // M, id, flags, nameLength
+constexpr uint8_t PEER_DROPPABLE = 1;      // M flags: a chat line rather than a notice
+constexpr uint32_t MAX_PEER_ROOM = 1 << 24; // bounds the peer's room ids we keep a table for
+
+void putRoomId(char *out, uint32_t id)
+{
+    encodeFrameHeader(id, out); // same 4-byte big-endian layout
+}
+
+uint32_t getRoomId(const char *in)
+{
+    const uint8_t *b = (const uint8_t *)in;
+    return (uint32_t)b[0] << 24 | (uint32_t)b[1] << 16 | (uint32_t)b[2] << 8 | b[3];
+}
+
+string peerLabel(const Peer &p)
+{
+    return p.address.empty() ? "fd " + to_string(p.fd) : p.address;
+}
+
+// Append one frame, head then body, to a peer's output
+void queuePeerFrame(Peer &p, const char *head, size_t headLength, const char *body = nullptr,
+                    size_t bodyLength = 0)
+{
+    char header[FRAME_HEADER_SIZE];
+    encodeFrameHeader((uint32_t)(headLength + bodyLength), header);
+    p.out.append(header, FRAME_HEADER_SIZE);
+    p.out.append(head, headLength);
+    if (bodyLength)
+        p.out.append(body, bodyLength);
+}
+
+void sendSubscription(Peer &p, const RoomInfo *info, bool subscribe)
+{
+    char head[5];
+    head[0] = subscribe ? 'S' : 'U';
+    putRoomId(head + 1, info->id);
+    if (subscribe)
+        queuePeerFrame(p, head, sizeof(head), info->name.data(), info->name.size());
+    else
+        queuePeerFrame(p, head, sizeof(head));
+}
+
+// Reactor 0: subscribe at the peers to a room this node now has members
+// in, or unsubscribe from one it has none in any more. Every reactor's
+// count is read afresh, so changes that arrive out of order still settle
+// on the right answer.
+void updateSubscription(Reactor &r, RoomInfo *info)
+{
+    int members = 0;
+    for (auto &other : reactors)
+        members += info->localMembers[other->id].load(memory_order_relaxed);
+    bool subscribe = members > 0;
+
+    if (info->id >= r.advertised.size())
+        r.advertised.resize(info->id + 1, nullptr);
+    if ((r.advertised[info->id] != nullptr) == subscribe)
+        return;
+    r.advertised[info->id] = subscribe ? info : nullptr;
+    for (auto &p : r.peers)
+    {
+        if (p->up)
+            sendSubscription(*p, info, subscribe);
+    }
+}
+
+// Hand this tick's membership changes to reactor 0
+void publishMembership(Reactor &r)
+{
+    for (RoomInfo *info : r.membershipChanges)
+    {
+        if (r.id == 0)
+            updateSubscription(r, info);
+        else
+            postToReactor(*reactors[0], info->id, MessageRef(), PostKind::Subscription, info);
+    }
+    r.membershipChanges.clear();
+}
+
+// Reactor 0: queue a local broadcast for every peer subscribed to its room
+void forwardToPeers(Reactor &r, const RoomInfo *info, const MessageRef &msg)
+{
+    // A line close to the client frame limit stays on this node
+    if (msg->length + PEER_MESSAGE_HEADER > MAX_FRAME)
+        return;
+
+    for (auto &p : r.peers)
+    {
+        if (!p->up || info->id >= p->remoteIds.size() || p->remoteIds[info->id] == NO_ROOM)
+            continue;
+        char head[PEER_MESSAGE_HEADER];
+        head[0] = 'M';
+        putRoomId(head + 1, p->remoteIds[info->id]);
+        head[5] = (char)(msg->droppable ? PEER_DROPPABLE : 0);
+        head[6] = (char)msg->nameLength;
+        queuePeerFrame(*p, head, sizeof(head), msg->data(), msg->length);
+        ++r.peerMessagesOut;
+    }
+}
+
+// Pass a local broadcast on to the peers subscribed to its room, through
+// reactor 0, which owns the links
+void federate(Reactor &r, RoomInfo *info, const MessageRef &msg)
+{
+    if (info->peerSubscribers.load(memory_order_relaxed) == 0)
+        return;
+    if (r.id == 0)
+        forwardToPeers(r, info, msg);
+    else
+        postToReactor(*reactors[0], info->id, msg, PostKind::Forward, info);
+}
+
+// Append a broadcast to its room's history, if the room keeps one
+void recordHistory(Reactor &r, RoomInfo *info, const MessageRef &msg)
+{
+    if (HistoryLog *log = info->history.get())
+    {
+        // Logged without its '\n'; the log adds its own framing
+        msg->room = info->id;
+        msg->seq = log->append(msg->data(), msg->length - 1);
+        if (msg->seq)
+            ++r.historyAppends;
+    }
+}
+
+// Reactor 0: a broadcast from a peer, for this node's members of the room
+void deliverFromPeer(Reactor &r, RoomInfo *info, uint8_t flags, const char *line, size_t length,
+                     size_t nameLength)
+{
+    MessageRef msg(MessageBuffer::create(line, nameLength, line + nameLength, length - nameLength));
+    msg->recvNs = r.recvNs;
+    msg->droppable = (flags & PEER_DROPPABLE) != 0;
+    recordHistory(r, info, msg);
+    if (info->id < r.rooms.size())
+    {
+        for (Connection *c : r.rooms[info->id].members)
+            enqueueMessage(r, *c, msg);
+    }
+    postToOtherReactors(r, info, msg);
+    ++r.peerMessagesIn;
+}
+
+// Close a peer link and forget the peer's subscriptions. A peer this node
+// dials is dialed again after PEER_RETRY_MS; an accepted link is removed
+// at the end of the tick.
+void dropPeer(Reactor &r, Peer &p, const char *why)
+{
+    if (p.up)
+    {
+        cout << "\nPeer " << peerLabel(p) << " " << why << "\n";
+        r.peerLinks -= 1;
+    }
+    for (RoomInfo *info : p.localRooms)
+    {
+        if (info)
+            info->peerSubscribers.fetch_sub(1, memory_order_relaxed);
+    }
+    p.localRooms.clear();
+    p.remoteIds.clear();
+
+    if (p.fd >= 0)
+        close(p.fd);
+    p.fd = -1;
+    p.connecting = p.up = p.helloSeen = p.writeArmed = false;
+    p.parser = FrameParser(FrameMode::Binary);
+    p.out.clear();
+    p.outOffset = 0;
+
+    if (p.address.empty())
+    {
+        p.dead = true;
+        return;
+    }
+    p.retryTimer.owner = (uint64_t)(uintptr_t)&p;
+    p.retryTimer.kind = (uint32_t)TimerKind::PeerRetry;
+    r.timers.arm(p.retryTimer, r.tickNs + PEER_RETRY_MS * 1000000ULL);
+}
+
+// A link is connected: introduce this node and subscribe to its rooms
+void linkUp(Reactor &r, Peer &p)
+{
+    p.up = true;
+    ++r.peerLinks;
+    cout << "\nPeer " << peerLabel(p) << " linked\n";
+
+    queuePeerFrame(p, "H", 1, FEDERATION_HELLO, sizeof(FEDERATION_HELLO) - 1);
+    for (RoomInfo *info : r.advertised)
+    {
+        if (info)
+            sendSubscription(p, info, true);
+    }
+}
+
+// One frame from a peer; false if it breaks the protocol
+bool handlePeerFrame(Reactor &r, Peer &p, const char *frame, size_t length)
+{
+    if (length == 0)
+        return false;
+    if (!p.helloSeen)
+    {
+        p.helloSeen = frame[0] == 'H' && string(frame + 1, length - 1) == FEDERATION_HELLO;
+        return p.helloSeen;
+    }
+
+    switch (frame[0])
+    {
+    case 'M':
+    {
+        if (length < PEER_MESSAGE_HEADER)
+            return false;
+        uint32_t id = getRoomId(frame + 1);
+        size_t nameLength = (uint8_t)frame[6];
+        size_t lineLength = length - PEER_MESSAGE_HEADER;
+        const char *line = frame + PEER_MESSAGE_HEADER;
+        // A whole line after the name, as a client broadcast always is
+        if (lineLength == 0 || line[lineLength - 1] != '\n' || nameLength >= lineLength)
+            return false;
+        // Crossed our unsubscribe on the way: nobody here to deliver to
+        RoomInfo *info = id < r.advertised.size() ? r.advertised[id] : nullptr;
+        if (info)
+            deliverFromPeer(r, info, (uint8_t)frame[5], line, lineLength, nameLength);
+        return true;
+    }
+
+    case 'S':
+    {
+        if (length < 6)
+            return false;
+        uint32_t theirs = getRoomId(frame + 1);
+        if (theirs >= MAX_PEER_ROOM)
+            return false;
+        if (theirs >= p.localRooms.size())
+            p.localRooms.resize(theirs + 1, nullptr);
+        if (p.localRooms[theirs])
+            return true;
+
+        string name(frame + 5, length - 5);
+        if (!validRoomName(name))
+            return false;
+        RoomInfo *info = internRoom(name);
+        // Out of rooms: its messages for that one are not wanted here
+        if (!info)
+            return true;
+        if (info->id >= p.remoteIds.size())
+            p.remoteIds.resize(info->id + 1, NO_ROOM);
+        // One id per room: a second one would be counted twice
+        if (p.remoteIds[info->id] != NO_ROOM)
+            return false;
+        p.localRooms[theirs] = info;
+        p.remoteIds[info->id] = theirs;
+        info->peerSubscribers.fetch_add(1, memory_order_relaxed);
+        return true;
+    }
+
+    case 'U':
+    {
+        if (length != 5)
+            return false;
+        uint32_t theirs = getRoomId(frame + 1);
+        if (theirs < p.localRooms.size() && p.localRooms[theirs])
+        {
+            RoomInfo *info = p.localRooms[theirs];
+            p.remoteIds[info->id] = NO_ROOM;
+            p.localRooms[theirs] = nullptr;
+            info->peerSubscribers.fetch_sub(1, memory_order_relaxed);
+        }
+        return true;
+    }
+    }
+    return false;
+}
+
+void readPeer(Reactor &r, Peer &p)
+{
+    for (int i = 0; i < READ_BUDGET; i++)
+    {
+        ssize_t n = recv(p.fd, p.parser.prepare(READ_SIZE), READ_SIZE, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0)
+        {
+            dropPeer(r, p, n == 0 ? "closed the link" : "link failed");
+            return;
+        }
+        p.parser.commit(n);
+        r.peerBytesIn += n;
+        r.recvNs = nowNs();
+
+        const char *frame;
+        size_t length;
+        FrameParser::Result res;
+        while ((res = p.parser.next(frame, length)) == FrameParser::Frame)
+        {
+            if (!handlePeerFrame(r, p, frame, length))
+                break;
+        }
+        if (res != FrameParser::NeedMore)
+        {
+            dropPeer(r, p, "broke the protocol");
+            return;
+        }
+    }
+}
+
+// Write as much of a peer's output as the socket takes; wait for EPOLLOUT
+// while anything is left
+void writePeer(Reactor &r, Peer &p)
+{
+    while (p.outOffset < p.out.size())
+    {
+        ssize_t n = send(p.fd, p.out.data() + p.outOffset, p.out.size() - p.outOffset, MSG_NOSIGNAL);
+        if (n > 0)
+        {
+            p.outOffset += n;
+            r.peerBytesOut += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        dropPeer(r, p, "link failed");
+        return;
+    }
+
+    // The buffer keeps its capacity; a large written head is cut off
+    if (p.outOffset == p.out.size())
+    {
+        p.out.clear();
+        p.outOffset = 0;
+    }
+    else if (p.outOffset > p.out.size() / 2)
+    {
+        p.out.erase(0, p.outOffset);
+        p.outOffset = 0;
+    }
+
+    bool pending = !p.out.empty();
+    if (pending != p.writeArmed)
+    {
+        epoll_event ev{};
+        ev.events = EPOLLIN | (pending ? (uint32_t)EPOLLOUT : 0);
+        ev.data.u64 = (uint32_t)p.fd;
+        if (epoll_ctl(r.epollfd, EPOLL_CTL_MOD, p.fd, &ev) == -1)
+            perror("epoll_ctl: EPOLL_CTL_MOD");
+        p.writeArmed = pending;
+    }
+}
+
+// Start a non-blocking connect to a peer; it completes on EPOLLOUT
+void dialPeer(Reactor &r, Peer &p)
+{
+    p.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (p.fd >= 0)
+    {
+        int one = 1;
+        setsockopt(p.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if ((connect(p.fd, (sockaddr *)&p.addr, sizeof(p.addr)) == 0 || errno == EINPROGRESS) &&
+            addToEpoll(r, p.fd, EPOLLOUT))
+        {
+            p.connecting = true;
+            return;
+        }
+    }
+    dropPeer(r, p, "unreachable");
+}
+
+void acceptPeer(Reactor &r)
+{
+    while (true)
+    {
+        int fd = accept4(r.peerSocket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept4: peer");
+            return;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (!addToEpoll(r, fd))
+        {
+            close(fd);
+            continue;
+        }
+        r.peers.emplace_back(new Peer());
+        r.peers.back()->fd = fd;
+        linkUp(r, *r.peers.back());
+    }
+}
+
+Peer *findPeer(Reactor &r, int fd)
+{
+    for (auto &p : r.peers)
+    {
+        if (p->fd == fd)
+            return p.get();
+    }
+    return nullptr;
+}
+
+void handlePeerEvent(Reactor &r, Peer &p, uint32_t events)
+{
+    if (p.connecting)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(p.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+        {
+            dropPeer(r, p, "unreachable");
+            return;
+        }
+        // Registered for EPOLLOUT only; writePeer() settles the interest
+        p.connecting = false;
+        p.writeArmed = true;
+        linkUp(r, p);
+        writePeer(r, p);
+        return;
+    }
+
+    if (events & EPOLLOUT)
+        writePeer(r, p);
+    if (p.fd >= 0 && (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+        readPeer(r, p);
+}
+
+// End of a tick on reactor 0: write what the tick queued for each peer,
+// drop links that have fallen too far behind, and remove closed accepted
+// links
+void flushPeers(Reactor &r)
+{
+    for (auto &p : r.peers)
+    {
+        if (!p->up)
+            continue;
+        if (!p->writeArmed && p->outOffset < p->out.size())
+            writePeer(r, *p);
+        if (p->up && p->out.size() - p->outOffset > PEER_QUEUE_LIMIT)
+            dropPeer(r, *p, "fell too far behind");
+    }
+    r.peers.erase(remove_if(r.peers.begin(), r.peers.end(),
+                            [](const unique_ptr<Peer> &p) { return p->dead; }),
+                  r.peers.end());
+}
+
+// Deliver messages posted by other reactors to the local clients, and on
+// reactor 0 take over their federation work
+void drainInbox(Reactor &r)
+{
+    uint64_t count;
+    if (read(r.wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("read: wakefd");
+
+    Post *post = r.inbox.popAll();
+    while (post)
+    {
+        if (post->kind == PostKind::Forward)
+        {
+            forwardToPeers(r, post->info, post->msg);
+        }
+        else if (post->kind == PostKind::Subscription)
+        {
+            updateSubscription(r, post->info);
+        }
+        else if (post->room == ALL_ROOMS)
+        {
+            for (Connection *c : r.conns.all())
+                enqueueMessage(r, *c, post->msg);
+        }
+        else if (post->room < r.rooms.size())
+        {
+            for (Connection *c : r.rooms[post->room].members)
+                enqueueMessage(r, *c, post->msg);
+        }
+
+        Post *next = post->next;
+        post->destroy();
+        post = next;
+    }
+}
+
+// Send a message from a client to everyone in one room. Chat lines are
+// `droppable`: a slow consumer may be skipped; presence notices are not.
+void broadcastMessage(Reactor &r, Connection &sender, uint32_t roomId, const string &body,
+                      bool droppable = false)
+{
+    // Serialized once; recipients share it
+    MessageRef msg(MessageBuffer::create(sender.name, sender.nameLength, body.data(), body.size()));
+    msg->recvNs = r.recvNs;
+    msg->droppable = droppable;
+    Room &room = r.rooms[roomId];
+    recordHistory(r, room.info, msg);
+    for (Connection *c : room.members) {
+        if(c != &sender) {
+            enqueueMessage(r, *c, msg);
+        } else {
+            // The sender sees "You" in place of its own name
+            enqueueMessage(r, *c, msg, msg->nameLength, "You");
+        }
+    }
+
+    postToOtherReactors(r, room.info, msg);
+    federate(r, room.info, msg);
+}
+
+// How notices name a room; the lobby keeps the original wording
+string roomLabel(const RoomInfo *info)
+{
+    return info->id == LOBBY_ROOM ? "the chat" : "#" + info->name;
+}
+
+// Announce the client's departure in every room it is in
+void broadcastLeave(Reactor &r, Connection &c)
+{
+    for (uint32_t id : c.rooms)
+        broadcastMessage(r, c, id, " has left " + roomLabel(r.rooms[id].info) + ".\n");
+}
+
+// Disconnect the slow consumers that ran out of grace. Their leave notices
+// may push others over the edge, so the list is walked until it is empty.
+void evictSlow(Reactor &r)
+{
+    for (size_t i = 0; i < r.evictions.size(); i++)
+    {
+        Connection *c = r.conns.find(r.evictions[i]);
+        if (!c)
+            continue;
+        cout << "\nClient " << c->fd << "[" << c->name << "]" << " too slow, disconnected (reactor " << r.id << ", total: " << r.conns.size() << ")\n";
+        ++r.slowEvictions;
+        broadcastLeave(r, *c);
+        cleanupClient(r, *c);
+    }
+    r.evictions.clear();
+}
+
+// Reply to one client only
+void sendNotice(Reactor &r, Connection &c, const string &text)
+{
+    MessageRef msg(MessageBuffer::create("[SERVER]: ", text.data(), text.size()));
+    enqueueMessage(r, c, msg);
+}
+
+// Stream a room's history to the client from the log's mapped segments:
+// the records after `afterSeq`, at most the last `count` of them. Live messages queue up behind it, followed by a notice
+// carrying the last replayed sequence number for a later "JOIN room @seq".
+void startReplay(Reactor &r, Connection &c, RoomInfo *info, uint64_t afterSeq, uint64_t count)
+{
+    HistoryLog *log = info->history.get();
+    if (!log || count == 0 || c.out.encoding == FrameMode::Detect)
+        return;
+    // A room's log opens when the room is created, which is when it has no
+    // history yet
+    if (!log->ready())
+        return;
+    if (!c.replay.done())
+    {
+        sendNotice(r, c, "a history replay is already running\n");
+        return;
+    }
+
+    uint64_t last = log->lastSeq();
+    if (last > count)
+        afterSeq = max(afterSeq, last - count);
+    if (!log->seek(afterSeq, c.replay))
+        return;
+
+    c.replayLog = log;
+    c.replayRoom = info->id;
+    c.replayThrough = c.replay.lastSeq;
+    sendNotice(r, c, "history of " + roomLabel(info) + " up to message " + to_string(c.replayThrough) + "\n");
+    flushClient(r, c);
+}
+
+// A room JOIN may end in a replay request: " <count>" for the last count
+// messages, or " @<seq>" for everything after seq, and is cut off `length`.
+// Returns false if there is none.
+bool parseReplay(const char *arg, size_t &length, uint64_t &afterSeq, uint64_t &count)
+{
+    const char *space = (const char *)memrchr(arg, ' ', length);
+    if (!space)
+        return false;
+    const char *p = space + 1, *end = arg + length;
+    bool after = (p < end && *p == '@');
+    if (after)
+        p++;
+    if (p == end)
+        return false;
+
+    uint64_t value = 0;
+    for (; p < end; p++)
+    {
+        if (*p < '0' || *p > '9')
+            return false;
+        value = value * 10 + (*p - '0');
+    }
+    afterSeq = after ? value : 0;
+    count = after ? UINT64_MAX : value;
+    length = space - arg;
+    return true;
+}
+
+// "JOIN #room", "JOIN room" and "LEAVE room" take the same room names
+string roomName(const char *arg, size_t length)
+{
+    if (length > 0 && arg[0] == '#')
+    {
+        arg++;
+        length--;
+    }
+    return string(arg, length);
+}
+
+enum class RateVerdict
+{
+    Pass,
+    Drop,
+    Close
+};
+
+// Charge a frame to a pair of buckets, a client's or a room's. With -P
+// delay the frame always passes, and a bucket it leaves empty pauses the
+// client's reads until it has refilled. Otherwise the frame passes only if
+// neither bucket is empty. -P close disconnects only over a client's own
+// limit (own); a busy room is shared, so its overage is dropped instead.
+RateVerdict limitRate(Reactor &r, Connection &c, TokenBucket &msgs, TokenBucket &bytes,
+                      const RateLimit &msgLimit, const RateLimit &byteLimit, size_t length, bool own)
+{
+    uint64_t now = nowNs();
+    // Both buckets refill, so not &&
+    bool ok = (!msgLimit.enabled() || msgs.ready(msgLimit, now)) &
+              (!byteLimit.enabled() || bytes.ready(byteLimit, now));
+    if (ok || ratePolicy == RatePolicy::Delay)
+    {
+        if (msgLimit.enabled())
+            msgs.spend(1);
+        if (byteLimit.enabled())
+            bytes.spend((double)length);
+    }
+
+    if (ratePolicy == RatePolicy::Delay)
+    {
+        uint64_t wait = max(msgLimit.enabled() ? msgs.waitNs(msgLimit) : 0,
+                            byteLimit.enabled() ? bytes.waitNs(byteLimit) : 0);
+        if (wait)
+        {
+            ++r.rateLimited;
+            setReadPaused(r, c, PAUSE_RATE, true);
+            armTimer(r, c, c.rateTimer, TimerKind::Rate, now + wait);
+        }
+        return RateVerdict::Pass;
+    }
+
+    if (ok)
+    {
+        c.rateNotified = false;
+        return RateVerdict::Pass;
+    }
+    ++r.rateLimited;
+    if (ratePolicy == RatePolicy::Close && own)
+        return RateVerdict::Close;
+    if (!c.rateNotified)
+    {
+        c.rateNotified = true;
+        sendNotice(r, c, "rate limit exceeded, messages are dropped\n");
+    }
+    return RateVerdict::Drop;
+}
+
+void closeOverLimit(Reactor &r, Connection &c)
+{
+    cout << "\nClient " << c.fd << "[" << c.name << "]" << " over the rate limit (reactor " << r.id << ", total: " << r.conns.size() << ")\n";
+    broadcastLeave(r, c);
+    cleanupClient(r, c);
+}
+
+// Act on one complete frame. Returns false once the client is gone.
+//
+//   JOIN <name>   first JOIN: pick a name and enter the lobby
+//   JOIN <room>   later JOINs: enter a room (or switch to it) and talk there
+//   LEAVE <room>  leave a room
+//   PART          leave the room currently talked in
+//   PING          answered with PONG
+//   PONG          answer to the server's heartbeat PING; not relayed
+//   #             disconnect
+bool handleFrame(Reactor &r, Connection &c, const char *frame, size_t length)
+{
+    // Any frame shows the client is alive (see lastActive); these two carry
+    // nothing else
+    if (length == 4 && strncmp(frame, "PONG", 4) == 0)
+        return true;
+    if (length == 4 && strncmp(frame, "PING", 4) == 0)
+    {
+        MessageRef pong(MessageBuffer::create("", "PONG\n", 5));
+        enqueueMessage(r, c, pong);
+        return true;
+    }
+
+    // Check for disconnect message
+    if (length > 0 && frame[0] == '#')
+    {
+        cout << "\nClient " << c.fd << "[" << c.name << "]" << " sent disconnect (reactor " << r.id << ", total: " << r.conns.size() << ")\n";
+        broadcastLeave(r, c);
+        cleanupClient(r, c);
+        return false;
+    }
+
+    if (length >= 5 && strncmp(frame, "JOIN ", 5) == 0 && !c.named)
+    {
+        if (length == 5)
+        {
+            sendNotice(r, c, "JOIN needs a name\n");
+            return true;
+        }
+        c.named = true;
+        c.nameLength = (uint8_t)min(length - 5, MAX_NAME);
+        memcpy(c.name, frame + 5, c.nameLength);
+        c.name[c.nameLength] = '\0';
+        // The JOIN deadline is met; from now on the timer is the heartbeat
+        if (idleNs)
+            armTimer(r, c, c.liveTimer, TimerKind::Idle, r.tickNs + idleNs);
+        else
+            r.timers.cancel(c.liveTimer);
+        RoomInfo *lobby = internRoom("lobby");
+        // Replayed first, so the join notice follows the history
+        startReplay(r, c, lobby, 0, replayCount);
+        joinRoom(r, c, lobby);
+        broadcastMessage(r, c, LOBBY_ROOM, " has joined the chat.\n");
+        cout << "\nClient " << c.fd << "[" << c.name <<  "]: " << "connected (reactor " << r.id << ", total: " << r.conns.size() << ")\n";
+        return true;
+    }
+
+    if (length >= 5 && strncmp(frame, "JOIN ", 5) == 0)
+    {
+        // "JOIN room 20" replays the last 20 messages, "JOIN room @N" those
+        // after message N; a plain JOIN replays the default count on entry
+        size_t argLength = length - 5;
+        uint64_t afterSeq = 0, count = 0;
+        bool explicitReplay = parseReplay(frame + 5, argLength, afterSeq, count);
+        string name = roomName(frame + 5, argLength);
+        if (!validRoomName(name))
+        {
+            sendNotice(r, c, "room names are up to " + to_string(MAX_ROOM_NAME) + " letters, digits, '-', '_' or '.'\n");
+            return true;
+        }
+        RoomInfo *info = internRoom(name);
+        if (!info)
+        {
+            sendNotice(r, c, "no more rooms can be created\n");
+            return true;
+        }
+        bool member = find(c.rooms.begin(), c.rooms.end(), info->id) != c.rooms.end();
+        if (explicitReplay)
+            startReplay(r, c, info, afterSeq, count);
+        else if (!member)
+            startReplay(r, c, info, 0, replayCount);
+        if (joinRoom(r, c, info))
+            broadcastMessage(r, c, info->id, " has joined " + roomLabel(info) + ".\n");
+        return true;
+    }
+
+    vector<uint32_t> &joined = c.rooms;
+    if ((length >= 6 && strncmp(frame, "LEAVE ", 6) == 0) ||
+        (length == 4 && strncmp(frame, "PART", 4) == 0))
+    {
+        uint32_t roomId = ALL_ROOMS;
+        if (length == 4)
+        {
+            if (!joined.empty())
+                roomId = joined.back();
+        }
+        else
+        {
+            string name = roomName(frame + 6, length - 6);
+            for (uint32_t id : joined)
+            {
+                if (r.rooms[id].info->name == name)
+                    roomId = id;
+            }
+        }
+
+        if (roomId == ALL_ROOMS)
+        {
+            sendNotice(r, c, "not in that room\n");
+            return true;
+        }
+        broadcastMessage(r, c, roomId, " has left " + roomLabel(r.rooms[roomId].info) + ".\n");
+        leaveRoom(r, c, roomId);
+        return true;
+    }
 
-atomic<bool> stop{false};
-int serverSocket = -1;
+    if (joined.empty())
+    {
+        sendNotice(r, c, "join a room first\n");
+        return true;
+    }
 
-mutex mtx;
-vector<int> clientSockets;
-unordered_map<int, string> clientNames;
+    // Messages go to the room joined (or switched to) last
+    uint32_t roomId = joined.back();
+    cout << "\nClient " << c.fd << "[" << c.name << "]" << " message: ";
+    cout.write(frame, length) << "\n";
 
-struct epoll_event ev, events[MAX_CONNECTION + 2];
-int epollfd;
+    // The room's share of the limit on this reactor; one flooding member
+    // cannot make the room louder than that
+    if (roomMsgLimit.enabled() || roomByteLimit.enabled())
+    {
+        Room &room = r.rooms[roomId];
+        if (limitRate(r, c, room.msgBucket, room.byteBucket, roomMsgLimit, roomByteLimit, length, false) == RateVerdict::Drop)
+            return true;
+    }
 
-void set_non_blocking(int socket)
+    // Built in the reactor's scratch string: no heap string per message
+    if (roomId == LOBBY_ROOM)
+    {
+        r.scratch.assign(": ");
+    }
+    else
+    {
+        r.scratch.assign(" [#");
+        r.scratch += r.rooms[roomId].info->name;
+        r.scratch += "]: ";
+    }
+    r.scratch.append(frame, length);
+    r.scratch += '\n';
+    broadcastMessage(r, c, roomId, r.scratch, true);
+
+    // Stop reading from the sender while a local member of the room cannot
+    // keep up, instead of queueing more for it
+    Room &room = r.rooms[roomId];
+    if (readBackpressure && room.slowMembers > 0 && !(c.readPaused & PAUSE_SLOW_ROOM))
+    {
+        setReadPaused(r, c, PAUSE_SLOW_ROOM, true);
+        room.pausedSenders.push_back(c.handle());
+    }
+    return true;
+}
+
+// Handle the complete frames in the client's parser until it runs dry or
+// reads are paused; frames after a pause stay there until it ends. Every
+// frame is charged to the client's rate limit. Returns false once the
+// client is gone; otherwise keepPending() must follow.
+bool handleFrames(Reactor &r, Connection &c)
 {
-    int flags = fcntl(socket, F_GETFL, 0);
+    FrameParser &parser = c.parser;
+    const char *frame;
+    size_t length;
+    bool limited = clientMsgLimit.enabled() || clientByteLimit.enabled();
 
-    if (flags == -1)
+    FrameParser::Result res = FrameParser::NeedMore;
+    while (!c.readPaused && (res = parser.next(frame, length)) == FrameParser::Frame)
     {
-        perror("fcntl F_GETFL");
-        return;
+        ++r.messagesIn;
+        // Replies follow the encoding the client picked
+        c.out.encoding = parser.encoding();
+
+        if (limited)
+        {
+            RateVerdict v = limitRate(r, c, c.msgBucket, c.byteBucket, clientMsgLimit, clientByteLimit, length, true);
+            if (v == RateVerdict::Drop)
+                continue;
+            if (v == RateVerdict::Close)
+            {
+                closeOverLimit(r, c);
+                return false;
+            }
+        }
+        if (!handleFrame(r, c, frame, length))
+            return false;
     }
 
-    if (fcntl(socket, F_SETFL, flags | O_NONBLOCK) == -1)
+    if (res == FrameParser::Error)
     {
-        perror("fcntl F_SETFL");
-        return;
+        cout << "\nClient " << c.fd << "[" << c.name << "]" << " sent an oversized frame (reactor " << r.id << ", total: " << r.conns.size() << ")\n";
+        broadcastLeave(r, c);
+        cleanupClient(r, c);
+        return false;
     }
+    return true;
 }
 
-void handle_sigint(int)
+// Keep what the parser has not consumed in the client's pending block, and
+// let go of the borrowed bytes. A block is only held while there is
+// something in it.
+void keepPending(Connection &c)
 {
-    cout << "\nSIGINT received, shutting down server...\n";
-    stop.store(true);
-    // shutdown(serverSocket, SHUT_RDWR);
+    FrameParser &parser = c.parser;
+    size_t n = parser.buffered();
+    uint32_t scanned = (uint32_t)parser.scannedTail();
+    const char *rest = parser.unconsumed();
+
+    if (n > 0 && c.pending && SizeClassPool::classOf(n) == c.pendingClass)
+    {
+        // May overlap: the rest can be in this very block
+        memmove(c.pending, rest, n);
+    }
+    else
+    {
+        char *block = nullptr;
+        int sizeClass = -1;
+        SizeClassPool *pool = nullptr;
+        if (n > 0)
+        {
+            block = static_cast<char *>(poolAllocate(n, sizeClass, pool));
+            memcpy(block, rest, n);
+        }
+        if (c.pending)
+            poolRelease(c.pending, c.pendingClass, c.pendingPool);
+        c.pending = block;
+        c.pendingClass = sizeClass;
+        c.pendingPool = pool;
+    }
+    c.pendingLength = (uint32_t)n;
+    c.pendingScanned = n ? scanned : 0;
+    parser.release();
 }
 
-void removeClient(int fd)
+// Read until the socket is drained or the connection's read budget is used
+// up, handling every complete frame along the way. `hangup` says the peer
+// may already have closed, so the read must go on until EOF or EAGAIN.
+void handleClientData(Reactor &r, Connection &c, bool hangup)
 {
-    lock_guard<mutex> lock(mtx);
-    clientSockets.erase(
-        remove(clientSockets.begin(), clientSockets.end(), fd),
-        clientSockets.end());
-    
-    clientNames.erase(fd);
+    FrameParser &parser = c.parser;
+    const char *frame;
+    size_t length;
+
+    // Frames left over from before a pause go first
+    if (c.pendingLength)
+    {
+        parser.borrow(c.pending, c.pendingLength, c.pendingScanned);
+        if (!handleFrames(r, c))
+            return;
+        keepPending(c);
+    }
+
+    for (int reads = 0; ; reads++)
+    {
+        // Backpressure: the rest waits in the socket buffer
+        if (c.readPaused)
+            return;
+
+        if (reads == READ_BUDGET)
+        {
+            // Let other connections run. In edge-triggered mode nobody will
+            // tell us about the rest of this data, so note it for later.
+            r.budgetYields++;
+            if (edgeTriggered)
+                r.readyList.push_back(c.handle());
+            return;
+        }
+
+        // Receive into the reactor's buffer, behind whatever the last read
+        // left unfinished; one read may carry many frames
+        char *buffer = r.recvBuffer.data();
+        size_t kept = c.pendingLength;
+        if (kept)
+            memcpy(buffer, c.pending, kept);
+        r.recvCalls++;
+        ssize_t n = recv(c.fd, buffer + kept, READ_SIZE, 0);
+        if (n > 0)
+        {
+            parser.borrow(buffer, kept + n, c.pendingScanned);
+            r.bytesIn += n;
+            r.recvNs = nowNs();
+            c.lastActive = r.tickNs;
+            if (!handleFrames(r, c))
+                return;
+            keepPending(c);
+
+            // A short read means the socket buffer is empty; new data will
+            // raise a new edge, so skip the recv() that would say EAGAIN.
+            // A FIN that is already queued raises no new edge, though.
+            if (n < READ_SIZE && !hangup)
+                return;
+        }
+        else if (n == 0)
+        {
+            // Older clients send "#" without a newline and close right away
+            parser.borrow(buffer, kept, c.pendingScanned);
+            if (parser.finish(frame, length) == FrameParser::Frame &&
+                !handleFrame(r, c, frame, length))
+                return;
+            parser.release();
+
+            // Connection closed by client
+            broadcastLeave(r, c);
+            cout << "\nClient " << c.fd << "[" << c.name << "]" << " closed connection (reactor " << r.id << ", total: " << r.conns.size() << ")\n";
+            cleanupClient(r, c);
+            return;
+        }
+        else
+        {
+            // n < 0: error or would-block
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return; // no more data available right now
+            if (errno == EINTR)
+                continue; // interrupted, try again
+
+            // Real error
+            perror("recv");
+            broadcastLeave(r, c);
+            cout << "\nClient " << c.fd << "[" << c.name << "]" << " error on recv (reactor " << r.id << ", total: " << r.conns.size() << ")\n";
+            cleanupClient(r, c);
+            return;
+        }
+    }
 }
 
-void cleanupClient(int fd)
+// Drop a client that missed a deadline
+void timeOut(Reactor &r, Connection &c, const char *why)
 {
-    removeClient(fd);
-    clientNames.erase(fd);
-    close(fd);
+    cout << "\nClient " << c.fd << "[" << c.name << "]" << " " << why << " (reactor " << r.id << ", total: " << r.conns.size() << ")\n";
+    ++r.timeouts;
+    broadcastLeave(r, c);
+    cleanupClient(r, c);
 }
 
-void handleNewConnection(int serverSocket)
+void onTimer(Reactor &r, TimerNode &t)
 {
-    sockaddr_in client_addr{};
-    socklen_t len = sizeof(client_addr);
-    
-    int client_fd = accept(serverSocket, (sockaddr*)&client_addr, &len);
-    if (client_fd < 0)
+    if ((TimerKind)t.kind == TimerKind::PeerRetry)
     {
-        if (errno == EAGAIN || errno == EWOULDBLOCK)
-            return; // no more pending connections
-        if (errno == EINTR)
-            return;
-        perror("accept");
+        dialPeer(r, *(Peer *)(uintptr_t)t.owner);
         return;
     }
 
-    // Add client to poll array
-    set_non_blocking(client_fd);
-    ev.events = EPOLLIN;
-    ev.data.fd = client_fd;
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, client_fd, &ev) == -1) {
-        perror("epoll_ctl: client_fd");
-        close(client_fd);
+    Connection *c = r.conns.find(t.owner);
+    if (!c)
         return;
+    uint64_t now = r.tickNs;
+
+    switch ((TimerKind)t.kind)
+    {
+    case TimerKind::Join:
+        timeOut(r, *c, "sent no JOIN in time");
+        break;
+
+    case TimerKind::Idle:
+        // Activity since the timer was armed just pushes it back
+        if (c->lastActive + idleNs > now)
+        {
+            armTimer(r, *c, c->liveTimer, TimerKind::Idle, c->lastActive + idleNs);
+            break;
+        }
+        {
+            MessageRef ping(MessageBuffer::create("", "PING\n", 5));
+            enqueueMessage(r, *c, ping);
+        }
+        ++r.pings;
+        c->pingSent = now;
+        armTimer(r, *c, c->liveTimer, TimerKind::Pong, now + pongNs);
+        break;
+
+    case TimerKind::Pong:
+        if (c->lastActive >= c->pingSent)
+            armTimer(r, *c, c->liveTimer, TimerKind::Idle, c->lastActive + idleNs);
+        else
+            timeOut(r, *c, "did not answer PING");
+        break;
+
+    case TimerKind::Flush:
+        r.pendingFlush.push_back(c->handle());
+        break;
+
+    case TimerKind::Rate:
+        setReadPaused(r, *c, PAUSE_RATE, false);
+        break;
+
+    case TimerKind::Slow:
+        // Disconnected with the other evictions at the end of the tick
+        if (c->slow && !c->evicting)
+        {
+            c->evicting = true;
+            r.evictions.push_back(c->handle());
+        }
+        break;
+
+    case TimerKind::PeerRetry:
+        break;
     }
-    clientSockets.push_back(client_fd);
+}
 
-    char ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &client_addr.sin_addr, ip, sizeof(ip));
+// Fire every timer that is due
+void runTimers(Reactor &r)
+{
+    r.timers.advance(r.tickNs, [&r](TimerNode &t) { onTimer(r, t); });
+    r.armedTimers += r.timers.size() - r.armedTimers.get();
 }
 
-void broadcastMessage(int clientFd, const char* buffer)
+// Operator input, read on its own thread so that a half-typed line never
+// holds up a reactor. Each line is injected into every reactor's inbox.
+void handle_send_data()
 {
-    lock_guard<mutex> lock(mtx);
-    for (int fd : clientSockets) {
-        if(fd != clientFd) {
-            string msg = clientNames[clientFd] + string(buffer);
-            send(fd, msg.c_str(), msg.length(), 0);
-        } else {
-            // Optionally, send to sender as well
-            string msg = "You" + string(buffer);
-            send(fd, msg.c_str(), msg.length(), 0);
-        }
+    char buffer[BUF_SIZE];
+    while (!stop.load() && cin.getline(buffer, BUF_SIZE))
+    {
+        if (strlen(buffer) == 0)
+            continue;
+        string text = string(buffer) + "\n";
+        MessageRef msg(MessageBuffer::create("[SERVER]: ", text.c_str(), text.size()));
+        for (auto &r : reactors)
+            postToReactor(*r, ALL_ROOMS, msg);
     }
 }
 
-void handleClientData(int clientFd)
+// Render every reactor's metrics in the Prometheus text format. Only
+// relaxed atomic loads touch the other reactors, so nobody is stopped.
+string renderMetrics(Reactor &admin)
 {
-    char buffer[BUF_SIZE];
-    ssize_t n = recv(clientFd, buffer, BUF_SIZE - 1, 0);
-    if (n > 0)
+    string out;
+    auto label = [](const Reactor &r) { return "reactor=\"" + to_string(r.id) + "\""; };
+    auto counter = [&](const char *name, const char *type, const char *help, Counter Reactor::*field) {
+        writeMetricHeader(out, name, type, help);
+        for (auto &r : reactors)
+            writeSample(out, name, label(*r), (double)((*r).*field).get());
+    };
+
+    counter("chat_connections", "gauge", "Open client connections.", &Reactor::connections);
+    counter("chat_messages_in_total", "counter", "Frames received from clients.", &Reactor::messagesIn);
+    counter("chat_messages_out_total", "counter", "Messages fully written to clients.", &Reactor::messagesOut);
+    counter("chat_bytes_in_total", "counter", "Bytes received from clients.", &Reactor::bytesIn);
+    counter("chat_bytes_out_total", "counter", "Bytes written to clients.", &Reactor::bytesOut);
+    counter("chat_write_calls_total", "counter", "writev and sendmsg calls on client sockets.", &Reactor::writeCalls);
+    counter("chat_slow_connections", "gauge", "Clients above the output high watermark.", &Reactor::slowConnections);
+    counter("chat_slow_drops_total", "counter", "Messages dropped or skipped for slow clients.", &Reactor::slowDrops);
+    counter("chat_slow_evictions_total", "counter", "Slow clients disconnected.", &Reactor::slowEvictions);
+    counter("chat_read_pauses_total", "counter", "Times a sender's reads were paused, for a slow room member or a rate limit.", &Reactor::readPauses);
+    counter("chat_rate_limited_total", "counter", "Frames over a client or room rate limit.", &Reactor::rateLimited);
+    counter("chat_pings_total", "counter", "Heartbeat PINGs sent to idle clients.", &Reactor::pings);
+    counter("chat_timeouts_total", "counter", "Clients disconnected for a missing JOIN or PONG.", &Reactor::timeouts);
+    counter("chat_timers", "gauge", "Timers armed on the reactor's wheel.", &Reactor::armedTimers);
+    counter("chat_output_queue_bytes", "gauge", "Bytes queued for clients and not yet written.", &Reactor::queuedBytes);
+    counter("chat_epoll_wakeups_total", "counter", "epoll_wait calls that returned events.", &Reactor::wakeups);
+    counter("chat_epoll_events_total", "counter", "Events returned by epoll_wait.", &Reactor::eventCount);
+
+    counter("chat_peer_links", "gauge", "Federation links to other nodes that are up.", &Reactor::peerLinks);
+    counter("chat_peer_messages_in_total", "counter", "Broadcasts received from peer nodes.", &Reactor::peerMessagesIn);
+    counter("chat_peer_messages_out_total", "counter", "Broadcasts forwarded to peer nodes, once per peer.", &Reactor::peerMessagesOut);
+    counter("chat_peer_bytes_in_total", "counter", "Bytes received on federation links.", &Reactor::peerBytesIn);
+    counter("chat_peer_bytes_out_total", "counter", "Bytes written to federation links.", &Reactor::peerBytesOut);
+
+    counter("chat_history_appends_total", "counter", "Broadcasts appended to a room history.", &Reactor::historyAppends);
+    counter("chat_history_replay_bytes_total", "counter", "History bytes replayed to joining clients.", &Reactor::replayBytes);
+
+    writeMetricHeader(out, "chat_reactor_busy_seconds_total", "counter", "Time the reactor spent outside epoll_wait.");
+    for (auto &r : reactors)
+        writeSample(out, "chat_reactor_busy_seconds_total", label(*r), r->busyNs.get() / 1e9);
+
+    // Utilization since the previous scrape
+    uint64_t now = nowNs();
+    uint64_t elapsed = now - admin.scrapeNs;
+    admin.scrapeBusyNs.resize(reactors.size());
+    writeMetricHeader(out, "chat_reactor_busy_percent", "gauge", "Share of time spent outside epoll_wait since the previous scrape.");
+    for (auto &r : reactors)
     {
-        buffer[n] = '\0';
+        uint64_t busy = r->busyNs.get();
+        uint64_t &last = admin.scrapeBusyNs[r->id];
+        writeSample(out, "chat_reactor_busy_percent", label(*r),
+                    elapsed ? 100.0 * (double)(busy - last) / (double)elapsed : 0.0);
+        last = busy;
+    }
+    admin.scrapeNs = now;
+
+    writeMetricHeader(out, "chat_fanout_latency_seconds", "histogram", "Time from receiving a message to writing its last copy.");
+    for (auto &r : reactors)
+        writeHistogram(out, "chat_fanout_latency_seconds", label(*r), r->fanoutLatency, 1e-9, 10, 34);
+
+    writeMetricHeader(out, "chat_output_queue_depth_bytes", "histogram", "Client output queue size after each enqueue.");
+    for (auto &r : reactors)
+        writeHistogram(out, "chat_output_queue_depth_bytes", label(*r), r->queueDepth, 1, 6, 24);
+
+    // Allocator pools: the connection slab and each message size class in use
+    auto pools = [&](const char *name, const char *type, const char *help, uint64_t (*value)(const SlabPool &)) {
+        writeMetricHeader(out, name, type, help);
+        for (auto &r : reactors)
+        {
+            writeSample(out, name, label(*r) + ",pool=\"connection\"", (double)value(r->connPool));
+            for (int c = 0; c < SizeClassPool::CLASSES; c++)
+            {
+                const SlabPool &p = r->msgPool[c];
+                if (p.slabCount.get() > 0)
+                    writeSample(out, name, label(*r) + ",pool=\"message_" + to_string(p.size()) + "\"", (double)value(p));
+            }
+        }
+    };
+    pools("chat_pool_hits_total", "counter", "Allocations served from a pool free list.",
+          [](const SlabPool &p) { return p.hits.get(); });
+    pools("chat_pool_misses_total", "counter", "Allocations that needed fresh slab memory.",
+          [](const SlabPool &p) { return p.misses.get(); });
+    pools("chat_pool_in_use", "gauge", "Blocks currently handed out.",
+          [](const SlabPool &p) { return p.inUse(); });
+    pools("chat_pool_slabs", "gauge", "2 MiB slabs mapped.",
+          [](const SlabPool &p) { return p.slabCount.get(); });
+
+    return out;
+}
+
+void closeAdmin(Reactor &r, int fd)
+{
+    r.adminConns.erase(fd);
+    close(fd);
+}
 
-        // Check for disconnect message
-        if (buffer[0] == '#')
+void acceptAdmin(Reactor &r)
+{
+    while (true)
+    {
+        int fd = accept4(r.adminSocket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
         {
-            cout << "\nClient " << clientFd << "[" << clientNames[clientFd] << "]" << " sent disconnect (total: " << clientSockets.size() << ")\n";
-            string leaveMsg = " has left the chat.\n";
-            broadcastMessage(clientFd, leaveMsg.c_str());
-            cleanupClient(clientFd);
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept4: admin");
             return;
         }
+        if (!addToEpoll(r, fd))
+        {
+            close(fd);
+            continue;
+        }
+        r.adminConns[fd];
+    }
+}
 
-        if(strncmp(buffer, "JOIN ", 5) == 0)
+// Answer any request with the metrics, then close. A reply larger than the
+// socket buffer is finished on EPOLLOUT.
+void handleAdmin(Reactor &r, int fd)
+{
+    string &reply = r.adminConns[fd];
+    if (reply.empty())
+    {
+        char request[BUF_SIZE];
+        ssize_t n = recv(fd, request, sizeof(request), 0);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        if (n <= 0)
         {
-            string name(buffer + 5);
-            name.erase(remove(name.begin(), name.end(), '\n'), name.end());
-            {
-                lock_guard<mutex> lock(mtx);
-                clientNames[clientFd] = name;
-            }
-            string joinMsg = " has joined the chat.\n";
-            broadcastMessage(clientFd, joinMsg.c_str());
-            cout << "\nClient " << clientFd << "[" << name <<  "]: " << "connected (total: " << clientSockets.size() << ")\n";
+            closeAdmin(r, fd);
             return;
         }
 
-        cout << "\nClient " << clientFd << "[" << clientNames[clientFd] << "]" << " message: " << buffer << "\n";
-        string msg = ": " + string(buffer);
-        broadcastMessage(clientFd, msg.c_str());
+        string body = renderMetrics(r);
+        reply = "HTTP/1.0 200 OK\r\n"
+                "Content-Type: text/plain; version=0.0.4\r\n"
+                "Content-Length: " + to_string(body.size()) + "\r\n"
+                "Connection: close\r\n\r\n" + body;
     }
-    else if (n == 0)
+
+    ssize_t n = send(fd, reply.data(), reply.size(), MSG_NOSIGNAL);
+    if (n < 0 && errno != EAGAIN && errno != EINTR)
     {
-        // Connection closed by client
-        string leaveMsg = " has left the chat.\n";
-        broadcastMessage(clientFd, leaveMsg.c_str());
-        cout << "\nClient " << clientFd << "[" << clientNames[clientFd] << "]" << " closed connection (total: " << clientSockets.size() << ")\n";
-        cleanupClient(clientFd);
+        closeAdmin(r, fd);
+        return;
     }
-    else
+    if (n > 0)
+        reply.erase(0, n);
+
+    if (reply.empty())
     {
-        // n < 0: error or would-block
-        if (errno == EAGAIN || errno == EWOULDBLOCK)
-            return; // no more data available right now
-        if (errno == EINTR)
-            return; // interrupted, try again
-        
-        // Real error
-        perror("recv");
-        string leaveMsg = " has left the chat.\n";
-        broadcastMessage(clientFd, leaveMsg.c_str());
-        cout << "\nClient " << clientFd << "[" << clientNames[clientFd] << "]" << " error on recv (total: " << clientSockets.size() << ")\n";
-        cleanupClient(clientFd);
+        closeAdmin(r, fd);
+        return;
     }
+
+    epoll_event ev{};
+    ev.events = EPOLLOUT;
+    ev.data.fd = fd;
+    epoll_ctl(r.epollfd, EPOLL_CTL_MOD, fd, &ev);
 }
 
-void handle_send_data()
+void pinToCpu(Reactor &r)
 {
-    // Server input → broadcast
-    char buffer[BUF_SIZE];
-    cin.getline(buffer, BUF_SIZE);
-    if(strlen(buffer) == 0)
+    unsigned ncpu = thread::hardware_concurrency();
+    if (ncpu == 0)
         return;
-    lock_guard<mutex> lock(mtx);
-    string msg = "[SERVER]: " + string(buffer) + "\n";
-    strcpy(buffer, msg.c_str());
-    for (int fd : clientSockets) {
-        send(fd, buffer, strlen(buffer), 0);
-    }
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(r.id % ncpu, &cpus);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (err != 0)
+        cerr << "reactor " << r.id << ": pthread_setaffinity_np: " << strerror(err) << "\n";
 }
 
-int main()
+bool setupReactor(Reactor &r)
 {
-    signal(SIGINT, handle_sigint);
+    r.connPool.init(sizeof(Connection), hugePages);
+    r.msgPool.init(hugePages);
+    r.recvBuffer.resize(MAX_FRAME + FRAME_HEADER_SIZE + READ_SIZE);
 
-    //Setup server socket
-    sockaddr_in server_addr{};
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    server_addr.sin_port = htons(PORT);
+    r.listenSocket = createListenSocket(clientPort, INADDR_ANY);
+    if (r.listenSocket < 0)
+        return false;
 
-    serverSocket = socket(AF_INET, SOCK_STREAM, 0);
-    if (serverSocket < 0)
-    {
-        perror("socket");
-        return 1;
+    r.epollfd = epoll_create1(0);
+    if (r.epollfd == -1) {
+        perror("epoll_create1");
+        return false;
     }
 
-    set_non_blocking(serverSocket);
+    r.wakefd = eventfd(0, EFD_NONBLOCK);
+    if (r.wakefd == -1) {
+        perror("eventfd");
+        return false;
+    }
 
-    int opt = 1;
-    setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    uint32_t et = edgeTriggered ? (uint32_t)EPOLLET : 0;
+    if (!addToEpoll(r, r.listenSocket, EPOLLIN | et) || !addToEpoll(r, r.wakefd, EPOLLIN | et))
+        return false;
 
-    if (bind(serverSocket, (sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    // The first reactor also serves metrics. Scrapes are short and
+    // non-blocking, so they are handled inline like any other socket.
+    if (r.id == 0 && adminPort > 0)
     {
-        perror("bind");
-        return 1;
+        r.adminSocket = createListenSocket(adminPort, INADDR_LOOPBACK);
+        if (r.adminSocket < 0 || !addToEpoll(r, r.adminSocket))
+            return false;
+        r.scrapeNs = nowNs();
     }
 
-    if (listen(serverSocket, 128) < 0)
+    // ... and the links to the other nodes of a cluster
+    if (r.id == 0 && peerPort > 0)
     {
-        perror("listen");
-        return 1;
+        r.peerSocket = createListenSocket(peerPort, INADDR_ANY);
+        if (r.peerSocket < 0 || !addToEpoll(r, r.peerSocket))
+            return false;
     }
 
-    cout << "Server listening on port " << PORT << "...\n";
-
-    epollfd = epoll_create1(0);
-    if (epollfd == -1) {
-        perror("epoll_create1");
-        return 1;
-    }
+    return true;
+}
 
-    // Add server socket to epoll
-    ev.events = EPOLLIN;
-    ev.data.fd = serverSocket;
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, serverSocket, &ev) == -1) {
-        perror("epoll_ctl: serverSocket");
-        return 1;
-    }
+void runReactor(Reactor &r)
+{
+    if (pinReactors)
+        pinToCpu(r);
 
-    // Add STDIN to epoll
-    ev.events = EPOLLIN;
-    ev.data.fd = STDIN_FILENO;
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == -1) {
-        perror("epoll_ctl: STDIN_FILENO");
-        return 1;
-    }
+    fanoutLatency = &r.fanoutLatency;
+    messagePool = &r.msgPool;
+    uint64_t busySince = nowNs();
+    r.timers.start(busySince);
+    for (auto &p : r.peers)
+        dialPeer(r, *p);
 
     while(!stop.load()) {
-        int nready = epoll_wait(epollfd, events, MAX_CONNECTION + 2, 1000);
+        // Don't sleep while budget-limited sockets still hold data, or past
+        // the next timer deadline
+        uint64_t waitStart = nowNs();
+        int timeout = 1000;
+        if (!r.readyList.empty()) {
+            timeout = 0;
+        } else {
+            uint64_t due = r.timers.nextDeadline();
+            if (due <= waitStart)
+                timeout = 0;
+            else if (due - waitStart < 1000000000ULL)
+                timeout = (int)((due - waitStart + 999999) / 1000000);
+        }
+        r.busyNs += waitStart - busySince;
+        int nready = epoll_wait(r.epollfd, r.events, MAX_EVENTS, timeout);
+        busySince = nowNs();
+        r.tickNs = busySince;
         if (nready == -1) {
             if (errno == EINTR)
                 continue;
             perror("epoll_wait");
             break;
         }
+        if (nready > 0) {
+            ++r.wakeups;
+            r.eventCount += nready;
+        }
 
         for (int i = 0; i < nready; i++) {
-            if (events[i].data.fd == serverSocket) {
+            // Clients are tagged with their handle, everything else with a
+            // bare fd (generation 0)
+            uint64_t tag = r.events[i].data.u64;
+            if (tag >> 32) {
+                // A stale event for an fd closed earlier in this batch and
+                // already handed to a new client resolves to nothing
+                Connection *c = r.conns.find(tag);
+                if (!c)
+                    continue;
+                uint32_t ev = r.events[i].events;
+                // Socket drained enough to take more queued output
+                if (ev & EPOLLOUT)
+                    flushClient(r, *c);
+                // Client data, hangup or error
+                if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    handleClientData(r, *c, ev & (EPOLLRDHUP | EPOLLHUP | EPOLLERR));
+                continue;
+            }
+
+            int fd = (int)tag;
+            if (fd == r.listenSocket) {
                 // New connection
-                handleNewConnection(serverSocket);
-            } else if (events[i].data.fd == STDIN_FILENO) {
-                // Server input
-                handle_send_data();
-            } else {
-                // Client data
-                handleClientData(events[i].data.fd);
+                handleNewConnection(r);
+            } else if (fd == r.wakefd) {
+                // Broadcasts from other reactors and the operator
+                drainInbox(r);
+            } else if (fd == r.adminSocket) {
+                // Metrics scraper
+                acceptAdmin(r);
+            } else if (r.adminConns.count(fd)) {
+                handleAdmin(r, fd);
+            } else if (fd == r.peerSocket) {
+                // Another node joining the cluster
+                acceptPeer(r);
+            } else if (Peer *p = findPeer(r, fd)) {
+                handlePeerEvent(r, *p, r.events[i].events);
+            }
+        }
+
+        // Resume sockets that yielded their read budget last time around
+        if (!r.readyList.empty()) {
+            r.readyScratch.swap(r.readyList);
+            for (uint64_t handle : r.readyScratch) {
+                if (Connection *c = r.conns.find(handle))
+                    handleClientData(r, *c, true);
             }
+            r.readyScratch.clear();
         }
+
+        // Timers are due against the time this tick started
+        runTimers(r);
+
+        // Everything this tick queued goes out in one write per client
+        evictSlow(r);
+        flushPending(r);
+
+        // ... and to each peer node
+        publishMembership(r);
+        if (r.id == 0)
+            flushPeers(r);
     }
 
-    // Notify clients about shutdown
-    lock_guard<mutex> lock(mtx);
-    for (int fd : clientSockets)
+    // Notify clients about shutdown (best effort, after what is queued)
+    MessageRef bye(MessageBuffer::create("", "#\n", 2));
+    vector<Connection *> remaining = r.conns.all();
+    for (Connection *c : remaining)
     {
-        send(fd, "#", 1, 0);
+        int fd = c->fd;
+        enqueueMessage(r, *c, bye);
+        flushClient(r, *c);
+        removeClient(r, *c);
         close(fd);
     }
-    close(serverSocket);
+    bye.reset();
+
+    uint64_t msgHits = 0, msgMisses = 0, slabs = r.connPool.slabCount.get(), huge = r.connPool.hugeSlabs.get();
+    for (int c = 0; c < SizeClassPool::CLASSES; c++)
+    {
+        msgHits += r.msgPool[c].hits.get();
+        msgMisses += r.msgPool[c].misses.get();
+        slabs += r.msgPool[c].slabCount.get();
+        huge += r.msgPool[c].hugeSlabs.get();
+    }
+    auto hitRate = [](uint64_t hits, uint64_t misses) {
+        return hits + misses ? 100.0 * hits / (hits + misses) : 0.0;
+    };
+
+    cout << "Reactor " << r.id << ": peak queued " << r.peakQueuedBytes
+         << " bytes, deepest client queue " << r.peakClientQueue
+         << " bytes, " << r.partialWrites << " partial writes, "
+         << r.writeCalls.get() << " writes for " << r.messagesOut.get() << " messages\n";
+    cout << "Reactor " << r.id << ": " << r.slowDrops.get() << " messages dropped for slow clients, "
+         << r.slowEvictions.get() << " slow clients disconnected, " << r.readPauses.get() << " read pauses, "
+         << r.rateLimited.get() << " frames over a rate limit\n";
+    cout << "Reactor " << r.id << ": " << r.pings.get() << " PINGs sent, "
+         << r.timeouts.get() << " clients timed out\n";
+    if (federation && r.id == 0)
+        cout << "Reactor " << r.id << ": " << r.peerMessagesOut.get() << " messages forwarded to peers, "
+             << r.peerMessagesIn.get() << " received from them\n";
+    cout << "Reactor " << r.id << ": " << r.wakeups.get() << " wakeups, "
+         << (r.wakeups.get() ? (double)r.eventCount.get() / r.wakeups.get() : 0.0) << " events/wakeup, "
+         << r.accepted << " accepted in " << r.acceptCalls << " accept4 calls, "
+         << r.recvCalls << " recv calls, " << r.budgetYields << " budget yields\n";
+    cout << "Reactor " << r.id << ": pool hit rate " << hitRate(r.connPool.hits.get(), r.connPool.misses.get())
+         << "% connections, " << hitRate(msgHits, msgMisses) << "% messages, "
+         << slabs << " slabs (" << huge << " huge)\n";
+    for (auto &admin : r.adminConns)
+        close(admin.first);
+    if (r.adminSocket != -1)
+        close(r.adminSocket);
+    for (auto &p : r.peers)
+    {
+        if (p->fd >= 0)
+            close(p->fd);
+    }
+    if (r.peerSocket != -1)
+        close(r.peerSocket);
+    close(r.listenSocket);
+    close(r.wakefd);
+    close(r.epollfd);
+}
+
+void usage(const char *prog)
+{
+    cerr << "Usage: " << prog << " [-r reactors] [-p] [-e] [-H] [-m port] [-d dir] [-k count] [-n rooms] [-w mode] [-f usec]\n"
+         << "       [-N] [-W high[:low]] [-S policy[:grace]] [-B] [-i idle[:pong]] [-j secs]\n"
+         << "       [-L msgs[:bytes]] [-R msgs[:bytes]] [-P policy] [-l port] [-F port] [-C host:port,...]\n"
+         << "  -r N  number of reactor threads (default: number of cores)\n"
+         << "  -p    pin each reactor thread to its own CPU\n"
+         << "  -e    edge-triggered epoll (drain sockets until EAGAIN)\n"
+         << "  -H    back connection and message pools with huge pages\n"
+         << "  -m N  serve Prometheus metrics on 127.0.0.1:N (default " << ADMIN_PORT << ", 0 disables)\n"
+         << "  -d D  keep a message history per room under directory D\n"
+         << "  -k N  history messages replayed on JOIN (default " << REPLAY_COUNT << ")\n"
+         << "  -n N  most rooms this node creates, the lobby included (default " << MAX_ROOMS << ")\n"
+         << "  -w M  output writes: now, tick (one writev per client per loop, default),\n"
+         << "        cork (tick + TCP_CORK) or more (tick + MSG_MORE)\n"
+         << "  -f U  let output wait up to U microseconds for more to join it\n"
+         << "  -N    set TCP_NODELAY on client sockets\n"
+         << "  -W H:L client queue watermarks in KiB (default " << HIGH_WATERMARK / 1024 << ":" << LOW_WATERMARK / 1024 << ", 0 = unbounded)\n"
+         << "  -S P  above the high watermark: drop (oldest messages, default), skip (chat\n"
+         << "        lines), close[:ms] (skip, then disconnect after ms, default " << SLOW_GRACE_MS << ")\n"
+         << "  -B    stop reading from a sender while its room has a slow member\n"
+         << "  -i I:P send PING after I seconds of silence, disconnect if nothing arrives\n"
+         << "        within P more (default " << IDLE_TIMEOUT_S << ":" << PONG_TIMEOUT_S << ", 0 = no heartbeat)\n"
+         << "  -j S  seconds a new connection has to send JOIN (default " << JOIN_TIMEOUT_S << ", 0 = no limit)\n"
+         << "  -L M:B limit each client to M frames and B bytes per second (0 = no limit)\n"
+         << "  -R M:B limit each room to M chat lines and B bytes per second on each reactor,\n"
+         << "        so a room may carry up to -r times that in all\n"
+         << "  -P P  over a limit: delay (stop reading for a while, default), drop or close\n"
+         << "        (a client over -L; a room over -R drops instead)\n"
+         << "  -l N  port for clients (default " << PORT << ")\n"
+         << "  -F N  accept links from other nodes of a cluster on port N\n"
+         << "  -C A  link to the nodes at A (host:port, comma separated); every pair of\n"
+         << "        nodes needs one link, so each node names the nodes started before it\n";
+}
+
+int main(int argc, char *argv[])
+{
+    int reactorCount = (int)thread::hardware_concurrency();
+    if (reactorCount <= 0)
+        reactorCount = 1;
+
+    vector<unique_ptr<Peer>> dialed; // -C, handed to reactor 0
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:peHm:d:k:n:w:f:NW:S:Bi:j:L:R:P:l:F:C:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            reactorCount = atoi(optarg);
+            break;
+        case 'p':
+            pinReactors = true;
+            break;
+        case 'e':
+            edgeTriggered = true;
+            break;
+        case 'H':
+            hugePages = true;
+            break;
+        case 'm':
+            adminPort = atoi(optarg);
+            break;
+        case 'd':
+            historyDir = optarg;
+            break;
+        case 'k':
+            replayCount = atoi(optarg);
+            break;
+        case 'n':
+            maxRooms = (size_t)max(1, atoi(optarg));
+            break;
+        case 'w':
+            if (strcmp(optarg, "now") == 0)
+                writeMode = WriteMode::Now;
+            else if (strcmp(optarg, "tick") == 0)
+                writeMode = WriteMode::Tick;
+            else if (strcmp(optarg, "cork") == 0)
+                writeMode = WriteMode::Cork;
+            else if (strcmp(optarg, "more") == 0)
+                writeMode = WriteMode::More;
+            else
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'f':
+            flushDeadlineNs = strtoull(optarg, nullptr, 10) * 1000;
+            break;
+        case 'N':
+            noDelay = true;
+            break;
+        case 'W':
+        {
+            char *end;
+            highWatermark = strtoull(optarg, &end, 10) * 1024;
+            lowWatermark = (*end == ':') ? strtoull(end + 1, nullptr, 10) * 1024 : highWatermark / 4;
+            break;
+        }
+        case 'S':
+            if (strncmp(optarg, "drop", 4) == 0)
+                slowPolicy = SlowPolicy::DropOldest;
+            else if (strncmp(optarg, "skip", 4) == 0)
+                slowPolicy = SlowPolicy::Skip;
+            else if (strncmp(optarg, "close", 5) == 0)
+                slowPolicy = SlowPolicy::Close;
+            else
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            if (const char *grace = strchr(optarg, ':'))
+                slowGraceNs = strtoull(grace + 1, nullptr, 10) * 1000000ULL;
+            break;
+        case 'B':
+            readBackpressure = true;
+            break;
+        case 'i':
+        {
+            char *end;
+            idleNs = strtoull(optarg, &end, 10) * 1000000000ULL;
+            if (*end == ':')
+                pongNs = strtoull(end + 1, nullptr, 10) * 1000000000ULL;
+            break;
+        }
+        case 'j':
+            joinTimeoutNs = strtoull(optarg, nullptr, 10) * 1000000000ULL;
+            break;
+        case 'L':
+        case 'R':
+        {
+            // Buckets hold one second's worth
+            RateLimit &msgs = opt == 'L' ? clientMsgLimit : roomMsgLimit;
+            RateLimit &bytes = opt == 'L' ? clientByteLimit : roomByteLimit;
+            char *end;
+            msgs.rate = msgs.burst = strtod(optarg, &end);
+            if (*end == ':')
+                bytes.rate = bytes.burst = strtod(end + 1, nullptr);
+            break;
+        }
+        case 'P':
+            if (strcmp(optarg, "delay") == 0)
+                ratePolicy = RatePolicy::Delay;
+            else if (strcmp(optarg, "drop") == 0)
+                ratePolicy = RatePolicy::Drop;
+            else if (strcmp(optarg, "close") == 0)
+                ratePolicy = RatePolicy::Close;
+            else
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'l':
+            clientPort = atoi(optarg);
+            break;
+        case 'F':
+            peerPort = atoi(optarg);
+            break;
+        case 'C':
+        {
+            string list = optarg;
+            size_t start = 0;
+            while (start <= list.size())
+            {
+                size_t comma = list.find(',', start);
+                if (comma == string::npos)
+                    comma = list.size();
+                string address = list.substr(start, comma - start);
+                start = comma + 1;
+                if (address.empty())
+                    continue;
+
+                unique_ptr<Peer> p(new Peer());
+                p->address = address;
+                p->addr.sin_family = AF_INET;
+                size_t colon = address.rfind(':');
+                if (colon == string::npos ||
+                    inet_pton(AF_INET, address.substr(0, colon).c_str(), &p->addr.sin_addr) != 1)
+                {
+                    cerr << "invalid peer address: " << address << "\n";
+                    return 1;
+                }
+                p->addr.sin_port = htons((uint16_t)atoi(address.c_str() + colon + 1));
+                dialed.push_back(move(p));
+            }
+            break;
+        }
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    federation = peerPort > 0 || !dialed.empty();
+
+    if (reactorCount <= 0 || replayCount < 0 || lowWatermark > highWatermark || clientPort <= 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (!historyDir.empty() && mkdir(historyDir.c_str(), 0755) < 0 && errno != EEXIST)
+    {
+        perror(("mkdir " + historyDir).c_str());
+        return 1;
+    }
+
+    signal(SIGINT, handle_sigint);
+    signal(SIGPIPE, SIG_IGN); // peers may vanish mid-broadcast
+
+    // All reactors must exist before any of them starts posting to the others
+    for (int i = 0; i < reactorCount; i++)
+    {
+        reactors.emplace_back(new Reactor());
+        reactors.back()->id = i;
+        if (!setupReactor(*reactors.back()))
+            return 1;
+    }
+    internRoom("lobby"); // takes LOBBY_ROOM
+    if (!historyDir.empty())
+        openHistories();
+    reactors[0]->peers = move(dialed);
+
+    cout << "Server listening on port " << clientPort << " with " << reactorCount
+         << " reactor" << (reactorCount > 1 ? "s" : "")
+         << (edgeTriggered ? " (edge-triggered)" : "") << "...\n";
+    if (adminPort > 0)
+        cout << "Metrics on http://127.0.0.1:" << adminPort << "/metrics\n";
+    if (!historyDir.empty())
+        cout << "History in " << historyDir << ", " << replayCount << " messages replayed on JOIN\n";
+    if (federation)
+        cout << "Federation: peer links on port " << (peerPort > 0 ? to_string(peerPort) : "(none)")
+             << ", dialing " << reactors[0]->peers.size() << " node" << (reactors[0]->peers.size() == 1 ? "" : "s") << "\n";
+
+    for (auto &r : reactors)
+        r->worker = thread(runReactor, ref(*r));
+
+    // Blocks in getline; left behind at exit
+    thread(handle_send_data).detach();
+
+    for (auto &r : reactors)
+        r->worker.join();
+
+    // Posts that arrived after a reactor stopped still hold message buffers;
+    // drop them while every pool is alive
+    for (auto &r : reactors)
+    {
+        Post *post = r->inbox.popAll();
+        while (post)
+        {
+            Post *next = post->next;
+            post->destroy();
+            post = next;
+        }
+    }
+
     cout << "Server shutdown complete.\n";
 }
@@ -0,0 +1,721 @@
+#include <iostream>
+#include <cstring>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <csignal>
+#include <ctime>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <unordered_map>
+
+#include "../common/frame.h"
+
+using namespace std;
+
+constexpr int PORT = 1500;
+constexpr int BUF_SIZE = 1024;
+constexpr unsigned RING_ENTRIES = 4096;   // submission queue size
+constexpr unsigned RECV_BUFFERS = 1024;   // provided buffers, power of two
+constexpr unsigned RECV_BUFFER_SIZE = 16 * 1024;
+constexpr uint16_t RECV_GROUP = 0;        // provided buffer group id
+constexpr int MAX_IOV = 64;               // queued messages per writev
+
+atomic<bool> stop{false};
+
+// What a completion belongs to, packed into user_data with the fd
+enum Op : uint32_t
+{
+    OP_ACCEPT = 1,
+    OP_RECV,
+    OP_SEND,
+    OP_STDIN
+};
+
+inline uint64_t makeUserData(Op op, int fd) { return ((uint64_t)op << 32) | (uint32_t)fd; }
+inline Op userDataOp(uint64_t data) { return (Op)(data >> 32); }
+inline int userDataFd(uint64_t data) { return (int)(uint32_t)data; }
+
+// Thin wrapper over the raw io_uring syscalls (no liburing dependency)
+struct Ring
+{
+    int fd = -1;
+
+    // Submission queue
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    io_uring_sqe *sqes;
+    unsigned sqEntries;
+    unsigned sqPending = 0; // prepared but not yet submitted
+
+    // Completion queue
+    unsigned *cqHead, *cqTail, *cqMask;
+    io_uring_cqe *cqes;
+
+    unsigned long long enterCalls = 0;
+
+    bool setup(unsigned entries)
+    {
+        io_uring_params p{};
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = entries * 4; // recv/send completions outnumber submissions
+
+        fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+        if (fd < 0)
+        {
+            perror("io_uring_setup");
+            return false;
+        }
+
+        if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG))
+        {
+            cerr << "io_uring: kernel too old (needs SINGLE_MMAP and EXT_ARG)\n";
+            return false;
+        }
+
+        size_t sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        size_t cqSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        size_t ringSize = max(sqSize, cqSize);
+
+        char *ring = (char *)mmap(nullptr, ringSize, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (ring == MAP_FAILED)
+        {
+            perror("mmap: sq ring");
+            return false;
+        }
+
+        sqes = (io_uring_sqe *)mmap(nullptr, p.sq_entries * sizeof(io_uring_sqe),
+                                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                    fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+        {
+            perror("mmap: sqes");
+            return false;
+        }
+
+        sqHead = (unsigned *)(ring + p.sq_off.head);
+        sqTail = (unsigned *)(ring + p.sq_off.tail);
+        sqMask = (unsigned *)(ring + p.sq_off.ring_mask);
+        sqArray = (unsigned *)(ring + p.sq_off.array);
+        sqEntries = p.sq_entries;
+
+        cqHead = (unsigned *)(ring + p.cq_off.head);
+        cqTail = (unsigned *)(ring + p.cq_off.tail);
+        cqMask = (unsigned *)(ring + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe *)(ring + p.cq_off.cqes);
+        return true;
+    }
+
+    // Next free SQE, submitting what is queued if the ring is full. Null if
+    // the kernel takes none of them (e.g. EBUSY until completions are
+    // reaped); the caller tries again on the next loop.
+    io_uring_sqe *getSqe()
+    {
+        unsigned tail = *sqTail;
+        while (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+        {
+            if (submit(0, nullptr) < 0 && errno != EINTR)
+                return nullptr;
+        }
+
+        unsigned index = tail & *sqMask;
+        io_uring_sqe *sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqArray[index] = index;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        sqPending++;
+        return sqe;
+    }
+
+    // One syscall: submit everything prepared and optionally wait for a
+    // completion (bounded by `timeout`)
+    int submit(unsigned waitFor, __kernel_timespec *timeout)
+    {
+        io_uring_getevents_arg arg{};
+        arg.ts = (uint64_t)(uintptr_t)timeout;
+
+        unsigned flags = IORING_ENTER_EXT_ARG | (waitFor ? IORING_ENTER_GETEVENTS : 0);
+        int ret = (int)syscall(__NR_io_uring_enter, fd, sqPending, waitFor, flags, &arg, sizeof(arg));
+        enterCalls++;
+        if (ret >= 0)
+            sqPending -= min<unsigned>(sqPending, (unsigned)ret);
+        return ret;
+    }
+};
+
+// Kernel-managed pool of receive buffers. Multishot recv picks a buffer per
+// completion; we hand it back once the bytes are parsed.
+struct BufferRing
+{
+    io_uring_buf_ring *ring = nullptr;
+    char *memory = nullptr;
+    unsigned mask = RECV_BUFFERS - 1;
+
+    bool setup(Ring &uring)
+    {
+        size_t ringBytes = RECV_BUFFERS * sizeof(io_uring_buf);
+        ring = (io_uring_buf_ring *)mmap(nullptr, ringBytes, PROT_READ | PROT_WRITE,
+                                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        memory = (char *)mmap(nullptr, (size_t)RECV_BUFFERS * RECV_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring == MAP_FAILED || memory == MAP_FAILED)
+        {
+            perror("mmap: buffer ring");
+            return false;
+        }
+
+        io_uring_buf_reg reg{};
+        reg.ring_addr = (uint64_t)(uintptr_t)ring;
+        reg.ring_entries = RECV_BUFFERS;
+        reg.bgid = RECV_GROUP;
+        if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        {
+            perror("io_uring_register: PBUF_RING");
+            return false;
+        }
+
+        for (unsigned i = 0; i < RECV_BUFFERS; i++)
+            put(i, i);
+        __atomic_store_n(&ring->tail, (uint16_t)RECV_BUFFERS, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    char *buffer(unsigned bid) { return memory + (size_t)bid * RECV_BUFFER_SIZE; }
+
+    // Return a consumed buffer to the kernel
+    void recycle(unsigned bid)
+    {
+        uint16_t tail = ring->tail;
+        put(tail, bid);
+        __atomic_store_n(&ring->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+    }
+
+private:
+    void put(unsigned slot, unsigned bid)
+    {
+        // Index the ring as a plain io_uring_buf array. Compiled as C++, the
+        // kernel header's flexible `bufs` member sits 8 bytes too far in.
+        io_uring_buf &b = reinterpret_cast<io_uring_buf *>(ring)[slot & mask];
+        b.addr = (uint64_t)(uintptr_t)buffer(bid);
+        b.len = RECV_BUFFER_SIZE;
+        b.bid = (uint16_t)bid;
+    }
+};
+
+using MessagePtr = shared_ptr<const string>;
+
+struct Client
+{
+    string name;
+    FrameParser parser;
+    FrameMode encoding = FrameMode::Detect; // fixed by the client's first byte
+
+    deque<MessagePtr> queue;  // waiting to be sent, front may be in flight
+    size_t offset = 0;        // bytes of queue.front() already sent
+    iovec iov[MAX_IOV];       // must outlive the in-flight writev
+    bool sending = false;     // a writev is in flight
+    bool recvArmed = false;   // multishot recv is active
+    bool closing = false;     // left the chat, waiting for in-flight ops
+    bool dirty = false;       // on the flush list
+};
+
+Ring uring;
+BufferRing recvBuffers;
+int serverSocket = -1;
+
+unordered_map<int, Client> clients;
+vector<int> clientOrder;  // accept order, for broadcast iteration
+vector<int> flushList;    // clients with queued data and no send in flight
+vector<uint64_t> deferred; // accept/recv/stdin arms that found the ring full
+
+char stdinBuffer[BUF_SIZE];
+FrameParser operatorInput(FrameMode::Text);
+
+unsigned long long messagesIn = 0;
+unsigned long long messagesOut = 0;
+
+void handle_sigint(int)
+{
+    cout << "\nSIGINT received, shutting down server...\n";
+    stop.store(true);
+}
+
+void armAccept()
+{
+    io_uring_sqe *sqe = uring.getSqe();
+    if (!sqe)
+    {
+        deferred.push_back(makeUserData(OP_ACCEPT, serverSocket));
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = serverSocket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = makeUserData(OP_ACCEPT, serverSocket);
+}
+
+void armRecv(int fd, Client &c)
+{
+    io_uring_sqe *sqe = uring.getSqe();
+    if (!sqe)
+    {
+        deferred.push_back(makeUserData(OP_RECV, fd));
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_GROUP;
+    sqe->user_data = makeUserData(OP_RECV, fd);
+    c.recvArmed = true;
+}
+
+void armStdin()
+{
+    io_uring_sqe *sqe = uring.getSqe();
+    if (!sqe)
+    {
+        deferred.push_back(makeUserData(OP_STDIN, STDIN_FILENO));
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = STDIN_FILENO;
+    sqe->addr = (uint64_t)(uintptr_t)stdinBuffer;
+    sqe->len = sizeof(stdinBuffer);
+    sqe->off = (uint64_t)-1; // current file position
+    sqe->user_data = makeUserData(OP_STDIN, STDIN_FILENO);
+}
+
+void markDirty(int fd, Client &c)
+{
+    if (!c.dirty && !c.sending)
+    {
+        c.dirty = true;
+        flushList.push_back(fd);
+    }
+}
+
+void enqueue(int fd, Client &c, const MessagePtr &msg)
+{
+    // Nothing is sent before the client's first byte fixes its encoding
+    if (c.closing || c.encoding == FrameMode::Detect)
+        return;
+    c.queue.push_back(msg);
+    messagesOut++;
+    markDirty(fd, c);
+}
+
+// Prepare one writev covering as much of the queue as fits. Returns false
+// if the ring is full.
+bool prepareSend(int fd, Client &c)
+{
+    io_uring_sqe *sqe = uring.getSqe();
+    if (!sqe)
+        return false;
+
+    int iovcnt = 0;
+    for (size_t i = 0; i < c.queue.size() && iovcnt < MAX_IOV; i++, iovcnt++)
+    {
+        size_t skip = (i == 0) ? c.offset : 0;
+        c.iov[iovcnt].iov_base = const_cast<char *>(c.queue[i]->data()) + skip;
+        c.iov[iovcnt].iov_len = c.queue[i]->size() - skip;
+    }
+
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)c.iov;
+    sqe->len = iovcnt;
+    sqe->user_data = makeUserData(OP_SEND, fd);
+    c.sending = true;
+    return true;
+}
+
+// Queue sends for every client touched in this batch. They all go to the
+// kernel together with the next io_uring_enter, so a broadcast to N
+// clients costs one syscall instead of N. Clients the ring has no room for
+// stay on the list for the next loop.
+void flushAll()
+{
+    size_t kept = 0;
+    for (int fd : flushList)
+    {
+        auto it = clients.find(fd);
+        if (it == clients.end())
+            continue;
+        Client &c = it->second;
+        if (!c.sending && !c.queue.empty() && !c.closing && !prepareSend(fd, c))
+        {
+            flushList[kept++] = fd;
+            continue;
+        }
+        c.dirty = false;
+    }
+    flushList.resize(kept);
+}
+
+// Retry the arms that found the ring full
+void armDeferred()
+{
+    vector<uint64_t> retry;
+    retry.swap(deferred);
+    for (uint64_t data : retry)
+    {
+        int fd = userDataFd(data);
+        switch (userDataOp(data))
+        {
+        case OP_ACCEPT:
+            armAccept();
+            break;
+        case OP_RECV:
+        {
+            auto it = clients.find(fd);
+            if (it != clients.end() && !it->second.closing && !it->second.recvArmed)
+                armRecv(fd, it->second);
+            break;
+        }
+        case OP_STDIN:
+            armStdin();
+            break;
+        case OP_SEND:
+            break;
+        }
+    }
+}
+
+// Build the per-encoding variants of a line once and share them
+struct Broadcast
+{
+    string line; // without the trailing '\n'
+    MessagePtr text, binary;
+
+    explicit Broadcast(string l) : line(move(l)) {}
+
+    const MessagePtr &forEncoding(FrameMode mode)
+    {
+        MessagePtr &slot = (mode == FrameMode::Binary) ? binary : text;
+        if (!slot)
+        {
+            string out;
+            appendFrame(out, mode, line.data(), line.size());
+            slot = make_shared<const string>(move(out));
+        }
+        return slot;
+    }
+};
+
+void broadcastMessage(int clientFd, const string &body)
+{
+    Client &sender = clients[clientFd];
+    Broadcast others(sender.name + body);
+    Broadcast self("You" + body);
+
+    for (int fd : clientOrder)
+    {
+        Client &c = clients[fd];
+        Broadcast &b = (fd == clientFd) ? self : others;
+        enqueue(fd, c, b.forEncoding(c.encoding));
+    }
+}
+
+void broadcastServer(const string &text)
+{
+    Broadcast msg("[SERVER]: " + text);
+    for (int fd : clientOrder)
+    {
+        Client &c = clients[fd];
+        enqueue(fd, c, msg.forEncoding(c.encoding));
+    }
+}
+
+void closeIfIdle(int fd)
+{
+    auto it = clients.find(fd);
+    if (it == clients.end())
+        return;
+    Client &c = it->second;
+    if (!c.closing || c.sending || c.recvArmed)
+        return;
+
+    close(fd);
+    clients.erase(it);
+}
+
+// Leave the chat: stop broadcasting to the client and tear down its
+// in-flight operations. The fd is closed once they have completed.
+void cleanupClient(int fd)
+{
+    Client &c = clients[fd];
+    if (c.closing)
+        return;
+    c.closing = true;
+    // An in-flight writev still points into the queue, so it is freed only
+    // with the client, in closeIfIdle
+    if (!c.sending)
+        c.queue.clear();
+    clientOrder.erase(remove(clientOrder.begin(), clientOrder.end(), fd), clientOrder.end());
+    shutdown(fd, SHUT_RDWR); // completes the pending recv/writev
+    closeIfIdle(fd);
+}
+
+void leaveChat(int fd, const char *reason)
+{
+    Client &c = clients[fd];
+    if (c.closing)
+        return;
+    broadcastMessage(fd, " has left the chat.");
+    cout << "\nClient " << fd << "[" << c.name << "]" << " " << reason << " (total: " << clientOrder.size() - 1 << ")\n";
+    cleanupClient(fd);
+}
+
+// Act on one complete frame. Returns false once the client is gone.
+bool handleFrame(int fd, const char *frame, size_t length)
+{
+    messagesIn++;
+
+    if (length > 0 && frame[0] == '#')
+    {
+        leaveChat(fd, "sent disconnect");
+        return false;
+    }
+
+    if (length >= 5 && strncmp(frame, "JOIN ", 5) == 0)
+    {
+        Client &c = clients[fd];
+        c.name.assign(frame + 5, length - 5);
+        broadcastMessage(fd, " has joined the chat.");
+        cout << "\nClient " << fd << "[" << c.name << "]: connected (total: " << clientOrder.size() << ")\n";
+        return true;
+    }
+
+    string text(frame, length);
+    cout << "\nClient " << fd << "[" << clients[fd].name << "]" << " message: " << text << "\n";
+    broadcastMessage(fd, ": " + text);
+    return true;
+}
+
+void handleAccept(io_uring_cqe *cqe)
+{
+    if (cqe->res >= 0)
+    {
+        int fd = cqe->res;
+        clientOrder.push_back(fd);
+        armRecv(fd, clients[fd]);
+    }
+    else if (cqe->res != -EINTR && cqe->res != -EAGAIN)
+    {
+        cerr << "accept: " << strerror(-cqe->res) << "\n";
+    }
+
+    // Multishot accept stays armed until the kernel says otherwise
+    if (!(cqe->flags & IORING_CQE_F_MORE) && !stop.load())
+        armAccept();
+}
+
+void handleRecv(io_uring_cqe *cqe)
+{
+    int fd = userDataFd(cqe->user_data);
+    Client &c = clients[fd];
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+
+    if (cqe->res > 0)
+    {
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (!c.closing)
+            c.parser.feed(recvBuffers.buffer(bid), cqe->res);
+        recvBuffers.recycle(bid);
+
+        const char *frame;
+        size_t length;
+        FrameParser::Result res = FrameParser::NeedMore;
+        while (!c.closing && (res = c.parser.next(frame, length)) == FrameParser::Frame)
+        {
+            c.encoding = c.parser.encoding();
+            if (!handleFrame(fd, frame, length))
+                break;
+        }
+
+        if (!c.closing && res == FrameParser::Error)
+            leaveChat(fd, "sent an oversized frame");
+    }
+    else if (cqe->res == 0)
+    {
+        const char *frame;
+        size_t length;
+        if (!c.closing && c.parser.finish(frame, length) == FrameParser::Frame)
+            handleFrame(fd, frame, length);
+        leaveChat(fd, "closed connection");
+    }
+    else if (cqe->res != -ENOBUFS && !c.closing)
+    {
+        cerr << "recv: " << strerror(-cqe->res) << "\n";
+        leaveChat(fd, "error on recv");
+    }
+
+    // The client stays in the map until here even if it left above
+    if (!more)
+    {
+        c.recvArmed = false;
+        // Buffer ring ran dry or the kernel ended the multishot: re-arm
+        if (!c.closing)
+            armRecv(fd, c);
+    }
+    closeIfIdle(fd);
+}
+
+void handleSend(io_uring_cqe *cqe)
+{
+    int fd = userDataFd(cqe->user_data);
+    Client &c = clients[fd];
+    c.sending = false;
+
+    if (c.closing)
+    {
+        closeIfIdle(fd);
+        return;
+    }
+    if (cqe->res < 0)
+    {
+        if (!c.closing)
+            leaveChat(fd, "error on send");
+        closeIfIdle(fd);
+        return;
+    }
+
+    size_t left = cqe->res;
+    while (left > 0 && !c.queue.empty())
+    {
+        size_t avail = c.queue.front()->size() - c.offset;
+        if (left < avail)
+        {
+            c.offset += left;
+            break;
+        }
+        left -= avail;
+        c.offset = 0;
+        c.queue.pop_front();
+    }
+
+    if (!c.queue.empty())
+        markDirty(fd, c);
+    closeIfIdle(fd);
+}
+
+void handleStdin(io_uring_cqe *cqe)
+{
+    if (cqe->res <= 0)
+        return; // stdin closed, stop reading it
+
+    operatorInput.feed(stdinBuffer, cqe->res);
+    const char *frame;
+    size_t length;
+    while (operatorInput.next(frame, length) == FrameParser::Frame)
+    {
+        if (length > 0)
+            broadcastServer(string(frame, length));
+    }
+    armStdin();
+}
+
+int main()
+{
+    signal(SIGINT, handle_sigint);
+    signal(SIGPIPE, SIG_IGN);
+
+    //Setup server socket
+    sockaddr_in server_addr{};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    server_addr.sin_port = htons(PORT);
+
+    serverSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (serverSocket < 0)
+    {
+        perror("socket");
+        return 1;
+    }
+
+    int opt = 1;
+    setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    if (bind(serverSocket, (sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+        perror("bind");
+        return 1;
+    }
+
+    if (listen(serverSocket, 128) < 0)
+    {
+        perror("listen");
+        return 1;
+    }
+
+    if (!uring.setup(RING_ENTRIES) || !recvBuffers.setup(uring))
+        return 1;
+
+    cout << "Server (io_uring) listening on port " << PORT << "...\n";
+
+    armAccept();
+    armStdin();
+
+    while (!stop.load())
+    {
+        armDeferred();
+        flushAll();
+
+        __kernel_timespec timeout{};
+        timeout.tv_sec = 1;
+        int ret = uring.submit(1, &timeout);
+        if (ret < 0 && errno != EINTR && errno != ETIME && errno != EBUSY)
+        {
+            perror("io_uring_enter");
+            break;
+        }
+
+        // Reap every completion that is ready
+        unsigned head = *uring.cqHead;
+        unsigned tail = __atomic_load_n(uring.cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            io_uring_cqe *cqe = &uring.cqes[head & *uring.cqMask];
+            switch (userDataOp(cqe->user_data))
+            {
+            case OP_ACCEPT: handleAccept(cqe); break;
+            case OP_RECV:   handleRecv(cqe);   break;
+            case OP_SEND:   handleSend(cqe);   break;
+            case OP_STDIN:  handleStdin(cqe);  break;
+            }
+        }
+        __atomic_store_n(uring.cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    // Notify clients about shutdown (best effort, bypasses the ring)
+    for (int fd : clientOrder)
+    {
+        if (clients[fd].encoding == FrameMode::Detect)
+        {
+            close(fd);
+            continue;
+        }
+        string bye;
+        appendFrame(bye, clients[fd].encoding, "#", 1);
+        send(fd, bye.data(), bye.size(), MSG_DONTWAIT);
+        close(fd);
+    }
+    close(serverSocket);
+
+    cout << "io_uring_enter calls: " << uring.enterCalls
+         << ", messages in: " << messagesIn
+         << ", messages out: " << messagesOut;
+    if (messagesOut > 0)
+        cout << ", syscalls/message out: " << (double)uring.enterCalls / messagesOut;
+    cout << "\nServer shutdown complete.\n";
+}
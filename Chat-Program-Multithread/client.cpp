@@ -85,7 +85,9 @@ int main() {
             if (strlen(buffer) == 0)
                 continue;
 
-            if (send(clientSocket, buffer, strlen(buffer), 0) <= 0) {
+            // One chat line per message, newline-terminated
+            string line = string(buffer) + "\n";
+            if (send(clientSocket, line.c_str(), line.size(), 0) <= 0) {
                 stop.store(true);
                 break;
             }
@@ -3,25 +3,59 @@
 #include <vector>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <deque>
 #include <atomic>
 #include <algorithm>
 #include <csignal>
+#include <climits>
+#include <getopt.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 
+#include "../common/frame.h"
+
 using namespace std;
 
 constexpr int PORT = 1500;
 constexpr int BUF_SIZE = 1024;
+constexpr int READ_SIZE = 16 * 1024; // bytes requested per recv(), may hold many frames
 
 atomic<bool> stop{false};
 int serverSocket = -1;
 
 mutex mtx;
 vector<int> clientSockets;
-vector<thread> clientThreads;
+
+// Client threads are started with a small stack and detached, so a thread
+// and its stack are released as soon as its client is gone
+size_t stackSize = 64 * 1024;
+atomic<int> liveThreads{0};
+atomic<int> peakThreads{0};
+mutex threadsMtx;
+condition_variable threadsDone;
+
+// Worker pool mode (-w): a dispatcher thread poll()s the listen socket and
+// every idle client, and hands a client whose socket became readable to
+// one of a fixed set of workers. The worker reads and handles what
+// arrived, then passes the client back through a pipe. The thread count
+// no longer grows with the number of clients.
+struct Session {
+    int fd;
+    FrameParser parser;
+};
+
+int workerCount = 0; // 0: one thread per client
+vector<pthread_t> workers;
+mutex queueMtx;
+condition_variable queueReady;
+deque<Session*> readyQueue;
+int returnPipe[2] = {-1, -1}; // workers -> dispatcher, one Session* per write
 
 void handle_sigint(int) {
     cout << "\nSIGINT received, shutting down server...\n";
@@ -46,23 +80,47 @@ void removeClient(int fd) {
     );
 }
 
-void clientReceiveLoop(int fd) {
-    char buffer[BUF_SIZE];
+// Returns false when the frame asks to disconnect
+bool handleFrame(int fd, const char* frame, size_t length) {
+    if (length > 0 && frame[0] == '#')
+        return false;
 
-    while (!stop.load()) {
-        ssize_t n = recv(fd, buffer, BUF_SIZE - 1, 0);
-        if (n <= 0)
-            break;
+    lock_guard<mutex> lock(mtx);
+    cout << "Client " << fd << ": " << string(frame, length) << endl;
+    return true;
+}
 
-        buffer[n] = '\0';
+// Read once and handle every complete frame. Returns false once the
+// client is done: it disconnected, closed, failed or sent an oversized frame.
+bool receiveOnce(int fd, FrameParser& parser) {
+    const char* frame;
+    size_t length;
 
-        if (buffer[0] == '#')
-            break;
+    // Receive straight into the parser; one read may carry many frames
+    ssize_t n = recv(fd, parser.prepare(READ_SIZE), READ_SIZE, 0);
+    if (n <= 0) {
+        // Older clients send "#" without a newline and close right away
+        if (n == 0 && parser.finish(frame, length) == FrameParser::Frame)
+            handleFrame(fd, frame, length);
+        return false;
+    }
+
+    parser.commit(n);
 
-        lock_guard<mutex> lock(mtx);
-        cout << "Client " << fd << ": " << buffer << endl;
+    FrameParser::Result res;
+    while ((res = parser.next(frame, length)) == FrameParser::Frame) {
+        if (!handleFrame(fd, frame, length))
+            return false;
     }
 
+    if (res == FrameParser::Error) {
+        cout << "Client " << fd << " sent an oversized frame.\n";
+        return false;
+    }
+    return true;
+}
+
+void disconnectClient(int fd) {
     removeClient(fd);
     send(fd, "#", 1, 0);
     close(fd);
@@ -70,8 +128,250 @@ void clientReceiveLoop(int fd) {
     cout << "Client " << fd << " disconnected.\n";
 }
 
-int main() {
+// "threads: 3, stacks: 192 KiB" - client or worker threads and the stack
+// address space reserved for them
+string threadReport(int threads) {
+    return "threads: " + to_string(threads) + ", stacks: " +
+           to_string(threads * stackSize / 1024) + " KiB";
+}
+
+// Start a thread with a stackSize stack. Without `tid` it is detached.
+bool startThread(pthread_t* tid, void* (*fn)(void*), void* arg) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, max(stackSize, (size_t)PTHREAD_STACK_MIN));
+    if (!tid)
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pthread_t detached;
+    int err = pthread_create(tid ? tid : &detached, &attr, fn, arg);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+        errno = err;
+        perror("pthread_create");
+        return false;
+    }
+
+    int n = ++liveThreads;
+    int peak = peakThreads.load();
+    while (n > peak && !peakThreads.compare_exchange_weak(peak, n))
+        ;
+    return true;
+}
+
+void threadFinished() {
+    lock_guard<mutex> lock(threadsMtx);
+    --liveThreads;
+    threadsDone.notify_all();
+}
+
+void* clientThread(void* arg) {
+    int fd = (int)(intptr_t)arg;
+    FrameParser parser;
+
+    while (!stop.load() && receiveOnce(fd, parser))
+        ;
+    disconnectClient(fd);
+
+    threadFinished();
+    return nullptr;
+}
+
+void* workerThread(void*) {
+    while (true) {
+        Session* s;
+        {
+            unique_lock<mutex> lock(queueMtx);
+            queueReady.wait(lock, [] { return stop.load() || !readyQueue.empty(); });
+            if (stop.load())
+                break;
+            s = readyQueue.front();
+            readyQueue.pop_front();
+        }
+
+        // The socket is readable, so this recv() does not block
+        if (receiveOnce(s->fd, s->parser)) {
+            if (write(returnPipe[1], &s, sizeof(s)) != sizeof(s))
+                perror("write: return pipe");
+        } else {
+            disconnectClient(s->fd);
+            delete s;
+        }
+    }
+
+    threadFinished();
+    return nullptr;
+}
+
+// Thread-per-client mode: accept and start a thread for each client
+void acceptLoop() {
+    while (!stop.load()) {
+        sockaddr_in client_addr{};
+        socklen_t len = sizeof(client_addr);
+
+        int fd = accept(serverSocket, (sockaddr*)&client_addr, &len);
+        if (fd < 0) {
+            if (stop.load())
+                break;
+            perror("accept");
+            continue;
+        }
+
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client_addr.sin_addr, ip, sizeof(ip));
+
+        {
+            lock_guard<mutex> lock(mtx);
+            clientSockets.push_back(fd);
+        }
+        if (!startThread(nullptr, clientThread, (void*)(intptr_t)fd)) {
+            removeClient(fd);
+            close(fd);
+            continue;
+        }
+
+        cout << "> Client " << fd << " connected from " << ip << " (" << threadReport(liveThreads.load()) << ")\n";
+    }
+
+    // Detached threads exit once the shutdown closes their sockets
+    unique_lock<mutex> lock(threadsMtx);
+    threadsDone.wait(lock, [] { return liveThreads.load() == 0; });
+}
+
+// Worker pool mode: accept clients, watch idle ones and queue ready ones
+void dispatchLoop() {
+    // Entry 0: listen socket, 1: return pipe, then idle clients
+    vector<pollfd> fds(2);
+    vector<Session*> idle(2, nullptr);
+    fds[0].fd = serverSocket;
+    fds[0].events = POLLIN;
+    fds[1].fd = returnPipe[0];
+    fds[1].events = POLLIN;
+
+    auto watch = [&](Session* s) {
+        pollfd pfd{};
+        pfd.fd = s->fd;
+        pfd.events = POLLIN | POLLRDHUP;
+        fds.push_back(pfd);
+        idle.push_back(s);
+    };
+
+    while (!stop.load()) {
+        int ready = poll(fds.data(), fds.size(), 1000);
+        if (ready < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+        if (stop.load())
+            break;
+
+        // Ready clients leave the watch list until a worker returns them.
+        // The last entry (with its revents) moves into the hole.
+        size_t queued = 0;
+        for (size_t i = 2; i < fds.size(); ) {
+            if (!(fds[i].revents & (POLLIN | POLLRDHUP | POLLHUP | POLLERR))) {
+                i++;
+                continue;
+            }
+            {
+                lock_guard<mutex> lock(queueMtx);
+                readyQueue.push_back(idle[i]);
+            }
+            queued++;
+            fds[i] = fds.back();
+            idle[i] = idle.back();
+            fds.pop_back();
+            idle.pop_back();
+        }
+        if (queued == 1)
+            queueReady.notify_one();
+        else if (queued > 1)
+            queueReady.notify_all();
+
+        // Clients a worker is done with for now
+        if (fds[1].revents & POLLIN) {
+            Session* s;
+            while (read(returnPipe[0], &s, sizeof(s)) == sizeof(s))
+                watch(s);
+        }
+
+        if (fds[0].revents & POLLIN) {
+            while (true) {
+                sockaddr_in client_addr{};
+                socklen_t len = sizeof(client_addr);
+
+                // Accepted sockets are blocking again; only the listen
+                // socket is non-blocking
+                int fd = accept(serverSocket, (sockaddr*)&client_addr, &len);
+                if (fd < 0) {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+                        perror("accept");
+                    break;
+                }
+
+                char ip[INET_ADDRSTRLEN];
+                inet_ntop(AF_INET, &client_addr.sin_addr, ip, sizeof(ip));
+
+                {
+                    lock_guard<mutex> lock(mtx);
+                    clientSockets.push_back(fd);
+                }
+                watch(new Session{fd, FrameParser()});
+
+                cout << "> Client " << fd << " connected from " << ip << " (" << threadReport(liveThreads.load()) << ")\n";
+            }
+        }
+    }
+
+    {
+        lock_guard<mutex> lock(queueMtx);
+    }
+    queueReady.notify_all();
+    for (pthread_t t : workers)
+        pthread_join(t, nullptr);
+
+    // Every remaining client is idle, queued or in the pipe
+    Session* s;
+    while (read(returnPipe[0], &s, sizeof(s)) == sizeof(s))
+        idle.push_back(s);
+    idle.insert(idle.end(), readyQueue.begin(), readyQueue.end());
+    readyQueue.clear();
+    for (size_t i = 2; i < idle.size(); i++) {
+        disconnectClient(idle[i]->fd);
+        delete idle[i];
+    }
+}
+
+void usage(const char* prog) {
+    cerr << "Usage: " << prog << " [-w workers] [-s stack-KiB]\n"
+         << "  -w N  serve clients from a pool of N worker threads (default: one thread per client)\n"
+         << "  -s N  stack size of client and worker threads in KiB (default " << stackSize / 1024 << ")\n";
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "w:s:h")) != -1) {
+        switch (opt) {
+        case 'w':
+            workerCount = atoi(optarg);
+            break;
+        case 's':
+            stackSize = (size_t)atoi(optarg) * 1024;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (workerCount < 0 || stackSize == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
     signal(SIGINT, handle_sigint);
+    signal(SIGPIPE, SIG_IGN); // clients may be gone when "#" is sent
 
     sockaddr_in server_addr{};
     server_addr.sin_family = AF_INET;
@@ -84,7 +384,7 @@ int main() {
         return 1;
     }
 
-    int opt = 1;
+    opt = 1;
     setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
     if (bind(serverSocket, (sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
@@ -99,31 +399,29 @@ int main() {
 
     cout << "Server listening on port " << PORT << "...\n";
 
-    // Accept thread
-    thread acceptThread([&]() {
-        while (!stop.load()) {
-            sockaddr_in client_addr{};
-            socklen_t len = sizeof(client_addr);
-
-            int fd = accept(serverSocket, (sockaddr*)&client_addr, &len);
-            if (fd < 0) {
-                if (stop.load())
-                    break;
-                perror("accept");
-                continue;
-            }
-
-            char ip[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &client_addr.sin_addr, ip, sizeof(ip));
-
-            {
-                lock_guard<mutex> lock(mtx);
-                clientSockets.push_back(fd);
-                clientThreads.emplace_back(clientReceiveLoop, fd);
-            }
+    if (workerCount > 0) {
+        if (pipe(returnPipe) < 0) {
+            perror("pipe");
+            return 1;
+        }
+        // The dispatcher drains both until EAGAIN
+        fcntl(serverSocket, F_SETFL, fcntl(serverSocket, F_GETFL, 0) | O_NONBLOCK);
+        fcntl(returnPipe[0], F_SETFL, fcntl(returnPipe[0], F_GETFL, 0) | O_NONBLOCK);
 
-            cout << "> Client " << fd << " connected from " << ip << "\n";
+        workers.resize(workerCount);
+        for (pthread_t& t : workers) {
+            if (!startThread(&t, workerThread, nullptr))
+                return 1;
         }
+        cout << "Worker pool: " << threadReport(workerCount) << "\n";
+    }
+
+    // Accept thread
+    thread acceptThread([&]() {
+        if (workerCount > 0)
+            dispatchLoop();
+        else
+            acceptLoop();
     });
 
     // Server input → broadcast
@@ -141,10 +439,7 @@ int main() {
     });
 
     acceptThread.join();
-
-    for (auto& t : clientThreads)
-        if (t.joinable())
-            t.join();
+    cout << "Peak " << threadReport(peakThreads.load()) << "\n";
 
     stop.store(true);
     sendThread.join();
@@ -3,26 +3,53 @@
 #include <vector>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <atomic>
 #include <algorithm>
 #include <csignal>
+#include <getopt.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
 
+#include "../common/frame.h"
+
 using namespace std;
 
 constexpr int PORT = 1500;
 constexpr int BUF_SIZE = 1024;
+constexpr int READ_SIZE = 16 * 1024; // bytes requested per recv(), may hold many frames
 
 atomic<bool> stop{false};
 int serverSocket = -1;
 
+struct Session
+{
+    int fd;
+    FrameParser parser;
+};
+
 mutex mtx;
-vector<int> clientSockets;
-vector<thread> clientThreads;
+vector<Session *> sessions;
+
+// Leader/followers: all pool threads share one epoll instance. One of them,
+// the leader, waits in epoll_wait() for a single event; the rest wait on
+// followersCv. On an event the leader promotes a follower and then handles
+// the event itself. Every socket is registered EPOLLONESHOT, so no other
+// thread sees it until the handler re-arms it. Idle connections cost no
+// wakeups and a message is handled as soon as it arrives.
+int epollfd = -1;
+int stopfd = -1; // eventfd, written by the SIGINT handler
+mutex leaderMtx;
+condition_variable followersCv;
+bool haveLeader = false;
+
+// epoll tags for the two non-client fds
+char listenTag, stopTag;
 
 void set_non_blocking(int socket)
 {
@@ -45,51 +72,222 @@ void handle_sigint(int)
 {
     cout << "\nSIGINT received, shutting down server...\n";
     stop.store(true);
+    // Wakes the leader; the eventfd stays readable, so every thread sees it
+    uint64_t one = 1;
+    if (write(stopfd, &one, sizeof(one)) < 0)
+        return;
     //shutdown(serverSocket, SHUT_RDWR);
 }
 
-void removeClient(int fd)
+void removeClient(Session *s)
+{
+    lock_guard<mutex> lock(mtx);
+    sessions.erase(
+        remove(sessions.begin(), sessions.end(), s),
+        sessions.end());
+}
+
+// Register (EPOLL_CTL_ADD) or re-arm (EPOLL_CTL_MOD) a one-shot watch
+bool armSocket(int op, int fd, void *tag)
+{
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = tag;
+    if (epoll_ctl(epollfd, op, fd, &ev) == -1)
+    {
+        perror("epoll_ctl");
+        return false;
+    }
+    return true;
+}
+
+// Returns false when the frame asks to disconnect
+bool handleFrame(int fd, const char *frame, size_t length)
 {
+    if (length > 0 && frame[0] == '#')
+        return false;
+
     lock_guard<mutex> lock(mtx);
-    clientSockets.erase(
-        remove(clientSockets.begin(), clientSockets.end(), fd),
-        clientSockets.end());
+    cout << "Client " << fd << ": " << string(frame, length) << endl;
+    return true;
 }
 
-void clientReceiveLoop(int fd)
+// Read everything the socket has. Returns false once the client is gone.
+bool handleClientData(Session *s)
 {
-    char buffer[BUF_SIZE];
+    const char *frame;
+    size_t length;
 
-    while (!stop.load())
+    while (true)
     {
-        ssize_t n = recv(fd, buffer, BUF_SIZE - 1, 0);
-        if (n <= 0)
+        // Receive straight into the parser; one read may carry many frames
+        ssize_t n = recv(s->fd, s->parser.prepare(READ_SIZE), READ_SIZE, 0);
+        if (n < 0)
         {
             if (errno == EAGAIN || errno == EWOULDBLOCK)
-            {
-                this_thread::sleep_for(chrono::milliseconds(50));
+                return true; // drained, wait for the next event
+            if (errno == EINTR)
+                continue;
+            return false; // real error
+        }
+
+        if (n == 0)
+        {
+            // Older clients send "#" without a newline and close right away
+            if (s->parser.finish(frame, length) == FrameParser::Frame)
+                handleFrame(s->fd, frame, length);
+            return false;
+        }
+
+        s->parser.commit(n);
+
+        FrameParser::Result res;
+        while ((res = s->parser.next(frame, length)) == FrameParser::Frame)
+        {
+            if (!handleFrame(s->fd, frame, length))
+                return false;
+        }
+
+        if (res == FrameParser::Error)
+        {
+            cout << "Client " << s->fd << " sent an oversized frame.\n";
+            return false;
+        }
+    }
+}
+
+void handleNewConnections()
+{
+    while (true)
+    {
+        sockaddr_in client_addr{};
+        socklen_t len = sizeof(client_addr);
+
+        int fd = accept(serverSocket, (sockaddr *)&client_addr, &len);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
                 continue;
-            }
-            break; // real error
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            return;
         }
 
-        buffer[n] = '\0';
+        set_non_blocking(fd);
 
-        if (buffer[0] == '#') {
-            cout << "Client " << fd << " disconnected.\n";
-            removeClient(fd);
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client_addr.sin_addr, ip, sizeof(ip));
+
+        Session *s = new Session{fd, FrameParser()};
+        {
+            lock_guard<mutex> lock(mtx);
+            sessions.push_back(s);
+        }
+        cout << "> Client " << fd << " connected from " << ip << "\n";
+
+        if (!armSocket(EPOLL_CTL_ADD, fd, s))
+        {
+            removeClient(s);
             close(fd);
-            break;
+            delete s;
         }
+    }
+}
 
-        lock_guard<mutex> lock(mtx);
-        cout << "Client " << fd << ": " << buffer << endl;
+void poolThread()
+{
+    while (true)
+    {
+        // Follow until there is no leader, then lead
+        {
+            unique_lock<mutex> lock(leaderMtx);
+            followersCv.wait(lock, [] { return !haveLeader; });
+            haveLeader = true;
+        }
+
+        epoll_event ev;
+        int ready = epoll_wait(epollfd, &ev, 1, -1);
+
+        // Promote a follower before doing any work
+        {
+            lock_guard<mutex> lock(leaderMtx);
+            haveLeader = false;
+        }
+        followersCv.notify_one();
+
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            return;
+        }
+        if (ready == 0)
+            continue;
+
+        if (ev.data.ptr == &stopTag)
+            return;
+
+        if (ev.data.ptr == &listenTag)
+        {
+            handleNewConnections();
+            armSocket(EPOLL_CTL_MOD, serverSocket, &listenTag);
+            continue;
+        }
+
+        Session *s = static_cast<Session *>(ev.data.ptr);
+        if (handleClientData(s) && armSocket(EPOLL_CTL_MOD, s->fd, s))
+            continue;
+
+        // Closing the fd also takes it out of the epoll set
+        cout << "Client " << s->fd << " disconnected.\n";
+        removeClient(s);
+        close(s->fd);
+        delete s;
     }
 }
 
-int main()
+void usage(const char *prog)
 {
+    cerr << "Usage: " << prog << " [-t threads]\n"
+         << "  -t N  leader/followers pool size (default: number of cores)\n";
+}
+
+int main(int argc, char *argv[])
+{
+    int threadCount = (int)thread::hardware_concurrency();
+    if (threadCount <= 0)
+        threadCount = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            threadCount = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (threadCount <= 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    epollfd = epoll_create1(0);
+    stopfd = eventfd(0, EFD_NONBLOCK);
+    if (epollfd < 0 || stopfd < 0)
+    {
+        perror("epoll_create1/eventfd");
+        return 1;
+    }
+
     signal(SIGINT, handle_sigint);
+    signal(SIGPIPE, SIG_IGN); // clients may be gone when "#" is sent
 
     sockaddr_in server_addr{};
     server_addr.sin_family = AF_INET;
@@ -105,7 +303,7 @@ int main()
 
     set_non_blocking(serverSocket);
 
-    int opt = 1;
+    opt = 1;
     setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
     if (bind(serverSocket, (sockaddr *)&server_addr, sizeof(server_addr)) < 0)
@@ -122,49 +320,22 @@ int main()
 
     cout << "Server listening on port " << PORT << "...\n";
 
-    // Accept thread
-    thread acceptThread([&]()
-                        {
-        while (!stop.load()) {
-            sockaddr_in client_addr{};
-            socklen_t len = sizeof(client_addr);
-
-            fd_set readfds;
-            FD_ZERO(&readfds);
-            FD_SET(serverSocket, &readfds);
-            int maxfd = serverSocket;
-            timeval timeout{};
-            timeout.tv_sec = 0.2;
-
-            int ready = select(maxfd + 1, &readfds, nullptr, nullptr, &timeout);
-            if (ready < 0) {
-                if (errno == EINTR)
-                    continue;
-                perror("select");
-                break;
-            }
-
-            if(FD_ISSET(serverSocket, &readfds)) {
-
-                int fd = accept(serverSocket, (sockaddr*)&client_addr, &len);
-                if (fd < 0) {
-                    this_thread::sleep_for(chrono::milliseconds(100));
-                    continue;
-                }
-
-                set_non_blocking(fd);
-
-                char ip[INET_ADDRSTRLEN];
-                inet_ntop(AF_INET, &client_addr.sin_addr, ip, sizeof(ip));
+    // The stop eventfd is level-triggered and never read, so it wakes
+    // every thread in turn
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.ptr = &stopTag;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, stopfd, &ev) == -1 ||
+        !armSocket(EPOLL_CTL_ADD, serverSocket, &listenTag))
+    {
+        perror("epoll_ctl");
+        return 1;
+    }
 
-                {
-                    lock_guard<mutex> lock(mtx);
-                    clientSockets.push_back(fd);
-                    clientThreads.emplace_back(clientReceiveLoop, fd);
-                }
-                cout << "> Client " << fd << " connected from " << ip << "\n";
-            }
-        } });
+    vector<thread> pool;
+    for (int i = 0; i < threadCount; i++)
+        pool.emplace_back(poolThread);
+    cout << "Leader/followers pool: " << threadCount << " threads\n";
 
     // Server input → broadcast
     thread sendThread([&]()
@@ -176,24 +347,22 @@ int main()
                 break;
 
             lock_guard<mutex> lock(mtx);
-            for (int fd : clientSockets)
-                send(fd, buffer, strlen(buffer), 0);
+            for (Session *s : sessions)
+                send(s->fd, buffer, strlen(buffer), 0);
         }
         });
 
-    acceptThread.join();
-
-    for (auto &t : clientThreads)
-        if (t.joinable())
-            t.join();
+    for (auto &t : pool)
+        t.join();
 
     sendThread.join();
 
     // Notify clients about shutdown
     lock_guard<mutex> lock(mtx);
-    for (int fd : clientSockets) {
-        send(fd, "#", 1, 0);
-        close(fd);
+    for (Session *s : sessions) {
+        send(s->fd, "#", 1, 0);
+        close(s->fd);
+        delete s;
     }
     close(serverSocket);
     cout << "Server shutdown complete.\n";
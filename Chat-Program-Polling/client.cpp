@@ -128,7 +128,9 @@ int main() {
                 if (strlen(buffer) == 0)
                     continue;
 
-                if (send(clientSocket, buffer, strlen(buffer), 0) <= 0) {
+                // One chat line per message, newline-terminated
+                string line = string(buffer) + "\n";
+                if (send(clientSocket, line.c_str(), line.size(), 0) <= 0) {
                     stop.store(true);
                     break;
                 }
@@ -139,7 +141,7 @@ int main() {
     ClientThread.join();
 
     //Notify server about shutdown
-    send(clientSocket, "#", 1, 0);
+    send(clientSocket, "#\n", 2, 0);
 
     shutdown(clientSocket, SHUT_RDWR); // wake recv/send
     close(clientSocket);               // release fd
@@ -1,33 +1,74 @@
 #include <iostream>
 #include <cstring>
 #include <vector>
-#include <thread>
-#include <mutex>
+#include <deque>
+#include <memory>
 #include <atomic>
-#include <algorithm>
+#include <thread>
 #include <csignal>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
 
-#define MAX_CONNECTION 100
+#include "../common/frame.h"
+#include "../common/mpsc.h"
 
 using namespace std;
 
 constexpr int PORT = 1500;
 constexpr int BUF_SIZE = 1024;
+constexpr int READ_SIZE = 16 * 1024; // bytes requested per recv(), may hold many frames
+constexpr int MAX_IOV = 64;          // queued messages per writev
+
+// Fixed entries at the front of pollFds; clients follow
+constexpr size_t LISTEN_ENTRY = 0;
+constexpr size_t WAKE_ENTRY = 1; // read end of wakePipe
+constexpr size_t FIRST_CLIENT = 2;
 
 atomic<bool> stop{false};
 int serverSocket = -1;
 
-mutex mtx;
-vector<int> clientSockets;
+// An operator line on its way from the input thread to the poll loop
+struct Announcement
+{
+    Announcement *next = nullptr;
+    string text;
+};
+
+// Filled by the input thread without locking; the loop is woken through
+// wakePipe when it goes from empty to non-empty
+MpscQueue<Announcement> announcements;
+int wakePipe[2] = {-1, -1};
+
+// One serialized message, shared by every queue it is in
+typedef shared_ptr<const string> MessagePtr;
 
-struct pollfd clientFds[MAX_CONNECTION + 1];
-int nfds = 0;
+struct Client
+{
+    int fd = -1;
+    size_t pollIndex = 0; // this client's entry in pollFds
+    string name;
+    FrameParser parser;   // reassembly of partial frames
+    FrameMode encoding = FrameMode::Detect;
+    deque<MessagePtr> queue; // waiting for the socket to take them
+    size_t offset = 0;       // bytes of queue.front() already sent
+};
+
+// Client state by slot. Slots of departed clients go onto freeSlots and are
+// handed out again before the table grows, so there is no client limit and
+// finding a slot never scans.
+vector<Client> clients;
+vector<int> freeSlots;
+
+// What poll() watches, kept dense: only live fds, no -1 holes. pollSlots
+// says which client owns each entry. A client that leaves has the last
+// entry moved into its place.
+vector<pollfd> pollFds;
+vector<int> pollSlots;
 
 void set_non_blocking(int socket)
 {
@@ -53,100 +94,268 @@ void handle_sigint(int)
     // shutdown(serverSocket, SHUT_RDWR);
 }
 
-void removeClient(int fd)
+size_t clientCount()
 {
-    lock_guard<mutex> lock(mtx);
-    clientSockets.erase(
-        remove(clientSockets.begin(), clientSockets.end(), fd),
-        clientSockets.end());
+    return pollFds.size() - FIRST_CLIENT;
 }
 
 void cleanupClient(int slot)
 {
-    int fd = clientFds[slot].fd;
-
-    removeClient(fd);
-    close(fd);
+    Client &c = clients[slot];
+    close(c.fd);
+
+    // Keep pollFds dense: move the last entry into the hole
+    size_t i = c.pollIndex;
+    pollFds[i] = pollFds.back();
+    pollSlots[i] = pollSlots.back();
+    clients[pollSlots[i]].pollIndex = i;
+    pollFds.pop_back();
+    pollSlots.pop_back();
+
+    c = Client();
+    freeSlots.push_back(slot);
+}
 
-    clientFds[slot].fd = -1;
-    clientFds[slot].revents = 0;
-    --nfds;
+// POLLOUT is watched only while something is queued
+void setWriteInterest(Client &c)
+{
+    short events = POLLIN | POLLRDHUP;
+    if (!c.queue.empty())
+        events |= POLLOUT;
+    pollFds[c.pollIndex].events = events;
 }
 
-void handleNewConnection(int serverSocket)
+// Write as much of the client's queue as the socket accepts
+void flushClient(Client &c)
 {
-    sockaddr_in client_addr{};
-    socklen_t len = sizeof(client_addr);
-    
-    int client_fd = accept(serverSocket, (sockaddr*)&client_addr, &len);
-    if (client_fd < 0)
+    while (!c.queue.empty())
     {
-        if (errno == EAGAIN || errno == EWOULDBLOCK)
-            return; // no more pending connections
-        if (errno == EINTR)
-            return;
-        perror("accept");
-        return;
+        iovec iov[MAX_IOV];
+        int iovcnt = 0;
+        size_t want = 0;
+        for (size_t i = 0; i < c.queue.size() && iovcnt < MAX_IOV; i++, iovcnt++)
+        {
+            size_t skip = (i == 0) ? c.offset : 0;
+            iov[iovcnt].iov_base = const_cast<char *>(c.queue[i]->data()) + skip;
+            iov[iovcnt].iov_len = c.queue[i]->size() - skip;
+            want += iov[iovcnt].iov_len;
+        }
+
+        ssize_t n = writev(c.fd, iov, iovcnt);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+
+            // Peer is gone. Drop what is queued and let the read side see
+            // EOF so the usual leave path cleans the client up.
+            c.queue.clear();
+            c.offset = 0;
+            shutdown(c.fd, SHUT_RDWR);
+            break;
+        }
+
+        size_t left = n;
+        while (left > 0)
+        {
+            size_t avail = c.queue.front()->size() - c.offset;
+            if (left < avail)
+            {
+                c.offset += left;
+                break;
+            }
+            left -= avail;
+            c.offset = 0;
+            c.queue.pop_front();
+        }
+
+        if ((size_t)n < want)
+            break; // socket buffer is full, wait for POLLOUT
     }
 
-    // Find empty slot for new client
-    int slot = -1;
-    for (int i = 1; i <= MAX_CONNECTION; i++)
+    setWriteInterest(c);
+}
+
+void enqueue(Client &c, const MessagePtr &msg)
+{
+    // Nothing is sent before the client's first byte fixes its encoding
+    if (c.encoding == FrameMode::Detect)
+        return;
+    bool wasEmpty = c.queue.empty();
+    c.queue.push_back(msg);
+
+    // A non-empty queue is already waiting for POLLOUT
+    if (wasEmpty)
+        flushClient(c);
+}
+
+// Build the per-encoding variants of a line once and share them
+struct Broadcast
+{
+    string line; // without the trailing '\n'
+    MessagePtr text, binary;
+
+    explicit Broadcast(string l) : line(move(l)) {}
+
+    const MessagePtr &forEncoding(FrameMode mode)
     {
-        if (clientFds[i].fd == -1)
+        MessagePtr &slot = (mode == FrameMode::Binary) ? binary : text;
+        if (!slot)
         {
-            slot = i;
-            break;
+            string out;
+            appendFrame(out, mode, line.data(), line.size());
+            slot = make_shared<const string>(move(out));
         }
+        return slot;
     }
+};
 
-    if (slot == -1)
+void broadcastMessage(int senderSlot, const string &body)
+{
+    Broadcast others(clients[senderSlot].name + body);
+    Broadcast self("You" + body);
+
+    for (size_t i = FIRST_CLIENT; i < pollFds.size(); i++)
     {
-        cout << "Max clients reached, rejecting connection\n";
-        close(client_fd);
-        return;
+        int slot = pollSlots[i];
+        Client &c = clients[slot];
+        Broadcast &b = (slot == senderSlot) ? self : others;
+        enqueue(c, b.forEncoding(c.encoding));
+    }
+}
+
+void broadcastServer(const string &text)
+{
+    Broadcast msg("[SERVER]: " + text);
+    for (size_t i = FIRST_CLIENT; i < pollFds.size(); i++)
+    {
+        Client &c = clients[pollSlots[i]];
+        enqueue(c, msg.forEncoding(c.encoding));
     }
+}
 
-    // Add client to poll array
-    set_non_blocking(client_fd);
-    clientFds[slot].fd = client_fd;
-    clientFds[slot].events = POLLIN | POLLRDHUP;
-    nfds++;
+// Announce the departure, then drop the client
+void leaveChat(int slot, const char *reason)
+{
+    int fd = clients[slot].fd;
+    string name = clients[slot].name;
+    broadcastMessage(slot, " has left the chat.");
+    cleanupClient(slot);
+    cout << "Client " << fd << "[" << name << "] " << reason << " (slot " << slot << ") (total: " << clientCount() << ")\n";
+}
 
-    lock_guard<mutex> lock(mtx);
-    clientSockets.push_back(client_fd);
+void handleNewConnection(int serverSocket)
+{
+    // Take everything in the backlog
+    while (true)
+    {
+        sockaddr_in client_addr{};
+        socklen_t len = sizeof(client_addr);
 
-    char ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &client_addr.sin_addr, ip, sizeof(ip));
-    cout << "> Client " << client_fd << " connected from " << ip 
-         << " (slot " << slot << ", total: " << nfds << ")\n";
+        int client_fd = accept(serverSocket, (sockaddr*)&client_addr, &len);
+        if (client_fd < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return; // no more pending connections
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept");
+            return;
+        }
+
+        // Reuse a departed client's slot, or grow the table
+        int slot;
+        if (!freeSlots.empty())
+        {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+        }
+        else
+        {
+            slot = (int)clients.size();
+            clients.emplace_back();
+        }
+
+        // Add client to poll array
+        set_non_blocking(client_fd);
+        Client &c = clients[slot];
+        c.fd = client_fd;
+        c.pollIndex = pollFds.size();
+        pollfd pfd{};
+        pfd.fd = client_fd;
+        pfd.events = POLLIN | POLLRDHUP;
+        pollFds.push_back(pfd);
+        pollSlots.push_back(slot);
+
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client_addr.sin_addr, ip, sizeof(ip));
+        cout << "> Client " << client_fd << " connected from " << ip
+             << " (slot " << slot << ", total: " << clientCount() << ")\n";
+    }
+}
+
+// Act on one complete frame. Returns false once the client is gone.
+bool handleFrame(int slot, const char *frame, size_t length)
+{
+    Client &c = clients[slot];
+
+    // Check for disconnect message
+    if (length > 0 && frame[0] == '#')
+    {
+        leaveChat(slot, "sent disconnect");
+        return false;
+    }
+
+    if (length >= 5 && strncmp(frame, "JOIN ", 5) == 0)
+    {
+        c.name.assign(frame + 5, length - 5);
+        broadcastMessage(slot, " has joined the chat.");
+        cout << "Client " << c.fd << "[" << c.name << "]: connected (total: " << clientCount() << ")\n";
+        return true;
+    }
+
+    string text(frame, length);
+    cout << "Client " << c.fd << "[" << c.name << "]: " << text << "\n";
+    broadcastMessage(slot, ": " + text);
+    return true;
 }
 
 void handleClientData(int slot)
 {
-    char buffer[BUF_SIZE];
-    int clientFd = clientFds[slot].fd;
-    
-    ssize_t n = recv(clientFd, buffer, BUF_SIZE - 1, 0);
+    FrameParser &parser = clients[slot].parser;
+    int clientFd = clients[slot].fd;
+    const char *frame;
+    size_t length;
+
+    // Receive straight into the parser; one read may carry many frames
+    ssize_t n = recv(clientFd, parser.prepare(READ_SIZE), READ_SIZE, 0);
     if (n > 0)
     {
-        buffer[n] = '\0';
+        parser.commit(n);
 
-        // Check for disconnect message
-        if (buffer[0] == '#')
+        FrameParser::Result res;
+        while ((res = parser.next(frame, length)) == FrameParser::Frame)
         {
-            cleanupClient(slot);
-            cout << "Client " << clientFd << " sent disconnect (slot " << slot << ") (total: " << nfds << ")\n";
-            return;
+            // Replies follow the encoding the client picked
+            clients[slot].encoding = parser.encoding();
+            if (!handleFrame(slot, frame, length))
+                return;
         }
 
-        cout << "Client " << clientFd << ": " << buffer << "\n";
+        if (res == FrameParser::Error)
+            leaveChat(slot, "sent an oversized frame");
     }
     else if (n == 0)
     {
+        // Older clients send "#" without a newline and close right away
+        if (parser.finish(frame, length) == FrameParser::Frame &&
+            !handleFrame(slot, frame, length))
+            return;
+
         // Connection closed by client
-        cleanupClient(slot);
-        cout << "Client " << clientFd << " closed connection (slot " << slot << ") (total: " << nfds << ")\n";
+        leaveChat(slot, "closed connection");
     }
     else
     {
@@ -155,17 +364,52 @@ void handleClientData(int slot)
             return; // no more data available right now
         if (errno == EINTR)
             return; // interrupted, try again
-        
+
         // Real error
         perror("recv");
-        cleanupClient(slot);
-        cout << "Client " << clientFd << " error on recv (slot " << slot << ") (total: " << nfds << ")\n";
+        leaveChat(slot, "error on recv");
+    }
+}
+
+// Operator input, read on its own thread so that a half-typed line never
+// holds up the poll loop
+void handle_send_data()
+{
+    char buffer[BUF_SIZE];
+    while (!stop.load() && cin.getline(buffer, BUF_SIZE))
+    {
+        if (strlen(buffer) == 0)
+            continue;
+        Announcement *a = new Announcement();
+        a->text = buffer;
+        // Only the first line needs a wakeup; the rest ride along with it
+        char one = 1;
+        if (announcements.push(a) && write(wakePipe[1], &one, 1) < 0 && errno != EAGAIN)
+            perror("write: wake pipe");
+    }
+}
+
+// Broadcast the operator lines queued since the last wakeup
+void drainAnnouncements()
+{
+    char drain[64];
+    while (read(wakePipe[0], drain, sizeof(drain)) > 0)
+        ;
+
+    Announcement *a = announcements.popAll();
+    while (a)
+    {
+        broadcastServer(a->text);
+        Announcement *next = a->next;
+        delete a;
+        a = next;
     }
 }
 
 int main()
 {
     signal(SIGINT, handle_sigint);
+    signal(SIGPIPE, SIG_IGN); // peers may vanish mid-broadcast
 
     //Setup server socket
     sockaddr_in server_addr{};
@@ -197,84 +441,81 @@ int main()
         return 1;
     }
 
-    cout << "Server listening on port " << PORT << "...\n";
-
-    for (int i = 1; i < MAX_CONNECTION + 1; i++)
+    // Wakeups for operator input. A pipe rather than an eventfd, so this
+    // variant stays portable.
+    if (pipe(wakePipe) < 0)
     {
-        clientFds[i].fd = -1; // reset
+        perror("pipe");
+        return 1;
     }
+    set_non_blocking(wakePipe[0]);
+    set_non_blocking(wakePipe[1]);
+
+    cout << "Server listening on port " << PORT << "...\n";
 
-    // Accept thread - handles incoming connections and client data
-    thread acceptThread([&]()
+    pollFds.resize(FIRST_CLIENT);
+    pollSlots.resize(FIRST_CLIENT, -1);
+    pollFds[LISTEN_ENTRY].fd = serverSocket;
+    pollFds[LISTEN_ENTRY].events = POLLIN;
+    pollFds[WAKE_ENTRY].fd = wakePipe[0];
+    pollFds[WAKE_ENTRY].events = POLLIN;
+
+    // Blocks in getline; left behind at exit
+    thread(handle_send_data).detach();
+
+    // One thread: connections, client data, queued output and operator lines
+    while (!stop.load())
     {
-        while (!stop.load())
+        int ready = poll(pollFds.data(), pollFds.size(), 1000);
+        if (ready < 0)
         {
-            clientFds[0].fd = serverSocket;
-            clientFds[0].events = POLLIN;
-
-            int ready = poll(clientFds, 1 + MAX_CONNECTION, 1000);
-            if (ready < 0)
-            {
-                if (errno == EINTR)
-                    continue;
-                perror("poll");
-                break;
-            }
-            
-            // Check for new connections
-            if (clientFds[0].revents & POLLIN)
-            {
-                handleNewConnection(serverSocket);
-            }
-            
-            // Check all client sockets for incoming data
-            for (int i = 1; i <= MAX_CONNECTION; i++)
-            {
-                if (clientFds[i].fd != -1 && (clientFds[i].revents & POLLIN))
-                {
-                    handleClientData(i);
-                }
-            }
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
         }
-    });
-
-    // Server input → broadcast
-    thread sendThread([&]()
-                      {
-        char buffer[BUF_SIZE];
-
-        while (!stop.load()) {
-            struct pollfd fds;
-            fds.fd = STDIN_FILENO;
-            fds.events = POLLIN;
-            int ready = poll(&fds, 1, 200); // 200ms timeout
-            if (ready < 0) {
-                if (errno == EINTR)
-                    continue;
-                perror("poll");
-                break;
-            }
-            
-            if(fds.revents & POLLIN) {
-                cin.getline(buffer, BUF_SIZE);
-                if(strlen(buffer) == 0)
-                    continue;
-                lock_guard<mutex> lock(mtx);
-                for (int fd : clientSockets) {
-                    send(fd, buffer, strlen(buffer), 0);
-                }
-            }
-        } });
 
-    acceptThread.join();
-    sendThread.join();
+        // New entries are appended with no revents, so the scan below
+        // skips them until the next poll()
+        if (pollFds[LISTEN_ENTRY].revents & POLLIN)
+            handleNewConnection(serverSocket);
 
-    // Notify clients about shutdown
-    lock_guard<mutex> lock(mtx);
-    for (int fd : clientSockets)
+        if (pollFds[WAKE_ENTRY].revents & POLLIN)
+            drainAnnouncements();
+
+        // Check all client sockets. A client that leaves has the last entry
+        // (with its revents) moved into its place, so that entry is looked
+        // at next without advancing.
+        for (size_t i = FIRST_CLIENT; i < pollFds.size(); )
+        {
+            short revents = pollFds[i].revents;
+            pollFds[i].revents = 0;
+            int slot = pollSlots[i];
+
+            // Socket drained enough to take more queued output
+            if (revents & POLLOUT)
+                flushClient(clients[slot]);
+            // Client data, hangup or error
+            if (revents & (POLLIN | POLLRDHUP | POLLHUP | POLLERR))
+                handleClientData(slot);
+
+            if (i < pollFds.size() && pollSlots[i] == slot)
+                i++;
+        }
+    }
+
+    // Notify clients about shutdown (best effort, after what is queued)
+    string bye;
+    for (size_t i = FIRST_CLIENT; i < pollFds.size(); i++)
     {
-        send(fd, "#", 1, 0);
-        close(fd);
+        Client &c = clients[pollSlots[i]];
+        if (c.encoding != FrameMode::Detect)
+        {
+            bye.clear();
+            appendFrame(bye, c.encoding, "#", 1);
+            enqueue(c, make_shared<const string>(bye));
+        }
+        close(c.fd);
     }
     close(serverSocket);
     cout << "Server shutdown complete.\n";
@@ -0,0 +1,205 @@
+#pragma once
+
+// Chat wire framing, shared by every server variant.
+//
+// Two encodings are accepted on the same port:
+//
+//   text   - one message per line, terminated by '\n' ("\r\n" is accepted).
+//            This is what the existing clients speak.
+//   binary - a 4-byte big-endian payload length followed by the payload.
+//
+// The encoding is detected from the first byte a client sends: a binary
+// frame always starts with 0x00 (MAX_FRAME is below 16 MiB), which never
+// starts a text line. Replies use the same encoding the client chose.
+//
+// FrameParser is incremental: bytes are received straight into its buffer,
+// any number of complete frames can be pulled out of one read, and frames
+// larger than a single read are reassembled across reads. It can also parse
+// bytes it does not own (borrow()), for callers that receive into a shared
+// buffer and keep only the unfinished tail themselves.
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+constexpr size_t MAX_FRAME = 64 * 1024; // largest accepted payload
+constexpr size_t FRAME_HEADER_SIZE = 4;
+
+enum class FrameMode : uint8_t
+{
+    Detect, // no byte seen yet
+    Text,
+    Binary
+};
+
+inline void encodeFrameHeader(uint32_t length, char out[FRAME_HEADER_SIZE])
+{
+    out[0] = (char)(length >> 24);
+    out[1] = (char)(length >> 16);
+    out[2] = (char)(length >> 8);
+    out[3] = (char)length;
+}
+
+// Append one message in the given encoding
+inline void appendFrame(std::string &out, FrameMode mode, const char *payload, size_t length)
+{
+    if (mode == FrameMode::Binary)
+    {
+        char header[FRAME_HEADER_SIZE];
+        encodeFrameHeader((uint32_t)length, header);
+        out.append(header, FRAME_HEADER_SIZE);
+        out.append(payload, length);
+    }
+    else
+    {
+        out.append(payload, length);
+        out.push_back('\n');
+    }
+}
+
+class FrameParser
+{
+public:
+    enum Result
+    {
+        Frame,    // `frame`/`length` point at one complete payload
+        NeedMore, // no complete frame buffered
+        Error     // protocol violation (oversized frame), drop the client
+    };
+
+    explicit FrameParser(FrameMode mode = FrameMode::Detect) : mode(mode) {}
+
+    FrameMode encoding() const { return mode; }
+
+    // Writable space for at least `want` bytes; receive into it, then commit()
+    char *prepare(size_t want)
+    {
+        if (rpos == wpos)
+        {
+            rpos = wpos = scanned = 0;
+        }
+        else if (rpos > 0 && buffer.size() - wpos < want)
+        {
+            // Slide the unconsumed tail to the front before growing
+            memmove(buffer.data(), buffer.data() + rpos, wpos - rpos);
+            wpos -= rpos;
+            scanned -= rpos;
+            rpos = 0;
+        }
+
+        if (buffer.size() - wpos < want)
+            buffer.resize(wpos + want);
+        return buffer.data() + wpos;
+    }
+
+    void commit(size_t n) { wpos += n; }
+
+    // Parse `n` bytes the caller owns instead of the parser's own buffer,
+    // which must be empty; not to be mixed with prepare()/feed(). `scanned`
+    // is what scannedTail() said for the start of these bytes. Frames point
+    // into `data`, and before it is reused the caller keeps the unconsumed()
+    // bytes, then calls release().
+    void borrow(const char *data, size_t n, size_t scannedTail = 0)
+    {
+        base = data;
+        rpos = 0;
+        wpos = n;
+        scanned = scannedTail;
+    }
+
+    const char *unconsumed() const { return data() + rpos; }
+
+    // Text mode: leading bytes of unconsumed() known to hold no '\n'
+    size_t scannedTail() const { return scanned - rpos; }
+
+    void release()
+    {
+        base = nullptr;
+        rpos = wpos = scanned = 0;
+    }
+
+    // Copy bytes in (for callers that did not receive into prepare())
+    void feed(const char *data, size_t n)
+    {
+        memcpy(prepare(n), data, n);
+        commit(n);
+    }
+
+    // Pull the next complete frame. The pointer stays valid until the next
+    // prepare()/feed() call, or while borrowed bytes are left alone.
+    Result next(const char *&frame, size_t &length)
+    {
+        if (rpos == wpos)
+            return NeedMore;
+
+        if (mode == FrameMode::Detect)
+            mode = (data()[rpos] == 0) ? FrameMode::Binary : FrameMode::Text;
+
+        return mode == FrameMode::Binary ? nextBinary(frame, length)
+                                         : nextText(frame, length);
+    }
+
+    // At EOF: a text client may have sent a last line without '\n' (older
+    // clients send "#" and close). Returns it as a final frame.
+    Result finish(const char *&frame, size_t &length)
+    {
+        if (mode != FrameMode::Text || rpos == wpos)
+            return NeedMore;
+
+        frame = data() + rpos;
+        length = wpos - rpos;
+        scanned = rpos = wpos;
+        return Frame;
+    }
+
+    size_t buffered() const { return wpos - rpos; }
+
+private:
+    const char *data() const { return base ? base : buffer.data(); }
+
+    Result nextText(const char *&frame, size_t &length)
+    {
+        // Resume the newline search where the last call stopped
+        const char *start = data() + scanned;
+        const char *nl = (const char *)memchr(start, '\n', wpos - scanned);
+        if (!nl)
+        {
+            scanned = wpos;
+            return (wpos - rpos > MAX_FRAME) ? Error : NeedMore;
+        }
+
+        frame = data() + rpos;
+        length = nl - frame;
+        rpos = scanned = (nl - data()) + 1;
+        if (length > 0 && frame[length - 1] == '\r')
+            length--;
+        return length > MAX_FRAME ? Error : Frame;
+    }
+
+    Result nextBinary(const char *&frame, size_t &length)
+    {
+        if (wpos - rpos < FRAME_HEADER_SIZE)
+            return NeedMore;
+
+        const unsigned char *h = (const unsigned char *)data() + rpos;
+        size_t payload = ((size_t)h[0] << 24) | ((size_t)h[1] << 16) | ((size_t)h[2] << 8) | h[3];
+        if (payload > MAX_FRAME)
+            return Error;
+        if (wpos - rpos < FRAME_HEADER_SIZE + payload)
+            return NeedMore;
+
+        frame = data() + rpos + FRAME_HEADER_SIZE;
+        length = payload;
+        rpos += FRAME_HEADER_SIZE + payload;
+        scanned = rpos;
+        return Frame;
+    }
+
+    std::vector<char> buffer;
+    const char *base = nullptr; // borrowed bytes, parsed instead of buffer
+    size_t rpos = 0;    // first unconsumed byte
+    size_t wpos = 0;    // end of received data
+    size_t scanned = 0; // text mode: bytes before this hold no '\n'
+    FrameMode mode;
+};
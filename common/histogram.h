@@ -0,0 +1,109 @@
+#pragma once
+
+// Log-linear latency histogram in the style of HdrHistogram.
+//
+// Values are sorted into buckets whose width is 1/16 of their power of two,
+// so any recorded value is reported within ~6% of what it was, over the
+// whole 64-bit range, in a fixed 976-slot array. Recording is a handful of
+// instructions and never allocates.
+//
+// Each histogram has a single writer. Counters are relaxed atomics, so other
+// threads may read (and merge) a histogram while it is being written; they
+// see a slightly stale but consistent-enough snapshot.
+
+#include <atomic>
+#include <cstdint>
+
+class Histogram
+{
+public:
+    static constexpr int SUB_BITS = 4;
+    static constexpr int SUB = 1 << SUB_BITS;
+    static constexpr int BUCKETS = SUB + (64 - SUB_BITS) * SUB;
+
+    Histogram() = default;
+    Histogram(const Histogram &) = delete;
+    Histogram &operator=(const Histogram &) = delete;
+
+    void record(uint64_t value)
+    {
+        bump(counts[bucketOf(value)], 1);
+        bump(total, 1);
+        bump(sumOfValues, value);
+        if (value > maxValue.load(std::memory_order_relaxed))
+            maxValue.store(value, std::memory_order_relaxed);
+    }
+
+    // Add another histogram's counts (may be called while it is written)
+    void merge(const Histogram &other)
+    {
+        for (int i = 0; i < BUCKETS; i++)
+        {
+            uint64_t n = other.counts[i].load(std::memory_order_relaxed);
+            if (n)
+                counts[i].fetch_add(n, std::memory_order_relaxed);
+        }
+        total.fetch_add(other.count(), std::memory_order_relaxed);
+        sumOfValues.fetch_add(other.sum(), std::memory_order_relaxed);
+        uint64_t m = other.max();
+        if (m > maxValue.load(std::memory_order_relaxed))
+            maxValue.store(m, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+    uint64_t sum() const { return sumOfValues.load(std::memory_order_relaxed); }
+    uint64_t max() const { return maxValue.load(std::memory_order_relaxed); }
+    uint64_t bucketCount(int i) const { return counts[i].load(std::memory_order_relaxed); }
+
+    // Smallest bucket bound at or below which a fraction q of the values lie
+    uint64_t percentile(double q) const
+    {
+        uint64_t n = count();
+        if (n == 0)
+            return 0;
+        uint64_t rank = (uint64_t)(q * n);
+        if (rank >= n)
+            rank = n - 1;
+
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; i++)
+        {
+            seen += bucketCount(i);
+            if (seen > rank)
+                return bucketLimit(i) < max() ? bucketLimit(i) : max();
+        }
+        return max();
+    }
+
+    // Largest value that falls into bucket i
+    static uint64_t bucketLimit(int i)
+    {
+        if (i < SUB)
+            return (uint64_t)i;
+        int msb = (i - SUB) / SUB + SUB_BITS;
+        uint64_t sub = (uint64_t)((i - SUB) % SUB);
+        uint64_t low = (1ULL << msb) | (sub << (msb - SUB_BITS));
+        return low + ((1ULL << (msb - SUB_BITS)) - 1);
+    }
+
+    static int bucketOf(uint64_t value)
+    {
+        if (value < (uint64_t)SUB)
+            return (int)value;
+        int msb = 63 - __builtin_clzll(value);
+        int sub = (int)((value >> (msb - SUB_BITS)) & (SUB - 1));
+        return SUB + (msb - SUB_BITS) * SUB + sub;
+    }
+
+private:
+    // Single writer: a plain load/store pair, no locked instruction
+    static void bump(std::atomic<uint64_t> &c, uint64_t by)
+    {
+        c.store(c.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> counts[BUCKETS] = {};
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> sumOfValues{0};
+    std::atomic<uint64_t> maxValue{0};
+};
@@ -0,0 +1,562 @@
+#pragma once
+
+// Append-only, memory-mapped message history (one log per room).
+//
+// A log is a directory of segment files, each named after the sequence
+// number of its first record. A segment is sized up front with ftruncate()
+// and mapped shared; records are appended with a memcpy and a zero length
+// marks the end. When a record does not fit, a new segment is started, and
+// segments beyond `keepSegments` are unlinked (a reader still holding one
+// keeps its mapping until it lets go).
+//
+// Record layout:
+//
+//   [4-byte big-endian length][line][\n]
+//
+// The first 4 + length bytes are the line as a binary frame and the last
+// length + 1 bytes are the line as a text frame, so a record is sent to
+// either kind of client straight from the mapping with one iovec.
+//
+// Appends take the log's mutex. Records are published by bumping the
+// segment's end offset, so readers that stay below it never lock. Every
+// INDEX_INTERVAL-th record's offset is kept in a sparse index, so finding
+// a sequence number scans at most INDEX_INTERVAL records.
+//
+// File system work stays off the appending thread. open() only posts the
+// directory scan to a background thread (HistoryFiles), and the log stays
+// unready(), storing and replaying nothing, until that has run. A spare
+// segment is created and mapped on the same thread once the current one
+// is half full. A full segment is replaced by the spare with a pointer
+// swap. The spare is renamed to its final name, and trimmed segments are
+// unlinked, on that thread too. A record that finds no spare ready is
+// dropped rather than waiting for one.
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "frame.h"
+
+constexpr size_t HISTORY_SEGMENT_BYTES = 8 * 1024 * 1024;
+constexpr size_t HISTORY_KEEP_SEGMENTS = 8;
+constexpr uint64_t HISTORY_INDEX_INTERVAL = 64;
+constexpr char HISTORY_SPARE_NAME[] = "/spare.tmp"; // a prepared segment, not yet in use
+
+// The thread that does the file system work of every log, in order
+class HistoryFiles
+{
+public:
+    static HistoryFiles &get()
+    {
+        // Never destroyed: logs are torn down during static destruction
+        static HistoryFiles *files = new HistoryFiles();
+        return *files;
+    }
+
+    void post(std::function<void()> task)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        tasks.push_back(std::move(task));
+        wake.notify_one();
+    }
+
+    // Wait until everything posted so far has run
+    void drain()
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        idle.wait(lock, [this] { return tasks.empty() && !busy; });
+    }
+
+private:
+    HistoryFiles()
+    {
+        std::thread([this] { run(); }).detach();
+    }
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        for (;;)
+        {
+            wake.wait(lock, [this] { return !tasks.empty(); });
+            std::function<void()> task = std::move(tasks.front());
+            tasks.pop_front();
+            busy = true;
+            lock.unlock();
+            task();
+            lock.lock();
+            busy = false;
+            if (tasks.empty())
+                idle.notify_all();
+        }
+    }
+
+    std::mutex mtx;
+    std::condition_variable wake, idle;
+    std::deque<std::function<void()>> tasks;
+    bool busy = false;
+};
+
+class HistorySegment
+{
+public:
+    uint64_t firstSeq = 0;
+    char *base = nullptr;
+    size_t capacity = 0;
+    std::atomic<size_t> end{0};        // bytes of published records
+    std::atomic<uint64_t> records{0};  // published records
+    std::vector<uint32_t> index;       // offset of record firstSeq + i * INDEX_INTERVAL; under the log mutex
+
+    void retain() { refs.fetch_add(1, std::memory_order_relaxed); }
+
+    void release()
+    {
+        if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            munmap(base, capacity);
+            delete this;
+        }
+    }
+
+    static uint32_t lengthAt(const char *p)
+    {
+        const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+        return ((uint32_t)u[0] << 24) | ((uint32_t)u[1] << 16) | ((uint32_t)u[2] << 8) | u[3];
+    }
+
+private:
+    std::atomic<int> refs{1};
+};
+
+// A position in a log: the next record to send and how much of its wire
+// form has been written already. Holds a reference to its segment.
+struct HistoryCursor
+{
+    HistorySegment *segment = nullptr;
+    size_t offset = 0;   // of the next record in `segment`
+    size_t sent = 0;     // bytes of that record already written
+    uint64_t seq = 0;    // of the next record
+    uint64_t lastSeq = 0; // last record to send
+
+    bool done() const { return segment == nullptr; }
+
+    void reset()
+    {
+        if (segment)
+            segment->release();
+        segment = nullptr;
+    }
+};
+
+class HistoryLog
+{
+public:
+    HistoryLog() = default;
+    HistoryLog(const HistoryLog &) = delete;
+    HistoryLog &operator=(const HistoryLog &) = delete;
+
+    ~HistoryLog()
+    {
+        // Pending renames must land, and no task may still refer to us
+        if (posted)
+            HistoryFiles::get().drain();
+        if (spare)
+            spare->release();
+        for (HistorySegment *s : segments)
+            s->release();
+    }
+
+    // Open (or create) the log in `dir` and pick up any segments already
+    // there. The work runs on the file thread; ready() tells when it is done.
+    void open(const std::string &dir)
+    {
+        path = dir;
+        posted = true;
+        HistoryFiles::get().post([this] { load(); });
+    }
+
+    // The log has been opened and takes appends and replays
+    bool ready() const { return opened.load(std::memory_order_acquire); }
+
+    // Append one line (without its '\n'). Returns its sequence number, or 0
+    // if it could not be stored.
+    uint64_t append(const char *line, size_t length)
+    {
+        size_t bytes = FRAME_HEADER_SIZE + length + 1;
+        if (bytes + FRAME_HEADER_SIZE > HISTORY_SEGMENT_BYTES || !ready())
+            return 0;
+
+        std::lock_guard<std::mutex> lock(mtx);
+        HistorySegment *s = segments.empty() ? nullptr : segments.back();
+        // Keep room for the zero length that ends the segment
+        if (!s || s->end.load(std::memory_order_relaxed) + bytes + FRAME_HEADER_SIZE > s->capacity)
+        {
+            // Never a file system call here: without a spare the record is
+            // lost, and another spare is asked for
+            if (!spare)
+            {
+                spareFailed = false;
+                prepareSpare();
+                return 0;
+            }
+            s = useSpare(nextSeq());
+            trim();
+        }
+        else if (s->end.load(std::memory_order_relaxed) > s->capacity / 2)
+        {
+            prepareSpare();
+        }
+
+        size_t offset = s->end.load(std::memory_order_relaxed);
+        uint64_t count = s->records.load(std::memory_order_relaxed);
+        char *p = s->base + offset;
+        encodeFrameHeader((uint32_t)length, p);
+        memcpy(p + FRAME_HEADER_SIZE, line, length);
+        p[FRAME_HEADER_SIZE + length] = '\n';
+        if (count % HISTORY_INDEX_INTERVAL == 0)
+            s->index.push_back((uint32_t)offset);
+
+        s->records.store(count + 1, std::memory_order_release);
+        s->end.store(offset + bytes, std::memory_order_release);
+        return s->firstSeq + count;
+    }
+
+    // Sequence number of the newest record, 0 if there is none
+    uint64_t lastSeq()
+    {
+        if (!ready())
+            return 0;
+        std::lock_guard<std::mutex> lock(mtx);
+        return nextSeq() - 1;
+    }
+
+    // Point `c` at the first retained record after `afterSeq`, to send
+    // everything up to the newest record. Returns false if there is nothing.
+    bool seek(uint64_t afterSeq, HistoryCursor &c)
+    {
+        c.reset();
+        if (!ready())
+            return false;
+        std::lock_guard<std::mutex> lock(mtx);
+        uint64_t last = nextSeq() - 1;
+        if (segments.empty() || afterSeq >= last)
+            return false;
+
+        uint64_t seq = std::max(afterSeq + 1, segments.front()->firstSeq);
+        // Newest segment that starts at or before seq
+        size_t i = segments.size() - 1;
+        while (i > 0 && segments[i]->firstSeq > seq)
+            i--;
+        HistorySegment *s = segments[i];
+
+        // seq may fall in a gap after this segment's records (a crash cut
+        // it short): start from the next segment that has any
+        while (seq - s->firstSeq >= s->records.load(std::memory_order_relaxed))
+        {
+            if (++i == segments.size())
+                return false;
+            s = segments[i];
+            seq = s->firstSeq;
+        }
+
+        // Jump to the nearest indexed record, then walk
+        uint64_t rel = seq - s->firstSeq;
+        size_t offset = s->index[rel / HISTORY_INDEX_INTERVAL];
+        for (uint64_t k = rel - rel % HISTORY_INDEX_INTERVAL; k < rel; k++)
+            offset += FRAME_HEADER_SIZE + HistorySegment::lengthAt(s->base + offset) + 1;
+
+        s->retain();
+        c.segment = s;
+        c.offset = offset;
+        c.sent = 0;
+        c.seq = seq;
+        c.lastSeq = last;
+        // Ask for the pages now, so sending them later does not fault
+        size_t page = offset & ~(size_t)4095;
+        madvise(s->base + page, s->end.load(std::memory_order_acquire) - page, MADV_WILLNEED);
+        return true;
+    }
+
+    // Describe the next records at the cursor as iovecs in the client's
+    // encoding, skipping what has been sent already. Returns the count.
+    int gather(const HistoryCursor &c, FrameMode mode, iovec *iov, int max) const
+    {
+        int n = 0;
+        size_t offset = c.offset, skip = c.sent;
+        uint64_t seq = c.seq;
+        size_t end = c.segment->end.load(std::memory_order_acquire);
+        while (n < max && seq <= c.lastSeq && offset < end)
+        {
+            const char *rec = c.segment->base + offset;
+            uint32_t length = HistorySegment::lengthAt(rec);
+            if (mode == FrameMode::Binary)
+                iov[n].iov_base = const_cast<char *>(rec) + skip;
+            else
+                iov[n].iov_base = const_cast<char *>(rec) + FRAME_HEADER_SIZE + skip;
+            iov[n].iov_len = length + (mode == FrameMode::Binary ? FRAME_HEADER_SIZE : 1) - skip;
+            n++;
+            skip = 0;
+            offset += FRAME_HEADER_SIZE + length + 1;
+            seq++;
+        }
+        return n;
+    }
+
+    // Move the cursor past `bytes` written bytes. It moves on to the next
+    // segment at the end of one, and becomes done() after lastSeq.
+    void advance(HistoryCursor &c, FrameMode mode, size_t bytes)
+    {
+        size_t header = (mode == FrameMode::Binary) ? FRAME_HEADER_SIZE : 1;
+        while (!c.done())
+        {
+            if (c.seq > c.lastSeq)
+            {
+                c.reset();
+                return;
+            }
+            if (c.offset >= c.segment->end.load(std::memory_order_acquire))
+            {
+                if (!nextSegment(c))
+                    return;
+                continue;
+            }
+
+            uint32_t length = HistorySegment::lengthAt(c.segment->base + c.offset);
+            size_t wire = length + header;
+            if (bytes < wire - c.sent)
+            {
+                c.sent += bytes;
+                return;
+            }
+            bytes -= wire - c.sent;
+            c.sent = 0;
+            c.offset += FRAME_HEADER_SIZE + length + 1;
+            c.seq++;
+        }
+    }
+
+    const std::string &directory() const { return path; }
+
+private:
+    uint64_t nextSeq() const
+    {
+        if (segments.empty())
+            return loadedNext;
+        HistorySegment *s = segments.back();
+        return s->firstSeq + s->records.load(std::memory_order_relaxed);
+    }
+
+    std::string segmentPath(uint64_t firstSeq) const
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "/%020llu.seg", (unsigned long long)firstSeq);
+        return path + name;
+    }
+
+    HistorySegment *map(const std::string &file, uint64_t firstSeq, bool create)
+    {
+        int fd = ::open(file.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0644);
+        if (fd < 0)
+        {
+            perror(("open " + file).c_str());
+            return nullptr;
+        }
+
+        size_t size = HISTORY_SEGMENT_BYTES;
+        struct stat st;
+        if (create ? ftruncate(fd, size) < 0 : fstat(fd, &st) < 0)
+        {
+            perror(("size " + file).c_str());
+            close(fd);
+            return nullptr;
+        }
+        if (!create)
+            size = (size_t)st.st_size;
+
+        void *base = size ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (base == MAP_FAILED)
+        {
+            perror(("mmap " + file).c_str());
+            return nullptr;
+        }
+
+        HistorySegment *s = new HistorySegment();
+        s->firstSeq = firstSeq;
+        s->base = static_cast<char *>(base);
+        s->capacity = size;
+        return s;
+    }
+
+    // Have the file thread create and map the next segment under the spare
+    // name, unless one is ready or on its way. Under the mutex.
+    void prepareSpare()
+    {
+        if (spare || spareRequested || spareFailed)
+            return;
+        spareRequested = true;
+        posted = true;
+        HistoryFiles::get().post([this] {
+            std::string file = path + HISTORY_SPARE_NAME;
+            unlink(file.c_str());
+            HistorySegment *s = map(file, 0, true);
+            std::lock_guard<std::mutex> lock(mtx);
+            spare = s;
+            spareRequested = false;
+            spareFailed = !s; // not retried before a record needs it
+        });
+    }
+
+    // Put the spare in use as the segment starting at firstSeq; the file
+    // thread gives it its real name. Under the mutex.
+    HistorySegment *useSpare(uint64_t firstSeq)
+    {
+        HistorySegment *s = spare;
+        spare = nullptr;
+        s->firstSeq = firstSeq;
+        segments.push_back(s);
+        std::string from = path + HISTORY_SPARE_NAME, to = segmentPath(firstSeq);
+        HistoryFiles::get().post([from, to] {
+            if (rename(from.c_str(), to.c_str()) < 0)
+                perror(("rename " + from).c_str());
+        });
+        posted = true;
+        return s;
+    }
+
+    // On the file thread: scan the directory, map the segments found and
+    // start the first one if there is none. Until `opened` is set nobody
+    // else touches the log's state, so this runs without the mutex.
+    void load()
+    {
+        if (mkdir(path.c_str(), 0755) < 0 && errno != EEXIST)
+        {
+            perror(("mkdir " + path).c_str());
+            return; // never ready
+        }
+
+        std::vector<std::string> names;
+        if (DIR *d = opendir(path.c_str()))
+        {
+            while (dirent *e = readdir(d))
+            {
+                std::string name = e->d_name;
+                if (name.size() > 4 && name.compare(name.size() - 4, 4, ".seg") == 0)
+                    names.push_back(name);
+            }
+            closedir(d);
+        }
+        // Zero-padded names sort by first sequence number
+        std::sort(names.begin(), names.end());
+        for (const std::string &name : names)
+            loadSegment(name);
+        trim();
+
+        // A spare left over from the previous run was never used
+        unlink((path + HISTORY_SPARE_NAME).c_str());
+        if (segments.empty())
+        {
+            HistorySegment *s = map(segmentPath(loadedNext), loadedNext, true);
+            if (!s)
+                return;
+            segments.push_back(s);
+        }
+
+        std::lock_guard<std::mutex> lock(mtx);
+        opened.store(true, std::memory_order_release);
+        prepareSpare();
+    }
+
+    // Map an existing segment and rebuild its index from the records in it
+    void loadSegment(const std::string &name)
+    {
+        uint64_t firstSeq = strtoull(name.c_str(), nullptr, 10);
+        if (firstSeq == 0 || firstSeq < loadedNext)
+            return;
+        HistorySegment *s = map(path + "/" + name, firstSeq, false);
+        if (!s)
+            return;
+
+        size_t offset = 0;
+        uint64_t count = 0;
+        while (offset + FRAME_HEADER_SIZE <= s->capacity)
+        {
+            uint32_t length = HistorySegment::lengthAt(s->base + offset);
+            size_t bytes = FRAME_HEADER_SIZE + length + 1;
+            if (length == 0 || offset + bytes > s->capacity || s->base[offset + bytes - 1] != '\n')
+                break;
+            if (count % HISTORY_INDEX_INTERVAL == 0)
+                s->index.push_back((uint32_t)offset);
+            offset += bytes;
+            count++;
+        }
+        s->end.store(offset);
+        s->records.store(count);
+        segments.push_back(s);
+        loadedNext = firstSeq + count;
+    }
+
+    // Drop the oldest segments beyond the retention limit
+    void trim()
+    {
+        while (segments.size() > HISTORY_KEEP_SEGMENTS)
+        {
+            HistorySegment *s = segments.front();
+            segments.pop_front();
+            // After any pending rename of the same file
+            std::string file = segmentPath(s->firstSeq);
+            HistoryFiles::get().post([file] { unlink(file.c_str()); });
+            posted = true;
+            s->release();
+        }
+    }
+
+    // Move the cursor to the segment holding its next record, or past a
+    // gap to the first one after it
+    bool nextSegment(HistoryCursor &c)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        uint64_t want = c.seq;
+        c.reset();
+        for (HistorySegment *s : segments)
+        {
+            if (s->firstSeq >= want && s->records.load(std::memory_order_relaxed) > 0)
+            {
+                s->retain();
+                c.segment = s;
+                c.offset = 0;
+                c.sent = 0;
+                c.seq = s->firstSeq;
+                return true;
+            }
+        }
+        return false; // the rest was trimmed away
+    }
+
+    std::string path;
+    std::mutex mtx;
+    std::deque<HistorySegment *> segments; // oldest first
+    uint64_t loadedNext = 1;               // next sequence number when no segment is open
+    HistorySegment *spare = nullptr;       // mapped, under HISTORY_SPARE_NAME
+    bool spareRequested = false;           // the file thread is preparing one
+    bool spareFailed = false;
+    bool posted = false;                   // tasks were handed to the file thread
+    std::atomic<bool> opened{false};       // load() has run and succeeded
+};
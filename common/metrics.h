@@ -0,0 +1,99 @@
+#pragma once
+
+// Server metrics: single-writer counters and Prometheus text exposition.
+//
+// Every counter and histogram is written by the one thread that owns it
+// (a reactor) and may be read by any other thread at any time, so the hot
+// path pays a plain load/store and never takes a lock.
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include "histogram.h"
+
+// Monotonic counter or gauge owned by one thread, readable from all
+class Counter
+{
+public:
+    Counter &operator+=(uint64_t n)
+    {
+        v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        return *this;
+    }
+    Counter &operator-=(uint64_t n)
+    {
+        v.store(v.load(std::memory_order_relaxed) - n, std::memory_order_relaxed);
+        return *this;
+    }
+    Counter &operator++() { return *this += 1; }
+    void raiseTo(uint64_t n)
+    {
+        if (n > get())
+            v.store(n, std::memory_order_relaxed);
+    }
+    uint64_t get() const { return v.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> v{0};
+};
+
+// "# HELP" and "# TYPE" lines that start a metric family
+inline void writeMetricHeader(std::string &out, const char *name, const char *type, const char *help)
+{
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+// One sample; `labels` is the inside of the braces, e.g. reactor="0"
+inline void writeSample(std::string &out, const std::string &name, const std::string &labels, double value)
+{
+    char number[32];
+    snprintf(number, sizeof(number), "%.15g", value);
+    out += name;
+    if (!labels.empty())
+    {
+        out += '{';
+        out += labels;
+        out += '}';
+    }
+    out += ' ';
+    out += number;
+    out += '\n';
+}
+
+// A Histogram as Prometheus buckets at the powers of two 2^minShift ..
+// 2^maxShift (in recorded units), each multiplied by `unit` for output
+// (1e-9 turns nanoseconds into seconds).
+inline void writeHistogram(std::string &out, const std::string &name, const std::string &labels,
+                           const Histogram &h, double unit, int minShift, int maxShift)
+{
+    std::string sep = labels.empty() ? "" : ",";
+    uint64_t cumulative = 0;
+    int next = 0;
+    for (int shift = minShift; shift <= maxShift; shift++)
+    {
+        // Every bucket below the first one at 2^shift holds values < 2^shift
+        int end = Histogram::bucketOf(1ULL << shift);
+        for (; next < end; next++)
+            cumulative += h.bucketCount(next);
+
+        char le[32];
+        snprintf(le, sizeof(le), "%.6g", (double)(1ULL << shift) * unit);
+        writeSample(out, name + "_bucket", labels + sep + "le=\"" + le + "\"", (double)cumulative);
+    }
+    for (; next < Histogram::BUCKETS; next++)
+        cumulative += h.bucketCount(next);
+
+    writeSample(out, name + "_bucket", labels + sep + "le=\"+Inf\"", (double)cumulative);
+    writeSample(out, name + "_sum", labels, (double)h.sum() * unit);
+    writeSample(out, name + "_count", labels, (double)cumulative);
+}
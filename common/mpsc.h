@@ -0,0 +1,58 @@
+#pragma once
+
+// Lock-free multi-producer, single-consumer queue of intrusive nodes.
+//
+// Any thread may push(); one consumer thread takes everything queued so far
+// with popAll(), oldest first. Producers only CAS the head and the consumer
+// only swaps it out whole, so there is no ABA problem and nobody ever
+// blocks. push() reports whether the queue was empty: only that producer
+// needs to wake the consumer (eventfd or pipe), later ones ride along.
+//
+// Nodes are linked through their own `next` member; the queue never
+// allocates. Where they come from is up to the caller.
+
+#include <atomic>
+
+template <typename Node>
+class MpscQueue
+{
+public:
+    MpscQueue() = default;
+    MpscQueue(const MpscQueue &) = delete;
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    // Any thread. Returns true if the queue was empty, i.e. the consumer
+    // may be asleep and must be woken.
+    bool push(Node *n)
+    {
+        Node *head = top.load(std::memory_order_relaxed);
+        do
+            n->next = head;
+        while (!top.compare_exchange_weak(head, n, std::memory_order_release,
+                                          std::memory_order_relaxed));
+        return head == nullptr;
+    }
+
+    // Consumer only. Takes every queued node and returns the oldest, linked
+    // through `next` to the newer ones; nullptr if there was none.
+    Node *popAll()
+    {
+        Node *n = top.exchange(nullptr, std::memory_order_acquire);
+
+        // Pushed newest first; reverse into arrival order
+        Node *oldest = nullptr;
+        while (n)
+        {
+            Node *next = n->next;
+            n->next = oldest;
+            oldest = n;
+            n = next;
+        }
+        return oldest;
+    }
+
+    bool empty() const { return top.load(std::memory_order_relaxed) == nullptr; }
+
+private:
+    std::atomic<Node *> top{nullptr};
+};
@@ -0,0 +1,180 @@
+#pragma once
+
+// Slab allocators for per-reactor objects.
+//
+// SlabPool hands out fixed-size blocks carved from large slabs (2 MiB, one
+// huge page when hugepage backing is on). Freed blocks go onto a free list
+// and are reused before any new memory is carved, so once a pool has
+// reached its working size it never calls into malloc or the kernel.
+//
+// A pool belongs to one thread (a reactor). Other threads may free blocks
+// into it with freeRemote(): those land on a lock-free stack that the owner
+// takes over in one exchange the next time its own free list runs dry.
+//
+// SizeClassPool groups power-of-two SlabPools (64 B .. 128 KiB) for
+// variable-size blocks such as message buffers.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+#include <sys/mman.h>
+
+#include "metrics.h"
+
+constexpr size_t SLAB_BYTES = 2 * 1024 * 1024;
+
+class SlabPool
+{
+public:
+    SlabPool() = default;
+    SlabPool(const SlabPool &) = delete;
+    SlabPool &operator=(const SlabPool &) = delete;
+
+    ~SlabPool()
+    {
+        for (void *slab : slabs)
+            munmap(slab, SLAB_BYTES);
+    }
+
+    // Must be called once before the first allocate()
+    void init(size_t size, bool hugePages)
+    {
+        blockSize = (size + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+        if (blockSize < sizeof(FreeBlock))
+            blockSize = sizeof(FreeBlock);
+        huge = hugePages;
+    }
+
+    size_t size() const { return blockSize; }
+
+    // Owner thread only. Returns nullptr if no memory could be mapped.
+    void *allocate()
+    {
+        if (!freeList)
+            freeList = remoteFrees.exchange(nullptr, std::memory_order_acquire);
+
+        if (freeList)
+        {
+            FreeBlock *b = freeList;
+            freeList = b->next;
+            ++hits;
+            return b;
+        }
+
+        if (carveNext == carveEnd && !addSlab())
+            return nullptr;
+        void *p = carveNext;
+        carveNext += blockSize;
+        ++misses;
+        return p;
+    }
+
+    // Owner thread only
+    void free(void *p)
+    {
+        FreeBlock *b = static_cast<FreeBlock *>(p);
+        b->next = freeList;
+        freeList = b;
+        ++frees;
+    }
+
+    // Any thread. The block is reused once the owner runs out of local ones.
+    void freeRemote(void *p)
+    {
+        remoteFreeCount.fetch_add(1, std::memory_order_relaxed);
+        FreeBlock *b = static_cast<FreeBlock *>(p);
+        b->next = remoteFrees.load(std::memory_order_relaxed);
+        while (!remoteFrees.compare_exchange_weak(b->next, b, std::memory_order_release,
+                                                  std::memory_order_relaxed))
+            ;
+    }
+
+    uint64_t inUse() const
+    {
+        return hits.get() + misses.get() - frees.get() -
+               remoteFreeCount.load(std::memory_order_relaxed);
+    }
+
+    Counter hits;       // served from a free list
+    Counter misses;     // carved from fresh slab memory
+    Counter frees;      // returned by the owner
+    Counter slabCount;
+    Counter hugeSlabs;  // slabs actually backed by a huge page
+
+private:
+    struct FreeBlock
+    {
+        FreeBlock *next;
+    };
+
+    bool addSlab()
+    {
+        void *slab = MAP_FAILED;
+        if (huge)
+        {
+            slab = mmap(nullptr, SLAB_BYTES, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (slab != MAP_FAILED)
+                ++hugeSlabs;
+        }
+        if (slab == MAP_FAILED)
+        {
+            // No reserved huge pages: fall back to normal pages, and let
+            // transparent hugepages back them when huge pages were asked for
+            slab = mmap(nullptr, SLAB_BYTES, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (slab == MAP_FAILED)
+                return false;
+            if (huge)
+                madvise(slab, SLAB_BYTES, MADV_HUGEPAGE);
+        }
+
+        slabs.push_back(slab);
+        ++slabCount;
+        carveNext = static_cast<char *>(slab);
+        carveEnd = carveNext + (SLAB_BYTES / blockSize) * blockSize;
+        return true;
+    }
+
+    size_t blockSize = 0;
+    bool huge = false;
+    FreeBlock *freeList = nullptr;
+    std::atomic<FreeBlock *> remoteFrees{nullptr};
+    std::atomic<uint64_t> remoteFreeCount{0};
+    char *carveNext = nullptr;
+    char *carveEnd = nullptr;
+    std::vector<void *> slabs;
+};
+
+class SizeClassPool
+{
+public:
+    static constexpr int MIN_SHIFT = 6;  // 64 B
+    static constexpr int MAX_SHIFT = 17; // 128 KiB
+    static constexpr int CLASSES = MAX_SHIFT - MIN_SHIFT + 1;
+
+    void init(bool hugePages)
+    {
+        for (int c = 0; c < CLASSES; c++)
+            classes[c].init((size_t)1 << (c + MIN_SHIFT), hugePages);
+    }
+
+    // Size class for `bytes`, or -1 if it is too large to pool
+    static int classOf(size_t bytes)
+    {
+        for (int c = 0; c < CLASSES; c++)
+        {
+            if (bytes <= ((size_t)1 << (c + MIN_SHIFT)))
+                return c;
+        }
+        return -1;
+    }
+
+    SlabPool &operator[](int c) { return classes[c]; }
+    const SlabPool &operator[](int c) const { return classes[c]; }
+
+private:
+    SlabPool classes[CLASSES];
+};
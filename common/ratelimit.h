@@ -0,0 +1,57 @@
+#pragma once
+
+// Token buckets for rate limiting.
+//
+// A RateLimit is the configuration (tokens per second and how many may be
+// saved up); a TokenBucket is the state, 16 bytes that live wherever the
+// limited thing lives (a connection, a room). One bucket counts messages
+// and another bytes, both with the same code.
+//
+// The balance may go negative: a message is let through as long as the
+// bucket is not empty, and whatever it costs beyond that is debt that has
+// to be repaid before the next one. So a single large message is never
+// stuck, and the long-run rate still holds.
+//
+// Not thread-safe; a bucket belongs to the thread that owns its holder.
+
+#include <cstdint>
+
+struct RateLimit
+{
+    double rate = 0;  // tokens per second, 0 = unlimited
+    double burst = 0; // most tokens that can be saved up
+
+    bool enabled() const { return rate > 0; }
+};
+
+class TokenBucket
+{
+public:
+    // Refill for the time since the last call and say whether anything is
+    // left to spend. A new bucket starts full.
+    bool ready(const RateLimit &limit, uint64_t nowNs)
+    {
+        if (last == 0)
+            tokens = limit.burst;
+        else if (nowNs > last)
+        {
+            tokens += (double)(nowNs - last) * limit.rate / 1e9;
+            if (tokens > limit.burst)
+                tokens = limit.burst;
+        }
+        last = nowNs;
+        return tokens > 0;
+    }
+
+    void spend(double n) { tokens -= n; }
+
+    // How long until ready() turns true again, from the last refill
+    uint64_t waitNs(const RateLimit &limit) const
+    {
+        return tokens > 0 ? 0 : (uint64_t)(-tokens * 1e9 / limit.rate) + 1;
+    }
+
+private:
+    double tokens = 0;
+    uint64_t last = 0;
+};
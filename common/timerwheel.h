@@ -0,0 +1,235 @@
+#pragma once
+
+// Hierarchical timing wheel for one reactor.
+//
+// Time is counted in ticks (1 ms by default). Level 0 has 64 slots of one
+// tick, level 1 64 slots of 64 ticks, and so on up to LEVELS levels
+// (64^4 ticks, about 4.6 hours at 1 ms; later deadlines wait in the top
+// level and are re-filed as they come closer). A timer is filed by the
+// bits of its expiry tick, so arm() and cancel() are O(1) list operations
+// whatever the number of armed timers. When time reaches a level's slot
+// boundary, that slot is cascaded: its timers are re-filed one level down.
+//
+// Each level keeps a bitmap of its non-empty slots. nextDeadline() and
+// advance() find the next slot with work using a rotate and a count of
+// trailing zeros per level, so an idle wheel costs nothing per tick and
+// advance() jumps straight over empty stretches. For a higher level the
+// answer is the time of the next cascade, which may be earlier than any
+// timer actually due; waking up for it is harmless.
+//
+// Timers are intrusive: a TimerNode lives inside its owner and the wheel
+// never allocates. `owner` and `kind` are for the caller; advance() hands
+// every expired node to a callback, which may arm or cancel any timer,
+// including ones that expire in the same call.
+//
+// Not thread-safe: a wheel belongs to the thread that drives it.
+
+#include <cstdint>
+#include <cstddef>
+
+struct TimerNode
+{
+    TimerNode() = default;
+    TimerNode(const TimerNode &) = delete;
+    TimerNode &operator=(const TimerNode &) = delete;
+
+    uint64_t owner = 0; // caller's data, e.g. a connection handle
+    uint32_t kind = 0;  // caller's data, e.g. what the timer is for
+
+    bool armed() const { return next != nullptr; }
+
+private:
+    friend class TimerWheel;
+    TimerNode *prev = nullptr;
+    TimerNode *next = nullptr;
+    uint64_t expires = 0; // tick
+    uint8_t level = 0;
+    uint8_t slot = 0;
+};
+
+class TimerWheel
+{
+public:
+    static constexpr int LEVELS = 4;
+    static constexpr int SLOT_BITS = 6;
+    static constexpr int SLOTS = 1 << SLOT_BITS;
+
+    explicit TimerWheel(uint64_t tickNs = 1000000) : tickNs(tickNs)
+    {
+        for (int l = 0; l < LEVELS; l++)
+            for (int s = 0; s < SLOTS; s++)
+                wheel[l][s].prev = wheel[l][s].next = &wheel[l][s];
+        pending.prev = pending.next = &pending;
+    }
+
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    // Set the wheel's clock, before any timer is armed
+    void start(uint64_t nowNs) { now = nowNs / tickNs; }
+
+    // (Re)arm t to expire at deadlineNs, rounded up to the next tick. A
+    // deadline that has passed fires on the next advance().
+    void arm(TimerNode &t, uint64_t deadlineNs)
+    {
+        if (t.armed())
+            unlink(t);
+        else
+            count++;
+        uint64_t tick = (deadlineNs + tickNs - 1) / tickNs;
+        t.expires = tick > now ? tick : now + 1;
+        file(t);
+    }
+
+    void cancel(TimerNode &t)
+    {
+        if (!t.armed())
+            return;
+        unlink(t);
+        count--;
+    }
+
+    size_t size() const { return count; }
+
+    // When the next timer may be due, in ns; UINT64_MAX if none is armed
+    uint64_t nextDeadline() const
+    {
+        uint64_t tick = nextTick();
+        return tick == UINT64_MAX ? UINT64_MAX : tick * tickNs;
+    }
+
+    // Bring the clock to nowNs and call expire(TimerNode &) for every timer
+    // due by then, oldest tick first. The node is disarmed before the call.
+    template <typename F>
+    void advance(uint64_t nowNs, F &&expire)
+    {
+        uint64_t target = nowNs / tickNs;
+        for (;;)
+        {
+            uint64_t tick = nextTick();
+            if (tick > target)
+                break;
+            now = tick;
+
+            // Re-file the slots whose boundary this tick is, top level first
+            int top = 0;
+            while (top + 1 < LEVELS && (now & ((1ULL << (SLOT_BITS * (top + 1))) - 1)) == 0)
+                top++;
+            for (int l = top; l >= 1; l--)
+            {
+                TimerNode *t;
+                takeSlot(l, (now >> (SLOT_BITS * l)) & (SLOTS - 1));
+                while ((t = popPending()) != nullptr)
+                    file(*t);
+            }
+
+            // Callbacks may cancel nodes still on the pending list; those
+            // are unlinked from it like from any slot
+            takeSlot(0, now & (SLOTS - 1));
+            TimerNode *t;
+            while ((t = popPending()) != nullptr)
+            {
+                t->prev = t->next = nullptr;
+                count--;
+                expire(*t);
+            }
+        }
+        if (target > now)
+            now = target;
+    }
+
+private:
+    static constexpr uint8_t PENDING = 0xFF; // level of a node taken off its slot
+
+    // Put an armed node (expires set) into the slot its expiry tick selects
+    void file(TimerNode &t)
+    {
+        uint64_t delta = t.expires - now;
+        int level = 0;
+        while (level + 1 < LEVELS && delta >= (1ULL << (SLOT_BITS * (level + 1))))
+            level++;
+
+        uint64_t slot;
+        if (level == LEVELS - 1 && delta >= (1ULL << (SLOT_BITS * LEVELS)))
+            slot = (now >> (SLOT_BITS * level)) + SLOTS - 1; // too far out: the last slot of the top level
+        else
+            slot = t.expires >> (SLOT_BITS * level);
+        slot &= SLOTS - 1;
+
+        TimerNode &head = wheel[level][slot];
+        t.level = (uint8_t)level;
+        t.slot = (uint8_t)slot;
+        t.prev = head.prev;
+        t.next = &head;
+        head.prev->next = &t;
+        head.prev = &t;
+        occupied[level] |= 1ULL << slot;
+    }
+
+    void unlink(TimerNode &t)
+    {
+        t.prev->next = t.next;
+        t.next->prev = t.prev;
+        if (t.level != PENDING)
+        {
+            TimerNode &head = wheel[t.level][t.slot];
+            if (head.next == &head)
+                occupied[t.level] &= ~(1ULL << t.slot);
+        }
+        t.prev = t.next = nullptr;
+    }
+
+    // Move a whole slot onto the pending list
+    void takeSlot(int level, uint64_t slot)
+    {
+        TimerNode &head = wheel[level][slot];
+        occupied[level] &= ~(1ULL << slot);
+        if (head.next == &head)
+            return;
+        for (TimerNode *t = head.next; t != &head; t = t->next)
+            t->level = PENDING;
+        pending.next = head.next;
+        pending.prev = head.prev;
+        pending.next->prev = &pending;
+        pending.prev->next = &pending;
+        head.prev = head.next = &head;
+    }
+
+    TimerNode *popPending()
+    {
+        TimerNode *t = pending.next;
+        if (t == &pending)
+            return nullptr;
+        pending.next = t->next;
+        t->next->prev = &pending;
+        return t;
+    }
+
+    // The first tick after `now` at which a slot has work: its expiry on
+    // level 0, its cascade on the levels above
+    uint64_t nextTick() const
+    {
+        uint64_t best = UINT64_MAX;
+        for (int l = 0; l < LEVELS; l++)
+        {
+            uint64_t bits = occupied[l];
+            if (!bits)
+                continue;
+            uint64_t position = now >> (SLOT_BITS * l);
+            unsigned shift = (unsigned)((position + 1) & (SLOTS - 1));
+            uint64_t rotated = shift ? (bits >> shift) | (bits << (64 - shift)) : bits;
+            uint64_t steps = (uint64_t)__builtin_ctzll(rotated) + 1;
+            uint64_t tick = (position + steps) << (SLOT_BITS * l);
+            if (tick < best)
+                best = tick;
+        }
+        return best;
+    }
+
+    uint64_t tickNs;
+    uint64_t now = 0; // ticks
+    size_t count = 0;
+    uint64_t occupied[LEVELS] = {};
+    TimerNode wheel[LEVELS][SLOTS];
+    TimerNode pending; // slot being expired or cascaded
+};
@@ -0,0 +1,419 @@
+#include <iostream>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <chrono>
+#include <csignal>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "../common/frame.h"
+#include "../common/histogram.h"
+
+using namespace std;
+
+// Open-loop load generator for every chat server variant.
+//
+// Connects `clients` simulated users and JOINs them, then lets the first
+// `senders` of them send timestamped lines at a fixed total `rate`. Each
+// line carries the time it was *scheduled* to be sent, so a server that
+// falls behind shows up as latency instead of as a lower send rate
+// (no coordinated omission). Every copy of a line that reaches any client
+// is timed, giving the end-to-end broadcast latency distribution.
+//
+// Only the text protocol is used, so it runs against all servers as is.
+
+constexpr int DEFAULT_PORT = 1500;
+constexpr int BUF_SIZE = 64 * 1024;
+constexpr int MAX_EVENTS = 256;
+constexpr char STAMP[] = "@ts="; // marks the send timestamp inside a line
+constexpr uint32_t TIMER_EVENT = UINT32_MAX; // epoll tag of the send timer
+
+struct LoadConn
+{
+    int fd = -1;
+    bool sender = false;
+    string outbox; // bytes the socket did not take yet
+    FrameParser parser{FrameMode::Text};
+};
+
+struct WorkerStats
+{
+    Histogram latency; // nanoseconds
+    unsigned long long sent = 0;
+    unsigned long long delivered = 0;
+    unsigned long long unstamped = 0; // join/leave notices and other lines
+    unsigned long long disconnects = 0;
+};
+
+atomic<bool> stop{false};
+chrono::steady_clock::time_point sendStart;
+chrono::steady_clock::time_point measureStart;
+chrono::steady_clock::time_point measureEnd;
+
+uint64_t nowNs()
+{
+    return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t toNs(chrono::steady_clock::time_point t)
+{
+    return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(t.time_since_epoch()).count();
+}
+
+void set_non_blocking(int socket)
+{
+    int flags = fcntl(socket, F_GETFL, 0);
+
+    if (flags == -1)
+    {
+        perror("fcntl F_GETFL");
+        return;
+    }
+
+    if (fcntl(socket, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        perror("fcntl F_SETFL");
+        return;
+    }
+}
+
+int connectTo(const sockaddr_in &addr)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    if (connect(fd, (const sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// Push as much of the outbox as the socket takes
+void flushOutbox(LoadConn &c)
+{
+    while (!c.outbox.empty())
+    {
+        ssize_t n = send(c.fd, c.outbox.data(), c.outbox.size(), MSG_NOSIGNAL);
+        if (n <= 0)
+            return;
+        c.outbox.erase(0, n);
+    }
+}
+
+// Time one received line if it carries a stamp from the measured window
+void onLine(WorkerStats &stats, const char *line, size_t length, uint64_t now,
+            uint64_t fromNs, uint64_t toNs)
+{
+    const char *stamp = (const char *)memmem(line, length, STAMP, sizeof(STAMP) - 1);
+    if (!stamp)
+    {
+        stats.unstamped++;
+        return;
+    }
+
+    uint64_t sentAt = strtoull(stamp + sizeof(STAMP) - 1, nullptr, 10);
+    if (sentAt < fromNs || sentAt >= toNs)
+        return; // warmup or cool-down traffic
+
+    stats.delivered++;
+    stats.latency.record(now > sentAt ? now - sentAt : 0);
+}
+
+void worker(vector<LoadConn> *connsPtr, double ratePerSender, size_t payload, WorkerStats *statsPtr)
+{
+    vector<LoadConn> &conns = *connsPtr;
+    WorkerStats &stats = *statsPtr;
+
+    int epollfd = epoll_create1(0);
+    if (epollfd == -1)
+    {
+        perror("epoll_create1");
+        return;
+    }
+
+    // Fires at the next scheduled send, so lines are not held back by a
+    // coarse epoll_wait timeout
+    int timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerfd == -1)
+    {
+        perror("timerfd_create");
+        close(epollfd);
+        return;
+    }
+    epoll_event tev{};
+    tev.events = EPOLLIN;
+    tev.data.u32 = TIMER_EVENT;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, timerfd, &tev);
+
+    vector<size_t> senders;
+    for (size_t i = 0; i < conns.size(); i++)
+    {
+        set_non_blocking(conns[i].fd);
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u32 = (uint32_t)i;
+        epoll_ctl(epollfd, EPOLL_CTL_ADD, conns[i].fd, &ev);
+        if (conns[i].sender)
+            senders.push_back(i);
+    }
+
+    // Sending starts with the warmup and ends with the measured window
+    uint64_t start = toNs(sendStart);
+    uint64_t from = toNs(measureStart);
+    uint64_t to = toNs(measureEnd);
+    double intervalNs = ratePerSender > 0 ? 1e9 / ratePerSender : 0;
+    unsigned long long scheduled = 0; // per sender, sent on every sender in step
+
+    string padding(payload, 'x');
+    epoll_event events[MAX_EVENTS];
+    const char *frame;
+    size_t length;
+
+    while (!stop.load())
+    {
+        // Send everything that is due. The stamp is the scheduled time, not
+        // the time send() got around to it.
+        uint64_t now = nowNs();
+        while (intervalNs > 0 && !senders.empty())
+        {
+            uint64_t due = start + (uint64_t)(scheduled * intervalNs);
+            if (due >= to)
+                break;
+            if (due > now)
+            {
+                // steady_clock is CLOCK_MONOTONIC, so `due` is an absolute expiry
+                itimerspec when{};
+                when.it_value.tv_sec = (time_t)(due / 1000000000);
+                when.it_value.tv_nsec = (long)(due % 1000000000);
+                timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &when, nullptr);
+                break;
+            }
+            string line = STAMP + to_string(due) + " " + padding + "\n";
+            for (size_t i : senders)
+            {
+                conns[i].outbox += line;
+                flushOutbox(conns[i]);
+                if (due >= from)
+                    stats.sent++;
+            }
+            scheduled++;
+        }
+
+        int nready = epoll_wait(epollfd, events, MAX_EVENTS, 100);
+        if (nready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        now = nowNs();
+        for (int i = 0; i < nready; i++)
+        {
+            if (events[i].data.u32 == TIMER_EVENT)
+            {
+                uint64_t expirations;
+                if (read(timerfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                    perror("read: timerfd");
+                continue;
+            }
+
+            LoadConn &c = conns[events[i].data.u32];
+            ssize_t n = recv(c.fd, c.parser.prepare(BUF_SIZE), BUF_SIZE, 0);
+            if (n <= 0)
+            {
+                if (n < 0 && (errno == EAGAIN || errno == EINTR))
+                    continue;
+                stats.disconnects++;
+                epoll_ctl(epollfd, EPOLL_CTL_DEL, c.fd, nullptr);
+                continue;
+            }
+            c.parser.commit(n);
+            bool pinged = false;
+            while (c.parser.next(frame, length) == FrameParser::Frame)
+            {
+                // Servers with a heartbeat drop clients that never answer
+                if (length == 4 && memcmp(frame, "PING", 4) == 0)
+                    pinged = true;
+                else
+                    onLine(stats, frame, length, now, from, to);
+            }
+            if (pinged)
+            {
+                c.outbox += "PONG\n";
+                flushOutbox(c);
+            }
+        }
+
+        for (size_t i : senders)
+            flushOutbox(conns[i]);
+    }
+
+    for (auto &c : conns)
+    {
+        send(c.fd, "#\n", 2, MSG_NOSIGNAL);
+        close(c.fd);
+    }
+    close(timerfd);
+    close(epollfd);
+}
+
+void usage(const char *prog)
+{
+    cerr << "Usage: " << prog << " [-c clients] [-s senders] [-r rate] [-m bytes] [-d seconds] [-W warmup] [-t threads] [-p port] [host]\n"
+         << "  -c N  simulated clients (default 1000)\n"
+         << "  -s N  clients that send (default 10)\n"
+         << "  -r N  lines per second, summed over all senders (default 100)\n"
+         << "  -m N  payload bytes per line (default 64)\n"
+         << "  -d N  measured seconds (default 10)\n"
+         << "  -W N  warmup seconds, sent but not measured (default 2)\n"
+         << "  -t N  load generator threads (default 2)\n";
+}
+
+int main(int argc, char *argv[])
+{
+    int clientCount = 1000;
+    int senderCount = 10;
+    double rate = 100;
+    size_t payload = 64;
+    int seconds = 10;
+    int warmup = 2;
+    int threadCount = 2;
+    int port = DEFAULT_PORT;
+    const char *host = "127.0.0.1";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:s:r:m:d:W:t:p:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c': clientCount = atoi(optarg); break;
+        case 's': senderCount = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'm': payload = (size_t)atol(optarg); break;
+        case 'd': seconds = atoi(optarg); break;
+        case 'W': warmup = atoi(optarg); break;
+        case 't': threadCount = atoi(optarg); break;
+        case 'p': port = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc)
+        host = argv[optind];
+
+    if (clientCount <= 0 || threadCount <= 0 || senderCount <= 0 ||
+        senderCount > clientCount || rate <= 0 || seconds <= 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+    {
+        cerr << "invalid IPv4 address: " << host << "\n";
+        return 1;
+    }
+
+    // Connect and JOIN every client while the sockets are still blocking.
+    // Servers with a connection limit simply end up with fewer clients.
+    vector<vector<LoadConn>> perThread(threadCount);
+    int connected = 0;
+    for (int i = 0; i < clientCount; i++)
+    {
+        LoadConn c;
+        c.fd = connectTo(addr);
+        if (c.fd < 0)
+            break;
+        c.sender = i < senderCount;
+
+        string join = "JOIN load" + to_string(i) + "\n";
+        send(c.fd, join.c_str(), join.size(), MSG_NOSIGNAL);
+        perThread[i % threadCount].push_back(move(c));
+        connected++;
+    }
+    if (connected < senderCount)
+    {
+        cerr << "only " << connected << " clients connected\n";
+        return 1;
+    }
+
+    // Let the JOIN announcements drain before any line is sent
+    this_thread::sleep_for(chrono::seconds(1));
+
+    sendStart = chrono::steady_clock::now();
+    measureStart = sendStart + chrono::seconds(warmup);
+    measureEnd = measureStart + chrono::seconds(seconds);
+
+    vector<unique_ptr<WorkerStats>> stats;
+    vector<thread> workers;
+    for (auto &conns : perThread)
+    {
+        stats.emplace_back(new WorkerStats());
+        workers.emplace_back(worker, &conns, rate / senderCount, payload, stats.back().get());
+    }
+
+    // Give lines sent at the very end a moment to arrive
+    this_thread::sleep_until(measureEnd + chrono::seconds(1));
+    stop.store(true);
+    for (auto &t : workers)
+        t.join();
+
+    Histogram latency;
+    unsigned long long sent = 0, delivered = 0, disconnects = 0;
+    for (auto &s : stats)
+    {
+        latency.merge(s->latency);
+        sent += s->sent;
+        delivered += s->delivered;
+        disconnects += s->disconnects;
+    }
+
+    // Every line should reach every connected client, its sender included
+    unsigned long long expected = sent * (unsigned long long)connected;
+    auto us = [](uint64_t ns) { return (long long)(ns / 1000); };
+    cout << "clients=" << connected
+         << " senders=" << senderCount
+         << " sent/s=" << (long long)(sent / (double)seconds)
+         << " delivered/s=" << (long long)(delivered / (double)seconds)
+         << " delivered=" << (expected ? 100 * delivered / expected : 0) << "%";
+    if (delivered)
+        cout << " p50=" << us(latency.percentile(0.50)) << "us"
+             << " p99=" << us(latency.percentile(0.99)) << "us"
+             << " p999=" << us(latency.percentile(0.999)) << "us"
+             << " max=" << us(latency.max()) << "us";
+    else
+        cout << " latency=n/a (server relayed nothing)";
+    if (disconnects)
+        cout << " disconnects=" << disconnects;
+    cout << "\n";
+}
@@ -0,0 +1,34 @@
+#!/bin/sh
+# Run the load generator against every server variant, one after another.
+#
+#   ./loadgen.sh [loadgen options...]
+#   VARIANTS="Epoll Polling" ./loadgen.sh -c 2000 -r 5000
+#
+# Builds each server and ./loadgen if needed, starts the server on the
+# default port, runs one measurement and prints one line per variant.
+
+set -e
+cd "$(dirname "$0")"
+
+VARIANTS=${VARIANTS:-"Multithread Non-Blocking Polling Epoll IoUring Coroutine"}
+
+[ loadgen -nt loadgen.cpp ] || g++ -std=c++11 -O2 -pthread loadgen.cpp -o loadgen
+
+for v in $VARIANTS; do
+    dir=../Chat-Program-$v
+    [ -f "$dir/server.cpp" ] || { echo "no such variant: $v" >&2; continue; }
+    std=c++11
+    [ "$v" = Coroutine ] && std=c++20
+    [ "$dir/server" -nt "$dir/server.cpp" ] || g++ -std=$std -O2 -pthread "$dir/server.cpp" -o "$dir/server"
+
+    "$dir/server" </dev/null >/dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+    printf '%-13s ' "$v"
+    ./loadgen "$@" || true
+    kill -INT "$pid" 2>/dev/null || true
+    sleep 1
+    # Blocking variants may sit in accept()/recv() after SIGINT
+    kill -KILL "$pid" 2>/dev/null || true
+    wait "$pid" 2>/dev/null || true
+done